@@ -1,320 +1,4338 @@
+#define _GNU_SOURCE // For mremap
+
 #include "alloc.h"
+#include "profile.h"
+#include "record.h"
+#include "size_classes.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h> // For dprintf
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h> // For the non-temporal stores of clear_block
+#endif
+
+#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+
+#define SMALL_MAX 512 /**< Largest request size whose payload has its own exact size class */
+#define SMALL_SHIFT 9 /**< log2(SMALL_MAX), the first power-of-two bin starts above it */
+#define NUM_SMALL_BINS (SMALL_MAX / ALIGNMENT) /**< One exact bin per multiple of ALIGNMENT */
+#define NUM_LARGE_BINS 32 /**< Power-of-two bins above SMALL_MAX, the last one takes everything bigger */
+#define NUM_BINS (NUM_SMALL_BINS + NUM_LARGE_BINS) /**< Number of segregated free lists */
+
+#define BLOCK_HEADER sizeof(header) /**< Bytes in front of every payload, half of ALIGNMENT */
+#define MIN_PAYLOAD (ALIGNMENT + BLOCK_HEADER) /**< Smallest payload, room for the links and footer of a free block */
+#define SMALL_PAYLOAD (SMALL_MAX + BLOCK_HEADER) /**< Payload of a SMALL_MAX request, the largest with an exact class */
+#define IN_USE 0x1 /**< Set in size while the block is allocated */
+#define PREV_IN_USE 0x2 /**< Set in size while the physically previous block is allocated */
+#define IN_CHUNK 0x4 /**< Set in size when the block lives in an mmap'd chunk instead of the main heap */
+#define MMAPPED 0x8 /**< Set in size when the block is a mapping of its own, freed with munmap */
+#define FLAG_MASK (ALIGNMENT - 1) /**< The low bits of the size word that hold flags instead of size */
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024) /**< Size of a transparent huge page on x86-64 and arm64 */
+#define CORE_RESERVE ((size_t)1 << 30) /**< Address space the main heap reserves at a time, to commit pages from as it grows */
+
+#ifdef TUALLOC_HUGE_PAGES
+#define HEAP_GROWTH HUGE_PAGE_SIZE /**< The main heap always commits up to a multiple of this */
+#define CHUNK_SHIFT 21 /**< log2(CHUNK_SIZE), a chunk is exactly one huge page */
+#else
+#define HEAP_GROWTH (64 * 1024) /**< The main heap always commits up to a multiple of this */
+#define CHUNK_SHIFT 20 /**< log2(CHUNK_SIZE) */
+#endif
+#define CHUNK_SIZE ((size_t)1 << CHUNK_SHIFT) /**< Size and alignment of the chunks backing thread heaps */
+#define CHUNK_HEADER (((sizeof(chunk) + BLOCK_HEADER + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - BLOCK_HEADER) /**< Bytes before the first block of a chunk, which puts its payload on ALIGNMENT */
+#define CHUNK_MAX (CHUNK_SIZE - CHUNK_HEADER - 2 * BLOCK_HEADER) /**< Largest block a chunk can hold */
+
+#ifdef TUALLOC_GUARD_PAGES
+#define DEFAULT_MMAP_THRESHOLD 0 /**< Every block gets its own mapping, ending at a guard page */
+#else
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024) /**< Default size from which blocks get their own mapping */
+#endif
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024) /**< Default size above which free blocks give pages back to the OS */
+#define DEFAULT_TOP_PAD HEAP_GROWTH /**< Default free bytes kept at the top of the main heap */
+#define DEFAULT_MXFAST 128 /**< Default largest request whose blocks go into fast bins */
+#define DEFAULT_FAST_TRIGGER (64 * 1024) /**< Default fast bin bytes that make a heap consolidate */
+#define RELEASE_INTERVAL_NS 1000000000ULL /**< A heap gives memory back on its own at most once per this */
+#define CLEAR_STREAM_MIN (4 * 1024 * 1024) /**< tucalloc zeroes recycled blocks at least this big, well past L2, with non-temporal stores */
+
+#define MAX_HEAPS 64 /**< Threads start sharing heaps once this many exist */
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1 /**< mbind policy: allocate on the given node while it has memory, from <numaif.h> */
+#endif
+
+#ifdef TUALLOC_CANARIES
+#define CANARY_SIZE sizeof(size_t) /**< Every request grows by a word for the canary at the end of its block */
+#else
+#define CANARY_SIZE 0 /**< Without canaries requests keep their size, no room is added */
+#endif
+
+#if defined(TUALLOC_ENCODE_POINTERS) || defined(TUALLOC_CANARIES) || defined(TUALLOC_DOUBLE_FREE_CHECK)
+#define TUALLOC_SECRETS /**< Some check needs random secrets, see init_secrets */
+#endif
+
+#define TCACHE_DEPTH 16 /**< Blocks a thread keeps per size class before it flushes */
+#define TCACHE_BATCH (TCACHE_DEPTH / 2) /**< Blocks moved between a thread cache and the heap at once */
+#define TCACHE_CHUNKS 16 /**< Chunks of its own heap a thread cache remembers for tufree_sized */
+
+/**
+ * Counters of one heap, guarded by its lock like everything they count
+ */
+typedef struct heap_stats {
+    size_t free_blocks[NUM_BINS]; /**< Blocks on each free list */
+    size_t free_bytes; /**< Payload bytes of every block on the free lists */
+    size_t reserved; /**< Bytes committed to the main heap or obtained as chunks */
+    size_t grows; /**< Times an allocation fell through to growing the main heap or a new chunk */
+    size_t splits; /**< Blocks split in two */
+    size_t coalesces; /**< Free neighbors merged */
+    size_t fast_bytes; /**< Payload bytes of every block in the fast bins */
+    size_t consolidations; /**< Times the fast bins were merged into the free lists */
+    size_t consolidated; /**< Blocks taken out of the fast bins by those merges */
+    uint64_t consolidate_ns; /**< Time spent merging */
+    size_t fit_searches; /**< Free list searches */
+    size_t fit_hits; /**< Searches that found a block */
+    size_t fit_steps; /**< Blocks looked at by all searches */
+    size_t fit_max_steps; /**< Most blocks a single search looked at */
+} heap_stats;
+
+/**
+ * A heap: segregated free lists plus what backs them
+ *
+ * Small blocks freed into the heap first wait uncoalesced in its fast bins,
+ * still marked in use, where an allocation of the same size takes them
+ * right back; consolidate merges them into the free lists in a batch.
+ *
+ * The main heap commits pages of a reserved range as it grows, see
+ * grow_main_heap. Every other heap grows with CHUNK_SIZE
+ * aligned chunks, so the heap of any block can be found by masking its
+ * address. Each heap belongs to the threads that allocate from it; blocks
+ * freed by any other thread are pushed onto remote_free with a single CAS
+ * and merged back by an owner the next time it takes the lock in tumalloc.
+ */
+typedef struct heap {
+    pthread_mutex_t lock; /**< Guards every field except remote_free and threads */
+    free_block *bins[NUM_BINS]; /**< Segregated free lists, one per size class */
+    free_block *fast[NUM_SMALL_BINS]; /**< Singly linked blocks freed but not coalesced yet, per small class */
+    uint64_t binmap; /**< Bit i is set while bins[i] is non-empty */
+    free_block *next_fit_ptr[NUM_BINS]; /**< extra cred: where the next search of each power-of-two bin starts */
+#ifdef TUALLOC_ENCODE_POINTERS
+    uintptr_t secret; /**< Random word the free list, thread cache and remote stack links of this heap are XOR'ed with */
+#endif
+#ifdef TUALLOC_BEST_FIT
+    struct tree_block *tree; /**< Root of the tree of free blocks above SMALL_PAYLOAD, which then skip the power-of-two bins */
+#endif
+    struct chunk *chunks; /**< The chunks backing this heap, NULL for the main heap */
+    free_block *remote_free; /**< Lock-free stack of blocks freed by non-owning threads */
+    int threads; /**< Number of threads that own this heap, updated atomically */
+    int node; /**< NUMA node the chunks are bound to, -1 if placed by first touch; never changes */
+    int handle; /**< Nonzero for a heap made by tuheap_create, which no thread adopts; never changes */
+    struct large_link *large; /**< A handle's mappings for blocks above CHUNK_MAX, see handle_large_alloc */
+    size_t handle_held; /**< Payload bytes a handle has handed out and not got back */
+    size_t handle_blocks; /**< Blocks a handle has handed out and not got back */
+    size_t handle_mapped; /**< Bytes of a handle's mappings */
+    struct heap *next_heap; /**< Next heap in the registry */
+    size_t dirty; /**< Bytes freed since the heap last checked whether to release pages */
+    size_t layout_version; /**< Bumped whenever a block boundary goes away, so a tumalloc_dump_layout walk knows to find its place again */
+    uint64_t released_at; /**< CLOCK_MONOTONIC_COARSE time memory was last given back, in nanoseconds */
+    heap_stats stats; /**< Counters, aggregated by tumalloc_stats */
+} heap;
+
+/**
+ * Links at the start of a mapping that holds a large block of a tuheap, so tuheap_destroy can find it
+ */
+typedef struct large_link {
+    struct large_link *next; /**< Next mapping of the same heap */
+    struct large_link *prev; /**< Previous mapping of the same heap, NULL for the first */
+} large_link;
+
+/**
+ * Header at the start of every CHUNK_SIZE aligned chunk
+ */
+typedef struct chunk {
+    heap *owner; /**< The heap this chunk belongs to */
+    struct chunk *next; /**< Next chunk of the same heap */
+    char *untouched; /**< Nothing from here to the end of the chunk was ever handed out, see mark_in_use */
+} chunk;
+
+/**
+ * Header at the start of every stretch of the main heap that was grown in
+ * one reservation, the first block follows it
+ */
+typedef struct heap_segment {
+    struct heap_segment *prev; /**< The segment before, NULL for the first */
+    char *prev_end; /**< Where the segment before ends, final once this one started */
+} heap_segment;
+
+#ifdef TUALLOC_BEST_FIT
+/**
+ * A free block above SMALL_PAYLOAD in a best-fit build, a node of its heap's tree
+ *
+ * The links overlay the payload like those of free_block, there is always
+ * room for them. The tree is a treap ordered by (size, address) whose
+ * priorities are a hash of the address, so it stays balanced in expectation
+ * without storing anything else.
+ */
+typedef struct tree_block {
+    size_t size; /**< Size of the block, same as in free_block */
+    struct tree_block *left; /**< Smaller blocks, or same size at a lower address */
+    struct tree_block *right; /**< Bigger blocks, or same size at a higher address */
+    struct tree_block *parent; /**< NULL for the root */
+} tree_block;
+
+#define FREE_LINKS sizeof(tree_block) /**< Bytes at the start of a free block that hold its header and links */
+#else
+#define FREE_LINKS sizeof(free_block) /**< Bytes at the start of a free block that hold its header and links */
+#endif
+
+/**
+ * Per-thread cache of recently freed small blocks
+ *
+ * Cached blocks stay marked in use as far as the heap is concerned, so they
+ * never coalesce, and are chained through the next field in their payload.
+ * Only blocks of the thread's own heap are ever cached. Only the owner
+ * touches the cache, but it stores count with relaxed atomics so that
+ * tumalloc_stats can read it.
+ *
+ * Chunks never move to another heap, so a chunk the cache was refilled from
+ * keeps holding blocks of the thread's heap, and a block with the caller's
+ * size can be cached by tufree_sized on its address alone.
+ */
+typedef struct tcache {
+    free_block *entries[NUM_SMALL_BINS]; /**< Singly linked cached blocks per small class */
+    unsigned int count[NUM_SMALL_BINS]; /**< Number of blocks in each entry */
+    size_t bytes; /**< Payload bytes of every cached block, which may be bigger than its class, see set_cached_next */
+    uintptr_t chunks[TCACHE_CHUNKS]; /**< Chunks refills took blocks from, indexed by their address, 0 if none */
+} tcache;
+
+/**
+ * Counters of one thread for the paths that don't take a heap lock
+ *
+ * Only the owning thread writes them, with relaxed stores, and
+ * tumalloc_stats reads them with relaxed loads. Byte counts go down for
+ * every block a thread gives back even if another thread took it out, so
+ * they wrap below zero and only the sum over every thread is meaningful.
+ * The thread cache fast paths bump a single counter: cache hits and the
+ * bytes in the cache are worked out from the blocks that went in and out
+ * and from the cache's own counts when tumalloc_stats adds things up.
+ */
+typedef struct thread_stats {
+    size_t requested; /**< Bytes asked for with tumalloc, tucalloc and turealloc */
+    size_t mallocs; /**< Successful allocations the thread cache did not serve */
+    size_t frees; /**< Blocks freed anywhere but into the thread cache */
+    size_t cache_frees; /**< Blocks freed into the thread cache */
+    size_t cache_fills; /**< Blocks moved from the heap into the thread cache */
+    size_t cache_flushes; /**< Blocks moved from the thread cache back to the heap */
+    size_t held; /**< Payload bytes taken from heaps and mappings, for the program or the thread cache */
+    size_t mmapped; /**< Bytes of large mappings made minus those unmapped */
+    size_t mmaps; /**< Large mappings made */
+    tcache *cache; /**< The thread's cache, read by tumalloc_stats under stats_lock */
+    int registered; /**< Nonzero while the counters are on the stats_threads list */
+    struct thread_stats *prev; /**< Neighbors on the stats_threads list */
+    struct thread_stats *next;
+} thread_stats;
+
+static heap main_heap = { .lock = PTHREAD_MUTEX_INITIALIZER, .node = -1 }; /**< The heap grown from reserved address space, first in the registry */
+static char *heap_end = NULL; /**< Right after the main heap's epilogue, guarded by its lock */
+static char *heap_untouched = NULL; /**< Like chunk.untouched for the main heap, guarded by its lock */
+static heap_segment *heap_segments = NULL; /**< Newest segment of the main heap, which ends at heap_end; guarded by its lock */
+static char *core_top = NULL; /**< End of what the main heap committed of its reservation, guarded by its lock */
+static char *core_end = NULL; /**< End of the main heap's reservation, guarded by its lock */
+
+static size_t soft_limit = 0; /**< Set with tumallopt, 0 for none; accessed atomically */
+static size_t committed = 0; /**< Bytes counted against soft_limit, accessed atomically */
+static size_t pressure_events = 0; /**< Allocations that had to trim or call the low-memory handler, accessed atomically */
+static tualloc_low_memory_fn low_memory_fn = NULL; /**< Set with tumalloc_set_low_memory_handler, guarded by heaps_lock */
+static void *low_memory_arg = NULL; /**< Passed to low_memory_fn, guarded by heaps_lock */
+
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD; /**< Set with tumallopt, accessed atomically */
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD; /**< Set with tumallopt, accessed atomically */
+static size_t top_pad = DEFAULT_TOP_PAD; /**< Set with tumallopt, accessed atomically */
+static size_t fast_limit = SIZE_CLASS_CEIL(((DEFAULT_MXFAST + CANARY_SIZE + BLOCK_HEADER + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - BLOCK_HEADER); /**< payload_size(TU_M_MXFAST), 0 for no fast bins; set with tumallopt, accessed atomically */
+static size_t fast_trigger = DEFAULT_FAST_TRIGGER; /**< Set with tumallopt, accessed atomically */
+
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER; /**< Guards the registry and the heap count */
+static int num_heaps = 1; /**< Heaps in the registry, the main heap included */
+
+static _Thread_local heap *thread_heap; /**< The heap this thread allocates from, NULL until its first tumalloc */
+static _Thread_local tcache thread_cache; /**< This thread's cache, no locking needed */
+static pthread_key_t thread_key; /**< Only used to flush and release a thread's heap when it exits */
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local thread_stats thread_counters; /**< This thread's counters */
+static _Thread_local free_block *zeroed_block; /**< The block this thread last marked in use */
+static _Thread_local char *zeroed_from; /**< Where the payload of zeroed_block is known to read as zeroes, but for its last word */
+static _Thread_local int relieving; /**< Set while this thread trims or runs the low-memory handler for a failed allocation */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; /**< Guards stats_threads and retired_stats */
+static thread_stats *stats_threads = NULL; /**< Counters of every live thread that allocated or freed */
+static thread_stats retired_stats; /**< Sum of the counters of threads that exited */
+static pthread_key_t stats_key; /**< Folds a thread's counters into retired_stats when it exits */
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+#ifdef TUALLOC_CANARIES
+static uintptr_t canary_secret; /**< XOR'ed with a block's address for the canary in its last word, set by init_secrets */
+#endif
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+static uintptr_t pending_key; /**< Second payload word of every block waiting in a thread cache or on a remote stack, set by init_secrets */
+#endif
+
+/**
+ * Get the payload size stored in a size word
+ *
+ * The word holds the whole span of the block, header included, which is a
+ * multiple of ALIGNMENT and leaves the low bits free for the flags. The
+ * epilogue spans nothing and must never be asked for its size.
+ *
+ * @param size_word The size word, flags included
+ * @return The size of the payload in bytes
+ */
+static inline size_t word_size(size_t size_word) {
+    return (size_word & ~(size_t)FLAG_MASK) - BLOCK_HEADER;
+}
+
+/**
+ * Get the size word for a payload size, without any flags
+ *
+ * @param size The payload size, BLOCK_HEADER short of a multiple of ALIGNMENT
+ * @return What goes into the header, to be or'ed with the flags
+ */
+static inline size_t size_to_word(size_t size) {
+    return size + BLOCK_HEADER;
+}
+
+_Static_assert(SIZE_CLASS_BINS == NUM_SMALL_BINS && SIZE_CLASS_MAX_PAYLOAD == SMALL_PAYLOAD,
+               "size_classes.h was generated for other small bins");
+
+/**
+ * Round a requested size up to the payload size of a block
+ *
+ * Headers sit BLOCK_HEADER in front of an ALIGNMENT boundary, so every
+ * payload is BLOCK_HEADER short of a multiple of ALIGNMENT and the next
+ * header fits in the padding. Small sizes are rounded further, to their
+ * size class, with one load from the generated table.
+ *
+ * A TUALLOC_CANARIES build adds a word for the canary first.
+ *
+ * @param size The requested size, at most PTRDIFF_MAX
+ * @return The payload size, at least MIN_PAYLOAD
+ */
+static inline size_t payload_size(size_t size) {
+    size += CANARY_SIZE;
+    if (size <= SMALL_PAYLOAD) {
+        return size_class_payload[(size + BLOCK_HEADER - 1) / ALIGNMENT];
+    }
+    return ((size + BLOCK_HEADER + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - BLOCK_HEADER;
+}
+
+/**
+ * Get the payload size of a block without its flag bits
+ *
+ * @param block The block
+ * @return The size of the payload in bytes
+ */
+static inline size_t block_size(free_block *block) {
+    return word_size(block->size);
+}
+
+/**
+ * Check whether a block is the epilogue that ends its heap or chunk
+ *
+ * @param block The block
+ * @return Nonzero for the epilogue, whose size word spans nothing
+ */
+static inline int is_epilogue(free_block *block) {
+    return (block->size & ~(size_t)FLAG_MASK) == 0;
+}
+
+/**
+ * Get the size word of an allocated block from outside the heap lock
+ *
+ * A neighbor may be flipping PREV_IN_USE in the same word meanwhile, so the
+ * word is loaded atomically.
+ *
+ * @param block The allocated block
+ * @return The size word, flags included
+ */
+static inline size_t allocated_size_word(free_block *block) {
+    return __atomic_load_n(&block->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the payload size of an allocated block from outside the heap lock
+ *
+ * @param block The allocated block
+ * @return The size of the payload in bytes
+ */
+static inline size_t allocated_size(free_block *block) {
+    return word_size(allocated_size_word(block));
+}
+
+/**
+ * Find the heap a block belongs to
+ *
+ * @param block The block
+ * @param size_word Its size word, IN_CHUNK never changes over a block's life
+ * @return The heap whose lock guards the block
+ */
+static inline heap *heap_of(free_block *block, size_t size_word) {
+    if (!(size_word & IN_CHUNK)) {
+        return &main_heap;
+    }
+    return ((chunk *)((uintptr_t)block & ~(uintptr_t)(CHUNK_SIZE - 1)))->owner;
+}
+
+/**
+ * Get the block that physically follows a block
+ *
+ * @param block The block
+ * @return The next block in memory, the epilogue if block is the last one
+ */
+static inline free_block *next_block(free_block *block) {
+    return (free_block *)((char *)block + BLOCK_HEADER + block_size(block));
+}
+
+/**
+ * Get the block that physically precedes a block
+ *
+ * Only valid when PREV_IN_USE is clear, since only free blocks have a footer.
+ *
+ * @param block The block
+ * @return The previous block in memory
+ */
+static inline free_block *prev_block(free_block *block) {
+    size_t prev_size = *((size_t *)block - 1);
+    return (free_block *)((char *)block - prev_size - BLOCK_HEADER);
+}
+
+/**
+ * Set or clear PREV_IN_USE in a block's header
+ *
+ * The block may be allocated and owned by another thread that reads its size
+ * without the heap lock, so the flag is flipped atomically.
+ *
+ * @param block The block whose header to update
+ * @param in_use Whether its predecessor is now allocated
+ */
+static inline void set_prev_in_use(free_block *block, int in_use) {
+    if (in_use) {
+        __atomic_fetch_or(&block->size, (size_t)PREV_IN_USE, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&block->size, ~(size_t)PREV_IN_USE, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Write the boundary tag of a free block into the last word of its payload
+ *
+ * @param block The free block
+ */
+static inline void set_footer(free_block *block) {
+    *((size_t *)next_block(block) - 1) = block_size(block);
+}
+
+#ifdef TUALLOC_SECRETS
+/**
+ * Report corruption a hardening check found and abort
+ *
+ * Nothing is allocated on the way out, the heap can't be trusted any more.
+ *
+ * @param what What was found, the start of the message
+ * @param ptr Where it was found
+ */
+static void corrupted(const char *what, const void *ptr) {
+    dprintf(STDERR_FILENO, "tualloc: %s %p\n", what, ptr);
+    abort();
+}
+#endif
+
+/**
+ * Encode a link for storing it in a free or cached block
+ *
+ * A TUALLOC_ENCODE_POINTERS build XORs links with the heap's secret, so a
+ * write through a dangling pointer can't plant an address for the heap to
+ * hand out later.
+ *
+ * @param h The heap the block belongs to
+ * @param link The block to link to, or NULL
+ * @return What to store
+ */
+static inline free_block *link_encode(heap *h, free_block *link) {
+#ifdef TUALLOC_ENCODE_POINTERS
+    return (free_block *)((uintptr_t)link ^ h->secret);
+#else
+    (void)h;
+    return link;
+#endif
+}
+
+/**
+ * Decode a link stored in a free or cached block
+ *
+ * Every block starts BLOCK_HEADER in front of an ALIGNMENT boundary, so in
+ * a TUALLOC_ENCODE_POINTERS build a decoded link that doesn't is corruption
+ * and aborts.
+ *
+ * @param h The heap the block belongs to
+ * @param stored What link_encode stored
+ * @return The block linked to, or NULL
+ */
+static inline free_block *link_decode(heap *h, free_block *stored) {
+#ifdef TUALLOC_ENCODE_POINTERS
+    free_block *link = (free_block *)((uintptr_t)stored ^ h->secret);
+    if (__builtin_expect(((uintptr_t)link & FLAG_MASK) != BLOCK_HEADER && link != NULL, 0)) {
+        corrupted("corrupted free list link to", link);
+    }
+    return link;
+#else
+    (void)h;
+    return stored;
+#endif
+}
+
+/**
+ * Get the block after a block on a free list, thread cache or remote stack
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @return The next block, NULL after the last one
+ */
+static inline free_block *get_next(heap *h, free_block *block) {
+    return link_decode(h, block->next);
+}
+
+/**
+ * Set the block after a block on a free list, thread cache or remote stack
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @param next The next block, NULL for none
+ */
+static inline void set_next(heap *h, free_block *block, free_block *next) {
+    block->next = link_encode(h, next);
+}
+
+/**
+ * Get the block before a block on a free list
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @return The previous block, NULL for the first one
+ */
+static inline free_block *get_prev(heap *h, free_block *block) {
+    return link_decode(h, block->prev);
+}
+
+/**
+ * Set the block before a block on a free list
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @param prev The previous block, NULL for none
+ */
+static inline void set_prev(heap *h, free_block *block, free_block *prev) {
+    block->prev = link_encode(h, prev);
+}
+
+/**
+ * Mark a block that waits in a thread cache or on a remote stack
+ *
+ * Such a block is still in use as far as its heap is concerned, so a
+ * TUALLOC_DOUBLE_FREE_CHECK build stores pending_key in its second payload
+ * word, right behind the link, for check_not_pending to find.
+ *
+ * @param block The block
+ */
+static inline void mark_pending(free_block *block) {
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+    block->prev = (free_block *)pending_key;
+#else
+    (void)block;
+#endif
+}
+
+/**
+ * Take the mark of mark_pending off a block that is handed out or goes back to its heap
+ *
+ * @param block The block
+ */
+static inline void clear_pending(free_block *block) {
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+    block->prev = NULL;
+#else
+    (void)block;
+#endif
+}
+
+/**
+ * Abort if a block about to be freed already waits in a thread cache or on a remote stack
+ *
+ * Only a program that stores the random pending_key itself could trip this
+ * by mistake. Does nothing unless built with TUALLOC_DOUBLE_FREE_CHECK.
+ *
+ * @param block The block
+ */
+static inline void check_not_pending(free_block *block) {
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+    if (__builtin_expect((uintptr_t)block->prev == pending_key, 0)) {
+        corrupted("double free of", (char *)block + BLOCK_HEADER);
+    }
+#else
+    (void)block;
+#endif
+}
+
+/**
+ * Write the canary into the last word of a block that is handed out, in a TUALLOC_CANARIES build
+ *
+ * The canary is the block's address XOR'ed with canary_secret, payload_size
+ * made room for it.
+ *
+ * @param ptr The payload
+ */
+static inline void set_canary(void *ptr) {
+#ifdef TUALLOC_CANARIES
+    free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+    *(size_t *)((char *)ptr + allocated_size(block) - sizeof(size_t)) = canary_secret ^ (uintptr_t)block;
+#else
+    (void)ptr;
+#endif
+}
+
+/**
+ * Abort if the canary of a block about to be freed was overwritten, in a TUALLOC_CANARIES build
+ *
+ * @param block The block
+ * @param size_word Its size word
+ */
+static inline void check_canary(free_block *block, size_t size_word) {
+#ifdef TUALLOC_CANARIES
+    size_t *canary = (size_t *)((char *)block + BLOCK_HEADER + word_size(size_word)) - 1;
+    if (__builtin_expect(*canary != (canary_secret ^ (uintptr_t)block), 0)) {
+        corrupted("write past the end of", (char *)block + BLOCK_HEADER);
+    }
+#else
+    (void)block;
+    (void)size_word;
+#endif
+}
+
+/**
+ * Run every hardening check that is compiled in on a block about to be freed
+ *
+ * A block that is not in use was freed already, or never was a block.
+ *
+ * @param block The block
+ * @param size_word Its size word
+ */
+static inline void check_free(free_block *block, size_t size_word) {
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+    if (__builtin_expect(!(size_word & IN_USE), 0)) {
+        corrupted("double free of", (char *)block + BLOCK_HEADER);
+    }
+#endif
+    check_not_pending(block);
+    check_canary(block, size_word);
+}
+
+/**
+ * Find the size class of a block
+ *
+ * Sizes up to SMALL_PAYLOAD have an exact class each, larger sizes share
+ * the power-of-two bin [2^k, 2^(k+1)) they fall into.
+ *
+ * @param size The payload size of the block
+ * @return The index of the bin that holds blocks of this size
+ */
+static int bin_index(size_t size) {
+    if (size <= SMALL_PAYLOAD) {
+        return (int)((size - BLOCK_HEADER) / ALIGNMENT) - 1;
+    }
+
+    int bin = NUM_SMALL_BINS + (63 - __builtin_clzll(size)) - SMALL_SHIFT;
+    return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+/**
+ * Get the smallest payload size a size class holds
+ *
+ * @param bin The size class
+ * @return The smallest size in bytes
+ */
+static size_t bin_min_size(int bin) {
+    if (bin < NUM_SMALL_BINS) {
+        return (size_t)(bin + 1) * ALIGNMENT + BLOCK_HEADER;
+    }
+    return bin == NUM_SMALL_BINS ? SMALL_PAYLOAD + ALIGNMENT : (size_t)1 << (bin - NUM_SMALL_BINS + SMALL_SHIFT);
+}
+
+/**
+ * Link a block into a thread cache class
+ *
+ * Bit 0 of the stored link, always clear in a block address and so the
+ * same in every link encoded with one heap's secret, is flipped for a block
+ * counted with more bytes than its class holds: the slack a split left it.
+ * Everything else is counted at its class's size, so only those blocks have
+ * their header read when they leave the cache.
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @param next The block cached before it, NULL for none
+ * @param bytes The payload bytes it was counted with in the cache's bytes
+ * @param bin Its class
+ */
+static inline void set_cached_next(heap *h, free_block *block, free_block *next, size_t bytes, int bin) {
+    block->next = (free_block *)((uintptr_t)link_encode(h, next) ^ (bytes > bin_min_size(bin)));
+}
+
+/**
+ * Get the block cached after a block, the link set_cached_next stored
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @return The next block of the class, NULL after the last one
+ */
+static inline free_block *get_cached_next(heap *h, free_block *block) {
+    uintptr_t slack = ((uintptr_t)block->next ^ (uintptr_t)link_encode(h, NULL)) & 1;
+    return link_decode(h, (free_block *)((uintptr_t)block->next ^ slack));
+}
+
+/**
+ * Get the payload bytes a cached block was counted with, see set_cached_next
+ *
+ * @param h The heap the block belongs to
+ * @param block The block
+ * @param bin Its class
+ * @return Its payload size if it has slack, its class's size otherwise
+ */
+static inline size_t cached_bytes(heap *h, free_block *block, int bin) {
+    int slack = (((uintptr_t)block->next ^ (uintptr_t)link_encode(h, NULL)) & 1) != 0;
+    return slack ? block_size(block) : bin_min_size(bin);
+}
+
+/**
+ * Find the first non-empty bin at or above a given bin
+ *
+ * @param h The heap to look in
+ * @param bin The bin to start looking from
+ * @return The index of a non-empty bin or -1 if there is none
+ */
+static int next_nonempty_bin(heap *h, int bin) {
+    if (bin >= NUM_BINS) {
+        return -1;
+    }
+
+    uint64_t mask = h->binmap & (~0ULL << bin);
+    return mask ? __builtin_ctzll(mask) : -1;
+}
+
+#ifdef TUALLOC_BEST_FIT
+/**
+ * Get the treap priority of a tree block, parents always have a higher one than their children
+ *
+ * @param node The block
+ * @return A hash of its address
+ */
+static inline uint64_t tree_priority(tree_block *node) {
+    return ((uint64_t)(uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * Check whether one tree block orders before another
+ *
+ * @param a A block
+ * @param b Another block
+ * @return 1 if a is smaller, or the same size at a lower address
+ */
+static inline int tree_less(tree_block *a, tree_block *b) {
+    size_t a_size = a->size & ~(size_t)FLAG_MASK;
+    size_t b_size = b->size & ~(size_t)FLAG_MASK;
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * Put a node in the place of its parent, which becomes its child
+ *
+ * @param h The heap whose tree holds the node
+ * @param node A node that has a parent
+ */
+static void tree_rotate_up(heap *h, tree_block *node) {
+    tree_block *parent = node->parent;
+    tree_block *grandparent = parent->parent;
+
+    if (parent->left == node) {
+        parent->left = node->right;
+        if (node->right != NULL) {
+            node->right->parent = parent;
+        }
+        node->right = parent;
+    } else {
+        parent->right = node->left;
+        if (node->left != NULL) {
+            node->left->parent = parent;
+        }
+        node->left = parent;
+    }
+    parent->parent = node;
+
+    node->parent = grandparent;
+    if (grandparent == NULL) {
+        h->tree = node;
+    } else if (grandparent->left == parent) {
+        grandparent->left = node;
+    } else {
+        grandparent->right = node;
+    }
+}
+
+/**
+ * Add a free block to a heap's tree
+ *
+ * @param h The heap the block belongs to
+ * @param node The block, with its size set
+ */
+static void tree_insert(heap *h, tree_block *node) {
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+
+    // An ordinary search tree insert as a leaf...
+    tree_block **link = &h->tree;
+    while (*link != NULL) {
+        node->parent = *link;
+        link = tree_less(node, *link) ? &(*link)->left : &(*link)->right;
+    }
+    *link = node;
+
+    // ...then up until the heap order of the priorities holds again
+    uint64_t priority = tree_priority(node);
+    while (node->parent != NULL && tree_priority(node->parent) < priority) {
+        tree_rotate_up(h, node);
+    }
+}
+
+/**
+ * Take a free block out of a heap's tree
+ *
+ * @param h The heap the block belongs to
+ * @param node A block in the tree
+ */
+static void tree_remove(heap *h, tree_block *node) {
+    // Rotate the node down below its higher priority child until it is a leaf
+    while (node->left != NULL || node->right != NULL) {
+        tree_block *child;
+        if (node->left == NULL) {
+            child = node->right;
+        } else if (node->right == NULL) {
+            child = node->left;
+        } else {
+            child = tree_priority(node->left) > tree_priority(node->right) ? node->left : node->right;
+        }
+        tree_rotate_up(h, child);
+    }
+
+    if (node->parent == NULL) {
+        h->tree = NULL;
+    } else if (node->parent->left == node) {
+        node->parent->left = NULL;
+    } else {
+        node->parent->right = NULL;
+    }
+}
+
+/**
+ * Find the tightest fit in a heap's tree
+ *
+ * @param h The heap to search
+ * @param size The payload size to find
+ * @param steps Incremented for every node looked at
+ * @return The smallest block of at least size bytes, the lowest address among equals, or NULL if none fits
+ */
+static tree_block *tree_best_fit(heap *h, size_t size, size_t *steps) {
+    tree_block *fit = NULL;
+    tree_block *node = h->tree;
+
+    while (node != NULL) {
+        (*steps)++;
+        if (word_size(node->size) >= size) {
+            // Fits, but something smaller on the left may fit too
+            fit = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return fit;
+}
+
+/**
+ * Get the next node of a tree in preorder, every node before its children
+ *
+ * @param node A node of the tree
+ * @return The next node or NULL after the last one
+ */
+static tree_block *tree_next(tree_block *node) {
+    if (node->left != NULL) {
+        return node->left;
+    }
+    if (node->right != NULL) {
+        return node->right;
+    }
+
+    // Climb until we come up from a left subtree whose parent has a right subtree
+    while (node->parent != NULL) {
+        tree_block *parent = node->parent;
+        if (parent->left == node && parent->right != NULL) {
+            return parent->right;
+        }
+        node = parent;
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Push a block onto the free list of its size class
+ *
+ * @param h The heap the block belongs to
+ * @param block The block to add
+ */
+static void insert_free_block(heap *h, free_block *block) {
+    int bin = bin_index(block_size(block));
+
+    h->stats.free_blocks[bin]++;
+    h->stats.free_bytes += block_size(block);
+
+#ifdef TUALLOC_BEST_FIT
+    if (bin >= NUM_SMALL_BINS) {
+        tree_insert(h, (tree_block *)block);
+        return;
+    }
+#endif
+
+    free_block *first = h->bins[bin];
+    set_prev(h, block, NULL);
+    set_next(h, block, first);
+    if (first != NULL) {
+        set_prev(h, first, block);
+    }
+    h->bins[bin] = block;
+    h->binmap |= 1ULL << bin;
+}
+
+/**
+ * Remove a block from the free list
+ *
+ * @param h The heap the block belongs to
+ * @param block The block to remove
+ */
+void remove_free_block(heap *h, free_block *block) {
+    int bin = bin_index(block_size(block));
+
+    h->stats.free_blocks[bin]--;
+    h->stats.free_bytes -= block_size(block);
+
+#ifdef TUALLOC_BEST_FIT
+    if (bin >= NUM_SMALL_BINS) {
+        tree_remove(h, (tree_block *)block);
+        return;
+    }
+#endif
+
+    free_block *prev = get_prev(h, block);
+    free_block *next = get_next(h, block);
+    if (prev != NULL) {
+        set_next(h, prev, next);
+    } else {
+        h->bins[bin] = next;
+    }
+    if (next != NULL) {
+        set_prev(h, next, prev);
+    }
+
+    // Never leave the next fit pointer on a block that is no longer free
+    if (h->next_fit_ptr[bin] == block) {
+        h->next_fit_ptr[bin] = next;
+    }
+
+    if (h->bins[bin] == NULL) {
+        h->binmap &= ~(1ULL << bin);
+    }
+}
+
+/**
+ * Find the previous neighbor of a block
+ *
+ * @param block The block to find the previous neighbor of
+ * @return A pointer to the previous neighbor or NULL if it is not free
+ */
+free_block *find_prev(free_block *block) {
+    if (block->size & PREV_IN_USE) {
+        return NULL;
+    }
+    return prev_block(block);
+}
+
+/**
+ * Find the next neighbor of a block
+ *
+ * @param block The block to find the next neighbor of
+ * @return A pointer to the next neighbor or NULL if it is not free
+ */
+free_block *find_next(free_block *block) {
+    free_block *next = next_block(block);
+    if (next->size & IN_USE) {
+        return NULL;
+    }
+    return next;
+}
+
+/**
+ * Coalesce neighboring free blocks
+ *
+ * The block must be free (IN_USE clear) and not on a free list yet. It is
+ * merged with whichever physical neighbors are free and the result is put on
+ * the free list of its size class.
+ *
+ * @param h The heap the block belongs to
+ * @param block The block to coalesce
+ * @return A pointer to the first block of the coalesced blocks
+ */
+void *coalesce(heap *h, free_block *block) {
+    if (block == NULL) {
+        return NULL;
+    }
+
+    free_block *prev = find_prev(block);
+    free_block *next = find_next(block);
+
+    // Coalesce with previous block if it is free; it keeps its own PREV_IN_USE bit.
+    if (prev != NULL) {
+        remove_free_block(h, prev);
+        prev->size += block_size(block) + BLOCK_HEADER;
+        block = prev; // Update block to point to the new coalesced block.
+        h->stats.coalesces++;
+        h->layout_version++;
+    }
+
+    // Coalesce with next block if it is free.
+    if (next != NULL) {
+        remove_free_block(h, next);
+        block->size += block_size(next) + BLOCK_HEADER;
+        h->stats.coalesces++;
+        h->layout_version++;
+    }
+
+    // Let the following block know its neighbor is free and where it starts
+    set_footer(block);
+    set_prev_in_use(next_block(block), 0);
+
+    insert_free_block(h, block);
+
+    return block;
+}
+
+/**
+ * Split a block into two blocks
+ *
+ * The first block keeps its flags and is the one handed out, the remainder
+ * becomes a free block and is coalesced with whatever follows it.
+ *
+ * @param h The heap the block belongs to
+ * @param block The block to split, it must not be on a free list
+ * @param size The size of the first new split block
+ * @return A pointer to the first block or NULL if the block cannot be split
+ */
+void *split(heap *h, free_block *block, size_t size) {
+    if((block_size(block) < size + BLOCK_HEADER + MIN_PAYLOAD)) {
+        return NULL;
+    }
+
+    void *split_pnt = (char *)block + size + BLOCK_HEADER;
+    free_block *new_block = (free_block *) split_pnt;
+
+    new_block->size = size_to_word(block_size(block) - size - BLOCK_HEADER) | PREV_IN_USE | (block->size & IN_CHUNK);
+    block->size = size_to_word(size) | (block->size & FLAG_MASK);
+    h->stats.splits++;
+
+    coalesce(h, new_block);
+
+    return block;
+}
+
+/**
+ * Get where the memory that was never handed out starts in the heap or chunk of a block
+ *
+ * Everything from there on still reads as the zeroes mmap or mprotect handed
+ * over, except for the header, links and footer of the free block it lies
+ * in: memory past the mark only ever was part of that one free block.
+ *
+ * Must be called with the lock of the block's heap held.
+ *
+ * @param block A block of the main heap or of a chunk
+ * @return The mark of the main heap or of the block's chunk
+ */
+static inline char **untouched_mark(free_block *block) {
+    if (!(block->size & IN_CHUNK)) {
+        return &heap_untouched;
+    }
+    return &((chunk *)((uintptr_t)block & ~(uintptr_t)(CHUNK_SIZE - 1)))->untouched;
+}
+
+/**
+ * Move the untouched mark of a block's heap or chunk past a block that is handed out
+ *
+ * Must be called with the lock of the block's heap held.
+ *
+ * @param block The block, already at the size it is handed out with
+ * @return Where the block's payload reads as zeroes but for its last word, past its end if nowhere
+ */
+static inline char *touch(free_block *block) {
+    char **mark = untouched_mark(block);
+    char *zero = *mark + FREE_LINKS;
+    char *end = (char *)next_block(block);
+    if (end > *mark) {
+        *mark = end;
+    }
+    return zero;
+}
+
+/**
+ * Mark a block as allocated in its own header and in its successor's
+ *
+ * Also remembers how much of it is known to be zero, for tucalloc.
+ *
+ * @param block The block being handed out
+ * @return The payload of the block
+ */
+static void *mark_in_use(free_block *block) {
+    block->size |= IN_USE;
+    set_prev_in_use(next_block(block), 1);
+    zeroed_from = touch(block);
+    zeroed_block = block;
+    return (char *)block + BLOCK_HEADER;
+}
+
+/**
+ * Take a block of at least size bytes off the bins
+ *
+ * Exact small classes are a single pop, the power-of-two bin of a large size
+ * is searched next fit style, and any bigger non-empty bin is guaranteed to
+ * fit so its first block is taken. In a best-fit build every block above
+ * SMALL_PAYLOAD lives in the tree instead, which hands out the tightest fit.
+ *
+ * @param h The heap to search
+ * @param size The aligned size to find
+ * @return A block that is no longer on the free lists or NULL if none fits
+ */
+static free_block *find_fit(heap *h, size_t size) {
+    int bin = bin_index(size);
+    size_t steps = 0;
+    free_block *block = NULL;
+
+    h->stats.fit_searches++;
+
+#ifdef TUALLOC_BEST_FIT
+    // Only the small bins are in the binmap, and any of them is a tighter fit than the tree
+    int fit = bin < NUM_SMALL_BINS ? next_nonempty_bin(h, bin) : -1;
+    if (fit >= 0) {
+        steps++;
+        block = h->bins[fit];
+        remove_free_block(h, block);
+    } else {
+        block = (free_block *)tree_best_fit(h, size, &steps);
+        if (block != NULL) {
+            remove_free_block(h, block);
+        }
+    }
+#else
+    if (bin >= NUM_SMALL_BINS && h->bins[bin] != NULL) {
+        // Blocks in a power-of-two bin may still be too small, search from the next fit pointer
+        free_block *start = h->next_fit_ptr[bin] ? h->next_fit_ptr[bin] : h->bins[bin];
+        free_block *curr = start;
+
+        do {
+            steps++;
+            if (block_size(curr) >= size) {
+                remove_free_block(h, curr);
+                h->next_fit_ptr[bin] = get_next(h, curr);
+                block = curr;
+                break;
+            }
+
+            // Wrap around to cover the blocks before the starting block
+            free_block *next = get_next(h, curr);
+            curr = next ? next : h->bins[bin];
+        } while (curr != start);
+    }
+
+    if (block == NULL) {
+        // Any block in the exact small bin or in a bigger bin fits, just take the first one
+        int fit = h->bins[bin] != NULL && bin < NUM_SMALL_BINS ? bin : next_nonempty_bin(h, bin + 1);
+        if (fit >= 0) {
+            steps++;
+            block = h->bins[fit];
+            remove_free_block(h, block);
+        }
+    }
+#endif
+
+    h->stats.fit_steps += steps;
+    if (steps > h->stats.fit_max_steps) {
+        h->stats.fit_max_steps = steps;
+    }
+    if (block != NULL) {
+        h->stats.fit_hits++;
+    }
+    return block;
+}
+
+/**
+ * Ask for huge pages to back a range, in a TUALLOC_HUGE_PAGES build
+ *
+ * Errors are ignored: without transparent huge pages the range simply keeps
+ * small pages.
+ *
+ * @param addr The start of the range, page aligned
+ * @param length The length of the range in bytes
+ */
+static inline void advise_huge(void *addr, size_t length) {
+#ifdef TUALLOC_HUGE_PAGES
+    madvise(addr, length, MADV_HUGEPAGE);
+#else
+    (void)addr;
+    (void)length;
+#endif
+}
+
+/**
+ * Count memory against the soft limit before it is committed or mapped
+ *
+ * @param bytes How much
+ * @return 0 on success, -1 if it would go past TU_M_SOFT_LIMIT
+ */
+static int charge(size_t bytes) {
+    size_t limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+    if (limit == 0) {
+        __atomic_fetch_add(&committed, bytes, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    size_t old = __atomic_load_n(&committed, __ATOMIC_RELAXED);
+    do {
+        if (bytes > limit || old > limit - bytes) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&committed, &old, old + bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * Stop counting memory that was decommitted or unmapped
+ *
+ * @param bytes How much
+ */
+static inline void uncharge(size_t bytes) {
+    __atomic_fetch_sub(&committed, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Map memory for blocks, counted against the soft limit
+ *
+ * @param length Bytes to map
+ * @return The mapping, or NULL if it would go past the limit or mmap failed
+ */
+static char *map_memory(size_t length) {
+    if (charge(length) != 0) {
+        return NULL;
+    }
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        uncharge(length);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * Unmap memory that map_memory counted, or part of it
+ *
+ * @param addr The start, page aligned
+ * @param length Bytes to unmap
+ */
+static void unmap_memory(void *addr, size_t length) {
+    munmap(addr, length);
+    uncharge(length);
+}
+
+/**
+ * Reserve a fresh range of address space for the main heap to commit from
+ *
+ * The range is mapped inaccessible and without swap reservation, so it
+ * costs nothing until pages are committed. What is left of the previous
+ * reservation is given back, the segment in it can't grow any more. Takes
+ * CORE_RESERVE, or less when the address space is limited, but at least need.
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param need Bytes the reservation must hold, a multiple of HEAP_GROWTH
+ * @return 0 on success, -1 if not even need could be reserved
+ */
+static int core_reserve(size_t need) {
+    size_t length = need > CORE_RESERVE ? need : CORE_RESERVE;
+    char *map;
+    for (;;) {
+        // Another HEAP_GROWTH to align the start, so commits never split a huge page
+        map = mmap(NULL, length + HEAP_GROWTH, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map != MAP_FAILED) {
+            break;
+        }
+        if (length == need) {
+            return -1;
+        }
+        length = length / 2 > need ? (length / 2) & ~(HEAP_GROWTH - 1) : need;
+    }
+
+    char *start = (char *)(((uintptr_t)map + HEAP_GROWTH - 1) & ~(uintptr_t)(HEAP_GROWTH - 1));
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    munmap(start + length, map + HEAP_GROWTH - start);
+
+    if (core_top < core_end) {
+        munmap(core_top, core_end - core_top);
+    }
+    core_top = start;
+    core_end = start + length;
+    return 0;
+}
+
+/**
+ * Commit the next pages of the reservation
+ *
+ * Must be called with the main heap's lock held, and the pages charged.
+ *
+ * @param incr Bytes to commit, so the reservation ends up committed to a multiple of HEAP_GROWTH
+ * @return 0 on success, -1 if the kernel refused
+ */
+static int core_commit(size_t incr) {
+    if (mprotect(core_top, incr, PROT_READ | PROT_WRITE) != 0) {
+        return -1;
+    }
+    core_top += incr;
+    return 0;
+}
+
+/**
+ * Give the last committed pages of the reservation back to the OS
+ *
+ * Mapping fresh inaccessible pages over them drops their contents and
+ * their commit charge in one call.
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param release Bytes to decommit, a multiple of HEAP_GROWTH
+ * @return 0 on success, -1 if the kernel refused
+ */
+static int core_decommit(size_t release) {
+    char *start = core_top - release;
+    if (mmap(start, release, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return -1;
+    }
+    core_top = start;
+    uncharge(release);
+    return 0;
+}
+
+/**
+ * Commit more of the main heap's reservation
+ *
+ * When the reservation has room after the heap, the old epilogue becomes
+ * the header of the new block, so the new memory coalesces with a free
+ * block at the top of the heap and only the missing part is committed.
+ * Otherwise (first call, or the reservation is full) a new segment is
+ * started in a fresh reservation. Either way the heap ends on a multiple
+ * of HEAP_GROWTH, so segments start on one too.
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param size The size the free block at the top of the heap must reach
+ * @return The free block at the top of the heap, still on the free lists, or NULL if it would go past the soft limit or no memory could be committed
+ */
+static free_block *grow_main_heap(size_t size) {
+    if (size > PTRDIFF_MAX / 2) {
+        return NULL;
+    }
+
+    char *brk = core_top;
+    char *segment = brk;
+    free_block *new_block;
+    size_t prev_in_use;
+    size_t incr = 0;
+
+    if (brk == heap_end && brk != NULL) {
+        // Reuse the epilogue as the new block's header
+        new_block = (free_block *)(heap_end - BLOCK_HEADER);
+        prev_in_use = new_block->size & PREV_IN_USE;
+
+        size_t top_free = 0;
+        if (!prev_in_use) {
+            top_free = block_size(prev_block(new_block)) + BLOCK_HEADER;
+        }
+        size_t need = size > top_free ? size - top_free : 0;
+        incr = need > ALIGNMENT ? need : ALIGNMENT;
+        incr += BLOCK_HEADER; // Room for the new epilogue
+
+        // Keep the end on a multiple of HEAP_GROWTH, so trimming and growing never split a huge page
+        incr = (((uintptr_t)brk + incr + HEAP_GROWTH - 1) & ~(uintptr_t)(HEAP_GROWTH - 1)) - (uintptr_t)brk;
+        if (incr > (size_t)(core_end - core_top)) {
+            incr = 0; // The reservation is full, start over in a new one
+        }
+    }
+    if (incr == 0) {
+        // Start a new segment at the start of a fresh reservation
+        incr = (sizeof(heap_segment) + ALIGNMENT + size + BLOCK_HEADER + HEAP_GROWTH - 1) & ~(HEAP_GROWTH - 1);
+        if (charge(incr) != 0) {
+            return NULL; // Before giving up what is left of the old reservation
+        }
+        if (core_reserve(incr) != 0) {
+            uncharge(incr);
+            return NULL;
+        }
+        brk = segment = core_top;
+        new_block = (free_block *)(segment + sizeof(heap_segment) + ALIGNMENT - BLOCK_HEADER); // So the payload is aligned
+        prev_in_use = PREV_IN_USE;
+    } else if (charge(incr) != 0) {
+        return NULL;
+    }
+
+    if (core_commit(incr) != 0) {
+        uncharge(incr);
+        return NULL;
+    }
+    if (brk != heap_end) {
+        heap_segment *link = (heap_segment *)segment;
+        link->prev = heap_segments;
+        link->prev_end = heap_end;
+        heap_segments = link;
+        heap_untouched = (char *)new_block;
+    }
+    advise_huge(segment, brk + incr - segment);
+    heap_end = brk + incr;
+    main_heap.stats.reserved += incr;
+
+    new_block->size = size_to_word(heap_end - (char *)new_block - 2 * BLOCK_HEADER) | prev_in_use;
+
+    // The epilogue is a bare allocated header that stops every walk
+    free_block *epilogue = (free_block *)(heap_end - BLOCK_HEADER);
+    epilogue->size = IN_USE;
+
+    // Merge with a free block at the top of the heap
+    free_block *top = coalesce(&main_heap, new_block);
+    if (top != new_block) {
+        // The old footer and epilogue are in the middle of the block now, clear them so it stays zero past the untouched mark
+        size_t *footer = (size_t *)new_block - 1;
+        if ((char *)footer >= (char *)top + FREE_LINKS) {
+            *footer = 0;
+        }
+        memset(new_block, 0, BLOCK_HEADER);
+    }
+    return top;
+}
+
+/**
+ * Grow the main heap to allocate a block the free lists had no room for
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the allocated memory
+ */
+void *do_alloc(size_t size) {
+    free_block *block = grow_main_heap(size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    // Carve the request out of the top of the heap
+    remove_free_block(&main_heap, block);
+    split(&main_heap, block, size);
+
+    return mark_in_use(block);
+}
+
+/**
+ * Check whether the main heap can grow right after a block
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param block The last block that would have to touch the new memory
+ * @return 1 if block is the last block of the heap and the reservation has pages after it
+ */
+static int at_heap_top(free_block *block) {
+    return heap_end != NULL && next_block(block) == (free_block *)(heap_end - BLOCK_HEADER)
+        && core_top == heap_end;
+}
+
+/**
+ * Get the number of NUMA nodes
+ *
+ * Read from sysfs without stdio, which might allocate. Machines without
+ * NUMA support have a single node.
+ *
+ * @return The highest online node plus one, at most TU_MAX_NODES
+ */
+static int node_count(void) {
+    // Like page_size, threads may race to fill the cache with the same value
+    static int count = 0;
+    int nodes = __atomic_load_n(&count, __ATOMIC_RELAXED);
+    if (nodes != 0) {
+        return nodes;
+    }
+
+    nodes = 1;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        // A list of ranges such as "0-3" or "0,2-3", the last number is the highest node
+        char buf[256];
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+
+        int last = 0;
+        for (ssize_t i = 0; i < len; i++) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                last = (i > 0 && buf[i - 1] >= '0' && buf[i - 1] <= '9' ? last * 10 : 0) + (buf[i] - '0');
+            }
+        }
+        nodes = last + 1 < TU_MAX_NODES ? last + 1 : TU_MAX_NODES;
+    }
+
+    __atomic_store_n(&count, nodes, __ATOMIC_RELAXED);
+    return nodes;
+}
+
+/**
+ * Get the NUMA node of the CPU this thread is running on
+ *
+ * @return The node, 0 if the kernel can't tell
+ */
+static int current_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= TU_MAX_NODES) {
+        return 0;
+    }
+    return (int)node;
+}
+
+/**
+ * Ask the kernel to back a range with memory of one NUMA node
+ *
+ * MPOL_PREFERRED falls back to other nodes when the node runs out instead of
+ * failing the page fault. Must be called before the pages are first touched.
+ * Errors are ignored, the memory then is placed by first touch.
+ *
+ * @param addr The start of the range, page aligned
+ * @param length The length of the range in bytes
+ * @param node The node
+ */
+static void bind_to_node(void *addr, size_t length, int node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
+
+/**
+ * Map CHUNK_SIZE bytes aligned to CHUNK_SIZE
+ *
+ * Mapping twice the size and trimming the ends gets the alignment. A
+ * TUALLOC_HUGE_PAGES build first tries an explicit hugetlb page, which the
+ * kernel aligns by itself, and gives up on them for good once none are left;
+ * otherwise it asks for a transparent huge page.
+ *
+ * @return The chunk or NULL if mmap failed
+ */
+static char *map_chunk(void) {
+#ifdef TUALLOC_HUGE_PAGES
+    static int no_hugetlb = 0;
+    if (!__atomic_load_n(&no_hugetlb, __ATOMIC_RELAXED)) {
+        char *huge = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED && (uintptr_t)huge % CHUNK_SIZE == 0) {
+            return huge;
+        }
+        // No pool reserved, or a default huge page size other than 2 MiB
+        if (huge != MAP_FAILED) {
+            munmap(huge, CHUNK_SIZE);
+        }
+        __atomic_store_n(&no_hugetlb, 1, __ATOMIC_RELAXED);
+    }
+#endif
+
+    char *map = mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *start = (char *)(((uintptr_t)map + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1));
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    munmap(start + CHUNK_SIZE, map + CHUNK_SIZE - start);
+
+    advise_huge(start, CHUNK_SIZE);
+    return start;
+}
+
+/**
+ * Map a fresh CHUNK_SIZE aligned chunk for a heap and allocate from it
+ *
+ * A chunk holds a single free block between the chunk header and an
+ * epilogue.
+ *
+ * @param h The heap to grow, not the main heap
+ * @param size The aligned size to allocate, at most CHUNK_MAX
+ * @return A pointer to the allocated memory or NULL if it would go past the soft limit or mmap failed
+ */
+static void *chunk_alloc(heap *h, size_t size) {
+    if (charge(CHUNK_SIZE) != 0) {
+        return NULL;
+    }
+    char *start = map_chunk();
+    if (start == NULL) {
+        uncharge(CHUNK_SIZE);
+        return NULL;
+    }
+
+    if (h->node >= 0) {
+        bind_to_node(start, CHUNK_SIZE, h->node);
+    }
+
+    chunk *c = (chunk *)start;
+    c->owner = h;
+    c->next = h->chunks;
+    c->untouched = start + CHUNK_HEADER;
+    h->chunks = c;
+    h->stats.reserved += CHUNK_SIZE;
+
+    free_block *block = (free_block *)(start + CHUNK_HEADER);
+    block->size = size_to_word(CHUNK_MAX) | PREV_IN_USE | IN_CHUNK;
+
+    free_block *epilogue = next_block(block);
+    epilogue->size = IN_USE | IN_CHUNK;
+
+    coalesce(h, block);
+    remove_free_block(h, block);
+    split(h, block, size);
+
+    return mark_in_use(block);
+}
+
+/**
+ * Get the size of a page
+ *
+ * @return The page size in bytes
+ */
+static size_t page_size(void) {
+    // Threads may race to fill the cache, they all store the same value
+    static size_t size = 0;
+    size_t page = __atomic_load_n(&size, __ATOMIC_RELAXED);
+    if (page == 0) {
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        __atomic_store_n(&size, page, __ATOMIC_RELAXED);
+    }
+    return page;
+}
+
+/**
+ * Get the granularity memory goes back to the OS in
+ *
+ * A TUALLOC_HUGE_PAGES build only gives back whole huge pages, so releasing
+ * memory never splits one into small pages.
+ *
+ * @return The size in bytes, a power of two
+ */
+static inline size_t release_unit(void) {
+#ifdef TUALLOC_HUGE_PAGES
+    return HUGE_PAGE_SIZE;
+#else
+    return page_size();
+#endif
+}
+
+/**
+ * Decommit the free block at the top of the main heap
+ *
+ * Only whole pages go back and at least pad bytes stay free at the top. Does
+ * nothing if the top isn't the end of what the reservation committed.
+ *
+ * Must be called with the main heap's lock held.
+ *
+ * @param pad Free bytes to keep at the top of the heap
+ * @return The number of bytes released
+ */
+static size_t trim_top(size_t pad) {
+    if (heap_end == NULL) {
+        return 0;
+    }
+
+    free_block *epilogue = (free_block *)(heap_end - BLOCK_HEADER);
+    if (epilogue->size & PREV_IN_USE) {
+        return 0;
+    }
+
+    free_block *top = prev_block(epilogue);
+    if (block_size(top) <= pad) {
+        return 0;
+    }
+
+    // The top block keeps at least MIN_PAYLOAD bytes so it stays a valid block
+    size_t keep = pad > MIN_PAYLOAD ? pad : MIN_PAYLOAD;
+    size_t release = (block_size(top) - keep) & ~(release_unit() - 1);
+    if (release == 0 || core_top != heap_end) {
+        return 0;
+    }
+
+    // The block changes size, so it changes bins
+    remove_free_block(&main_heap, top);
+    if (core_decommit(release) != 0) {
+        insert_free_block(&main_heap, top);
+        return 0;
+    }
+    heap_end -= release;
+    main_heap.stats.reserved -= release;
+    main_heap.layout_version++;
+
+    top->size -= release;
+    set_footer(top);
+    epilogue = (free_block *)(heap_end - BLOCK_HEADER);
+    epilogue->size = IN_USE;
+    insert_free_block(&main_heap, top);
+
+    return release;
+}
+
+/**
+ * Give the physical pages inside a free block back to the OS with madvise
+ *
+ * The header, the free list links and the footer stay where they are, only
+ * the whole pages between them are released. The block keeps its place in
+ * the heap and reads as zeroes where it was released once it is handed out again.
+ *
+ * @param block A free block
+ * @return The number of bytes released
+ */
+static size_t release_pages(free_block *block) {
+    uintptr_t mask = release_unit() - 1;
+    char *lo = (char *)(((uintptr_t)block + FREE_LINKS + mask) & ~mask);
+    char *hi = (char *)(((uintptr_t)next_block(block) - sizeof(size_t)) & ~mask);
+    if (hi <= lo) {
+        return 0;
+    }
+
+    // MADV_FREE would leave the pages counted in RSS until memory runs low
+    if (madvise(lo, hi - lo, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    return hi - lo;
+}
+
+/**
+ * Release the pages inside the free blocks of a heap that are bigger than min_size
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap
+ * @param min_size Blocks of this size or smaller keep their pages
+ * @return The number of bytes released
+ */
+static size_t release_free_pages(heap *h, size_t min_size) {
+    size_t released = 0;
+
+#ifdef TUALLOC_BEST_FIT
+    // Blocks with whole pages inside are all above SMALL_PAYLOAD, so they are all in the tree
+    for (tree_block *node = h->tree; node != NULL; node = tree_next(node)) {
+        if (block_size((free_block *)node) > min_size) {
+            released += release_pages((free_block *)node);
+        }
+    }
+#else
+    // Only the large bins can hold blocks with whole pages inside
+    int first = bin_index(min_size > SMALL_PAYLOAD ? min_size : SMALL_PAYLOAD + ALIGNMENT);
+    for (int bin = first; bin < NUM_BINS; bin++) {
+        for (free_block *block = h->bins[bin]; block != NULL; block = get_next(h, block)) {
+            if (block_size(block) > min_size) {
+                released += release_pages(block);
+            }
+        }
+    }
+#endif
+
+    return released;
+}
+
+/**
+ * Give a heap's free memory back to the OS if enough was freed since the last time and the last time was long enough ago
+ *
+ * The top of the main heap is decommitted down to top_pad free bytes
+ * once it is bigger than the trim threshold, and the pages inside every
+ * other free block bigger than the threshold are released. Freed memory is
+ * often allocated again right away and giving it back would only buy
+ * syscalls and page faults, so a heap does this at most once per
+ * RELEASE_INTERVAL_NS; the clock is only read once per trim threshold freed.
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap
+ * @param freed Bytes just freed into the heap
+ */
+static void maybe_release(heap *h, size_t freed) {
+    size_t threshold = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+
+    h->dirty += freed;
+    if (h->dirty <= threshold) {
+        return;
+    }
+    h->dirty = 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    if (h->released_at != 0 && now - h->released_at < RELEASE_INTERVAL_NS) {
+        return;
+    }
+
+    h->released_at = now;
+    if (h == &main_heap && heap_end != NULL) {
+        free_block *epilogue = (free_block *)(heap_end - BLOCK_HEADER);
+        if (!(epilogue->size & PREV_IN_USE) && block_size(prev_block(epilogue)) > threshold) {
+            trim_top(__atomic_load_n(&top_pad, __ATOMIC_RELAXED));
+        }
+    }
+    release_free_pages(h, threshold);
+}
+
+/**
+ * Sort a list of blocks linked through next by address
+ *
+ * A top-down merge sort, which needs no memory but O(log n) stack.
+ *
+ * @param h The heap the blocks belong to
+ * @param list The first block of the list
+ * @return The first block of the sorted list
+ */
+static free_block *sort_by_address(heap *h, free_block *list) {
+    if (list == NULL || get_next(h, list) == NULL) {
+        return list;
+    }
+
+    // Cut the list in half, fast runs to the end twice as quickly as slow
+    free_block *slow = list;
+    free_block *fast = get_next(h, list);
+    while (fast != NULL && get_next(h, fast) != NULL) {
+        slow = get_next(h, slow);
+        fast = get_next(h, get_next(h, fast));
+    }
+    free_block *second = get_next(h, slow);
+    set_next(h, slow, NULL);
+
+    free_block *a = sort_by_address(h, list);
+    free_block *b = sort_by_address(h, second);
+
+    free_block *head = NULL;
+    free_block *tail = NULL;
+    while (a != NULL || b != NULL) {
+        free_block *lowest;
+        if (b == NULL || (a != NULL && a < b)) {
+            lowest = a;
+            a = get_next(h, a);
+        } else {
+            lowest = b;
+            b = get_next(h, b);
+        }
+        if (tail == NULL) {
+            head = lowest;
+        } else {
+            set_next(h, tail, lowest);
+        }
+        tail = lowest;
+    }
+    set_next(h, tail, NULL);
+    return head;
+}
+
+/**
+ * Merge every block in a heap's fast bins into its free lists
+ *
+ * The blocks go through coalesce in address order, so a run of freed
+ * neighbors grows one block front to back instead of being merged in
+ * whatever order it was freed in. The time it takes shows up in the stats.
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap
+ */
+static void consolidate(heap *h) {
+    if (h->stats.fast_bytes == 0) {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // One list out of every fast bin
+    free_block *list = NULL;
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        free_block *block = h->fast[bin];
+        while (block != NULL) {
+            free_block *next = get_next(h, block);
+            set_next(h, block, list);
+            list = block;
+            block = next;
+        }
+        h->fast[bin] = NULL;
+    }
+    list = sort_by_address(h, list);
+
+    size_t count = 0;
+    while (list != NULL) {
+        free_block *block = list;
+        list = get_next(h, block);
+
+        // A neighbor later in the list is still in use, it merges with this block when its turn comes
+        clear_pending(block);
+        block->size &= ~(size_t)IN_USE;
+        coalesce(h, block);
+        count++;
+    }
+
+    size_t freed = h->stats.fast_bytes;
+    h->stats.fast_bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    h->stats.consolidations++;
+    h->stats.consolidated += count;
+    h->stats.consolidate_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec
+                               - (uint64_t)start.tv_nsec;
+
+    maybe_release(h, freed);
+}
+
+/**
+ * Return a block to its heap
+ *
+ * Blocks up to fast_limit go into the heap's fast bins as they are and the
+ * bins are consolidated once they hold more than fast_trigger bytes. Bigger
+ * blocks are merged with their free neighbors right away.
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap the block belongs to
+ * @param block The allocated block to free
+ */
+static void heap_free(heap *h, free_block *block) {
+    size_t freed = block_size(block);
+
+    if (freed <= __atomic_load_n(&fast_limit, __ATOMIC_RELAXED)) {
+        // Stays in use, so nothing merges with it until consolidate
+        int bin = bin_index(freed);
+        set_next(h, block, h->fast[bin]);
+        mark_pending(block);
+        h->fast[bin] = block;
+        h->stats.fast_bytes += freed;
+
+        if (h->stats.fast_bytes > __atomic_load_n(&fast_trigger, __ATOMIC_RELAXED)) {
+            consolidate(h);
+        }
+        return;
+    }
+
+    // Coalescing may bury the mark in the middle of a bigger block, where a later block's payload could start
+    clear_pending(block);
+
+    // Merge with free neighbors right away and put the result on its free list
+    block->size &= ~(size_t)IN_USE;
+    coalesce(h, block);
+
+    maybe_release(h, freed);
+}
+
+/**
+ * Free every block other threads have pushed onto a heap's remote stack
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap to drain
+ */
+static void drain_remote(heap *h) {
+    if (__atomic_load_n(&h->remote_free, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    free_block *block = __atomic_exchange_n(&h->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        free_block *next = get_next(h, block);
+        heap_free(h, block);
+        block = next;
+    }
+}
+
+/**
+ * Free blocks that belong to a heap this thread does not own
+ *
+ * The blocks are pushed onto the heap's remote stack with one CAS, an owner
+ * merges them later. A heap nobody owns any more has no one to drain it, so
+ * the blocks are freed under its (uncontended) lock instead. The last owner
+ * may leave between the check and the push; then either its final drain in
+ * thread_exit sees the push or the check after it sees the owner gone, and
+ * the stack is drained here.
+ *
+ * @param h The heap the blocks belong to
+ * @param first The first allocated block to free, linked to the others through next
+ * @param last The last block to free, first itself for a single block
+ */
+static void remote_free(heap *h, free_block *first, free_block *last) {
+    if (__atomic_load_n(&h->threads, __ATOMIC_ACQUIRE) == 0) {
+        pthread_mutex_lock(&h->lock);
+        for (free_block *block = first, *next; block != last; block = next) {
+            next = get_next(h, block);
+            heap_free(h, block);
+        }
+        heap_free(h, last);
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+
+    free_block *head = __atomic_load_n(&h->remote_free, __ATOMIC_RELAXED);
+    do {
+        set_next(h, last, head);
+    } while (!__atomic_compare_exchange_n(&h->remote_free, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Pairs with the fence in thread_exit: one side or the other sees what the other did
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->threads, __ATOMIC_RELAXED) == 0) {
+        pthread_mutex_lock(&h->lock);
+        drain_remote(h);
+        pthread_mutex_unlock(&h->lock);
+    }
+}
+
+/**
+ * Grow or shrink an allocated block without moving it
+ *
+ * Shrinking splits off the tail once it is at least a quarter of the block.
+ * Growing absorbs the following block if it is free, after extending the
+ * main heap when that block (or the block itself) is at the top.
+ *
+ * Must be called with the heap's lock held.
+ *
+ * @param h The heap the block belongs to
+ * @param block The allocated block
+ * @param size The new aligned size
+ * @return 1 if the block now holds size bytes, 0 if it has to move
+ */
+static int resize_in_place(heap *h, free_block *block, size_t size) {
+    size_t old_size = block_size(block);
+
+    if (size <= old_size) {
+        // Keep small slack, a buffer that shrinks a little tends to grow back
+        if (old_size - size >= old_size / 4) {
+            split(h, block, size);
+        }
+        return 1;
+    }
+
+    free_block *next = find_next(block);
+    size_t available = old_size + (next != NULL ? block_size(next) + BLOCK_HEADER : 0);
+
+    if (available < size && h == &main_heap && at_heap_top(next != NULL ? next : block)) {
+        // grow_main_heap makes the top free block, which becomes our next block, big enough
+        size_t missing = size - old_size;
+        if (grow_main_heap(missing > BLOCK_HEADER ? missing - BLOCK_HEADER : ALIGNMENT) != NULL) {
+            next = find_next(block);
+            available = old_size + (next != NULL ? block_size(next) + BLOCK_HEADER : 0);
+        }
+    }
+
+    if (available < size) {
+        return 0;
+    }
+
+    remove_free_block(h, next);
+    block->size += block_size(next) + BLOCK_HEADER;
+    set_prev_in_use(next_block(block), 1);
+    h->layout_version++;
+
+    // Give back whatever the absorbed block had beyond the request
+    split(h, block, size);
+    touch(block);
+    return 1;
+}
+
+/**
+ * Allocate a block from a heap
+ *
+ * Must be called with the heap's lock held. Blocks other threads freed
+ * remotely are merged back first.
+ *
+ * @param h The heap to allocate from
+ * @param size The aligned size to allocate
+ * @return A pointer to the payload or NULL if the OS is out of memory
+ */
+static void *heap_alloc(heap *h, size_t size) {
+    TRACE(TU_TRACE_NEXT_FIT, h->next_fit_ptr[bin_index(size)], size);
+
+    drain_remote(h);
+
+    // A block of this very size freed recently is handed out again as it is
+    if (size <= SMALL_PAYLOAD && h->fast[bin_index(size)] != NULL) {
+        int bin = bin_index(size);
+        free_block *block = h->fast[bin];
+        h->fast[bin] = get_next(h, block);
+        h->stats.fast_bytes -= size;
+        h->stats.fit_searches++;
+        h->stats.fit_hits++;
+        h->stats.fit_steps++;
+        clear_pending(block);
+        return mark_in_use(block);
+    }
+
+    // Look for a free block in the size class bins
+    free_block *curr = find_fit(h, size);
+    if (curr == NULL && h->stats.fast_bytes != 0) {
+        // Merging the fast bins may make room before the heap has to grow
+        consolidate(h);
+        curr = find_fit(h, size);
+    }
+    if (curr != NULL) {
+        // Split the block if it's larger than the requested size
+        split(h, curr, size);
+        return mark_in_use(curr);
+    }
+
+    // If no free block is found, allocate new memory from the OS
+    h->stats.grows++;
+    if (h == &main_heap) {
+        return do_alloc(size);
+    }
+    return chunk_alloc(h, size);
+}
+
+/**
+ * Add to one of this thread's counters
+ *
+ * Only the owning thread writes its counters, so a relaxed load and store
+ * are enough and cost no more than a plain increment.
+ *
+ * @param counter The counter
+ * @param n How much to add, negative amounts wrap around
+ */
+static inline void stat_add(size_t *counter, size_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Fold an exiting thread's counters into retired_stats and forget them
+ *
+ * Runs as the thread-specific data destructor of stats_key.
+ *
+ * @param arg The exiting thread's counters
+ */
+static void stats_thread_exit(void *arg) {
+    thread_stats *st = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    retired_stats.requested += st->requested;
+    retired_stats.mallocs += st->mallocs;
+    retired_stats.frees += st->frees;
+    retired_stats.cache_frees += st->cache_frees;
+    retired_stats.cache_fills += st->cache_fills;
+    retired_stats.cache_flushes += st->cache_flushes;
+    retired_stats.held += st->held;
+    retired_stats.mmapped += st->mmapped;
+    retired_stats.mmaps += st->mmaps;
+
+    if (st->prev != NULL) {
+        st->prev->next = st->next;
+    } else {
+        stats_threads = st->next;
+    }
+    if (st->next != NULL) {
+        st->next->prev = st->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    // A later free from another destructor, or flushing the cache, registers the thread again from zero
+    *st = (thread_stats){ 0 };
+}
+
+/**
+ * Create the key whose destructor retires a thread's counters
+ */
+static void stats_key_create(void) {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/**
+ * Put this thread's counters on the stats_threads list
+ *
+ * @param st This thread's counters
+ */
+static void stats_register(thread_stats *st) {
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_setspecific(stats_key, st);
+
+    st->cache = &thread_cache;
+
+    pthread_mutex_lock(&stats_lock);
+    st->prev = NULL;
+    st->next = stats_threads;
+    if (stats_threads != NULL) {
+        stats_threads->prev = st;
+    }
+    stats_threads = st;
+    st->registered = 1;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get this thread's counters, registering them on first use
+ *
+ * @return This thread's counters
+ */
+static inline thread_stats *my_stats(void) {
+    thread_stats *st = &thread_counters;
+    if (!st->registered) {
+        stats_register(st);
+    }
+    return st;
+}
+
+/**
+ * Give every block in a thread cache back to the heap it was filled from
+ *
+ * @param cache The calling thread's cache
+ * @param h The calling thread's heap
+ */
+static void tcache_flush(tcache *cache, heap *h) {
+    thread_stats *st = my_stats();
+    size_t flushed = 0;
+
+    pthread_mutex_lock(&h->lock);
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        while (cache->entries[bin] != NULL) {
+            free_block *block = cache->entries[bin];
+            cache->entries[bin] = get_cached_next(h, block);
+            flushed += block_size(block);
+            heap_free(h, block);
+        }
+        stat_add(&st->cache_flushes, cache->count[bin]);
+        __atomic_store_n(&cache->count[bin], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&cache->bytes, 0, __ATOMIC_RELAXED);
+    drain_remote(h);
+    pthread_mutex_unlock(&h->lock);
+
+    stat_add(&st->held, -flushed);
+}
+
+/**
+ * Give every block in a thread cache back to the thread's heap and release the heap
+ *
+ * Runs as the thread-specific data destructor when a thread exits.
+ *
+ * @param arg The exiting thread's cache
+ */
+static void thread_exit(void *arg) {
+    heap *h = thread_heap;
+    tcache *cache = arg;
+    tcache_flush(cache, h);
+
+    // From now on frees into this heap take its lock, until another thread adopts it
+    if (__atomic_fetch_sub(&h->threads, 1, __ATOMIC_ACQ_REL) == 1) {
+        // Blocks pushed after the flush drained the stack have no one else to merge them, see remote_free for the ones still in flight
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&h->lock);
+        drain_remote(h);
+        pthread_mutex_unlock(&h->lock);
+    }
+    thread_heap = NULL;
+    memset(cache->chunks, 0, sizeof(cache->chunks)); // A heap adopted later has other chunks
+
+    record_thread_exit();
+    TRACE_THREAD_EXIT();
+}
+
+/**
+ * Take every allocator lock before fork, so the child gets them in a consistent state
+ *
+ * The order is the one tumalloc_stats uses: the registry, each heap, then
+ * the thread counters, after the profiler's lock, which is held while it
+ * allocates.
+ */
+static void fork_prepare(void) {
+    profile_fork_lock();
+    pthread_mutex_lock(&heaps_lock);
+    for (heap *h = &main_heap; h != NULL; h = h->next_heap) {
+        pthread_mutex_lock(&h->lock);
+    }
+    pthread_mutex_lock(&stats_lock);
+}
+
+/**
+ * Release the locks fork_prepare took, in the parent after fork
+ */
+static void fork_parent(void) {
+    pthread_mutex_unlock(&stats_lock);
+    for (heap *h = &main_heap; h != NULL; h = h->next_heap) {
+        pthread_mutex_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&heaps_lock);
+    profile_fork_unlock();
+}
+
+/**
+ * Release the locks fork_prepare took, in the child after fork
+ *
+ * Only the forking thread lives on in the child, so every other heap is
+ * left without owners; their frees take the lock from now on and the heaps
+ * can be adopted again. Blocks other threads had cached are lost.
+ */
+static void fork_child(void) {
+    fork_parent();
+    for (heap *h = &main_heap; h != NULL; h = h->next_heap) {
+        __atomic_store_n(&h->threads, h == thread_heap, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Create the key whose destructor releases a thread's cache and heap, and make fork safe
+ */
+static void thread_key_create(void) {
+    pthread_key_create(&thread_key, thread_exit);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+#ifdef TUALLOC_SECRETS
+/**
+ * Get a random word for a secret
+ *
+ * Falls back to the clock and the stack address without getrandom.
+ *
+ * @return A random word, never 0
+ */
+static uintptr_t random_word(void) {
+    uintptr_t word;
+    if (getrandom(&word, sizeof(word), GRND_NONBLOCK) != (ssize_t)sizeof(word)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        word = ((uintptr_t)ts.tv_nsec ^ ((uintptr_t)ts.tv_sec << 32) ^ (uintptr_t)&word) * 0x9E3779B97F4A7C15ULL;
+    }
+    return word != 0 ? word : 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * Pick the secrets of the hardening checks, before the first block is handed out
+ *
+ * Must be called with heaps_lock held. Every other thread reads the secrets
+ * only after it took heaps_lock in attach_heap, or after it got a block
+ * from a thread that did.
+ */
+static void init_secrets(void) {
+    static int ready = 0;
+    if (ready) {
+        return;
+    }
+    ready = 1;
+
+#ifdef TUALLOC_ENCODE_POINTERS
+    main_heap.secret = random_word();
+#endif
+#ifdef TUALLOC_CANARIES
+    canary_secret = random_word();
+#endif
+#ifdef TUALLOC_DOUBLE_FREE_CHECK
+    pending_key = random_word();
+#endif
+}
+#endif
+
+/**
+ * Create an empty heap that grows in chunks and add it to the registry
+ *
+ * Must be called with heaps_lock held.
+ *
+ * @param node The NUMA node to bind its chunks to, -1 for none
+ * @param handle Nonzero for a tuheap, which does not count towards MAX_HEAPS
+ * @return The new heap or NULL if mmap failed
+ */
+static heap *heap_new(int node, int handle) {
+    heap *h = mmap(NULL, sizeof(heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&h->lock, NULL);
+    h->node = node;
+    h->handle = handle;
+#ifdef TUALLOC_ENCODE_POINTERS
+    h->secret = random_word();
+#endif
+
+    h->next_heap = main_heap.next_heap;
+    main_heap.next_heap = h;
+    num_heaps += !handle;
+    return h;
+}
+
+/**
+ * Find the least shared heap bound to a NUMA node
+ *
+ * Heaps made by tuheap_create are never picked. Must be called with
+ * heaps_lock held.
+ *
+ * @param node The node, -1 for the heaps placed by first touch
+ * @param fewest Where to store how many threads own the heap found
+ * @return The heap, NULL if there is none on the node
+ */
+static heap *least_shared_heap(int node, int *fewest) {
+    heap *h = NULL;
+    for (heap *curr = &main_heap; curr != NULL; curr = curr->next_heap) {
+        int threads = __atomic_load_n(&curr->threads, __ATOMIC_ACQUIRE);
+        if (curr->node == node && !curr->handle && (h == NULL || threads < *fewest)) {
+            h = curr;
+            *fewest = threads;
+        }
+    }
+    return h;
+}
+
+/**
+ * Pick the heap this thread allocates from
+ *
+ * A heap no thread owns is adopted first (the main heap is the first one),
+ * then a new heap is created until MAX_HEAPS exist, after which the least
+ * shared heap is used. On a NUMA machine only heaps bound to the node the
+ * thread runs on are candidates, so its memory is local and freed blocks go
+ * back to that node; the main heap, placed by first touch, is left alone.
+ *
+ * @return The heap now owned by this thread
+ */
+static heap *attach_heap(void) {
+    int node = node_count() > 1 ? current_node() : -1;
+
+    pthread_mutex_lock(&heaps_lock);
+
+#ifdef TUALLOC_SECRETS
+    init_secrets();
+#endif
+
+    int fewest = 0;
+    heap *h = least_shared_heap(node, &fewest);
+
+    if ((h == NULL || fewest > 0) && num_heaps < MAX_HEAPS) {
+        heap *fresh = heap_new(node, 0);
+        if (fresh != NULL) {
+            h = fresh;
+        }
+    }
+
+    if (h == NULL) {
+        // Nothing on this node and no room for another heap, share the main heap rather than fail
+        h = &main_heap;
+    }
+
+    __atomic_fetch_add(&h->threads, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&heaps_lock);
+
+    // Set first: when this is malloc, the pthread calls below may call it again
+    thread_heap = h;
+
+    // Release the cache and the heap when the thread exits
+    pthread_once(&thread_key_once, thread_key_create);
+    pthread_setspecific(thread_key, &thread_cache);
+
+    // The allocation fast paths count without checking for this
+    my_stats();
+
+    return h;
+}
+
+/**
+ * Get this thread's heap, picking one on first use
+ *
+ * @return The heap this thread allocates from
+ */
+static inline heap *get_thread_heap(void) {
+    heap *h = thread_heap;
+    return h != NULL ? h : attach_heap();
+}
+
+/**
+ * Allocate a block of any size from a heap, taking its lock
+ *
+ * Chunks cannot hold blocks above CHUNK_MAX, those come from the main heap.
+ *
+ * @param h The heap to allocate from
+ * @param size The aligned size to allocate
+ * @return A pointer to the payload or NULL if the OS is out of memory
+ */
+static void *locked_alloc(heap *h, size_t size) {
+    if (size > CHUNK_MAX) {
+        h = &main_heap;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    void *ptr = heap_alloc(h, size);
+    pthread_mutex_unlock(&h->lock);
+
+    if (ptr != NULL) {
+        stat_add(&thread_counters.mallocs, 1);
+        stat_add(&thread_counters.held, allocated_size((free_block *)((char *)ptr - BLOCK_HEADER)));
+    }
+    return ptr;
+}
+
+/**
+ * Allocate a block aligned to more than a header from a heap, taking its lock
+ *
+ * A block with room for the payload at any offset is allocated, then the
+ * slack in front of the aligned payload goes back to the heap as a free block
+ * of its own and the tail is split off as usual, so nothing is wasted.
+ *
+ * @param h The heap to allocate from
+ * @param size The aligned size to allocate
+ * @param align The alignment, a power of two above ALIGNMENT
+ * @return A pointer to the payload or NULL if the OS is out of memory
+ */
+static void *aligned_locked_alloc(heap *h, size_t size, size_t align) {
+    // The slack must hold a header and a minimal payload, so the payload moves up by at most align + ALIGNMENT
+    size_t padded = size + align + ALIGNMENT;
+    if (padded > CHUNK_MAX) {
+        h = &main_heap;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    char *ptr = heap_alloc(h, padded);
+    if (ptr != NULL) {
+        free_block *block = (free_block *)(ptr - BLOCK_HEADER);
+        char *aligned = (char *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+
+        if (aligned != ptr) {
+            if ((size_t)(aligned - ptr) < BLOCK_HEADER + MIN_PAYLOAD) {
+                aligned += align;
+            }
+
+            // The block starts over at the aligned payload, what is left in front is freed; heap_free clears PREV_IN_USE if it merges it
+            size_t lead = aligned - ptr;
+            free_block *moved = (free_block *)(aligned - BLOCK_HEADER);
+            moved->size = size_to_word(block_size(block) - lead) | IN_USE | PREV_IN_USE | (block->size & IN_CHUNK);
+            block->size = size_to_word(lead - BLOCK_HEADER) | (block->size & FLAG_MASK);
+            heap_free(h, block);
+
+            block = moved;
+            ptr = aligned;
+        }
+
+        split(h, block, size);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    if (ptr != NULL) {
+        stat_add(&thread_counters.mallocs, 1);
+        stat_add(&thread_counters.held, allocated_size((free_block *)(ptr - BLOCK_HEADER)));
+    }
+    return ptr;
+}
+
+/**
+ * Get a small block from this thread's cache, refilling it from the heap in a batch if it is empty
+ *
+ * @param h This thread's heap
+ * @param size The payload size, at most SMALL_PAYLOAD
+ * @return A pointer to the payload or NULL if the heap is out of memory
+ */
+static void *tcache_alloc(heap *h, size_t size) {
+    tcache *cache = &thread_cache;
+    thread_stats *st = &thread_counters;
+    int bin = bin_index(size);
+
+    if (cache->entries[bin] == NULL) {
+        // One lock round trip fills half the cache
+        pthread_mutex_lock(&h->lock);
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            void *ptr = heap_alloc(h, size);
+            if (ptr == NULL) {
+                break;
+            }
+
+            free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+            if (block->size & IN_CHUNK) {
+                uintptr_t base = (uintptr_t)block & ~(uintptr_t)(CHUNK_SIZE - 1);
+                cache->chunks[(base >> CHUNK_SHIFT) % TCACHE_CHUNKS] = base;
+            }
+            set_cached_next(h, block, cache->entries[bin], block_size(block), bin);
+            mark_pending(block);
+            cache->entries[bin] = block;
+            __atomic_store_n(&cache->count[bin], cache->count[bin] + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&cache->bytes, cache->bytes + block_size(block), __ATOMIC_RELAXED);
+            stat_add(&st->held, block_size(block));
+            stat_add(&st->cache_fills, 1);
+        }
+        pthread_mutex_unlock(&h->lock);
+
+        if (cache->entries[bin] == NULL) {
+            return NULL;
+        }
+    }
+
+    free_block *block = cache->entries[bin];
+    size_t bytes = cached_bytes(h, block, bin);
+    cache->entries[bin] = get_cached_next(h, block);
+    clear_pending(block);
+    __atomic_store_n(&cache->count[bin], cache->count[bin] - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->bytes, cache->bytes - bytes, __ATOMIC_RELAXED);
+
+    return (char *)block + BLOCK_HEADER;
+}
+
+/**
+ * Put a small block into this thread's cache, flushing half of the class to the heap if it is full
+ *
+ * A block a split left bigger than its class is cached with the largest
+ * class it holds. The block is counted in the cache's bytes with size, so
+ * tufree_sized, which passes its class's size, never reads the header.
+ *
+ * @param h This thread's heap, which the block belongs to
+ * @param block The allocated block
+ * @param size Its payload size or its class's, at most SMALL_PAYLOAD and at least the smallest class
+ */
+static void tcache_free(heap *h, free_block *block, size_t size) {
+    tcache *cache = &thread_cache;
+    thread_stats *st = &thread_counters;
+    int bin = size_class_floor_bin[bin_index(size)];
+
+    if (cache->count[bin] >= TCACHE_DEPTH) {
+        // One lock round trip frees half the cache
+        size_t flushed = 0;
+        size_t counted = 0;
+        pthread_mutex_lock(&h->lock);
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            free_block *victim = cache->entries[bin];
+            counted += cached_bytes(h, victim, bin);
+            cache->entries[bin] = get_cached_next(h, victim);
+            flushed += block_size(victim);
+            heap_free(h, victim);
+        }
+        pthread_mutex_unlock(&h->lock);
+        __atomic_store_n(&cache->count[bin], cache->count[bin] - TCACHE_BATCH, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->bytes, cache->bytes - counted, __ATOMIC_RELAXED);
+        stat_add(&st->held, -flushed);
+        stat_add(&st->cache_flushes, TCACHE_BATCH);
+    }
+
+    set_cached_next(h, block, cache->entries[bin], size, bin);
+    mark_pending(block);
+    cache->entries[bin] = block;
+    __atomic_store_n(&cache->count[bin], cache->count[bin] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->bytes, cache->bytes + size, __ATOMIC_RELAXED);
+    stat_add(&st->cache_frees, 1);
+}
+
+/**
+ * Get the mapping length that holds a header and a payload of at least size bytes
+ *
+ * Pages start on ALIGNMENT, so the header of a page aligned mapping sits
+ * ALIGNMENT - BLOCK_HEADER bytes in and as many bytes at the end are never
+ * covered by the size word, see mmap_end.
+ *
+ * @param size The aligned payload size
+ * @return The length rounded up to whole pages, or 0 if it does not fit in a size_t
+ */
+static size_t mmap_length(size_t size) {
+    size_t page = page_size();
+    if (size > SIZE_MAX - 2 * ALIGNMENT - page) {
+        return 0;
+    }
+    return (size + 2 * ALIGNMENT - BLOCK_HEADER + page - 1) & ~(page - 1);
+}
+
+/**
+ * Get the start of the mapping of a block that has one of its own
+ *
+ * The header is in the first page of the mapping and the size covers all
+ * of the rest but for the last ALIGNMENT - BLOCK_HEADER bytes.
+ *
+ * @param block The mmap'd block
+ * @return The page the mapping starts at
+ */
+static inline char *mmap_base(free_block *block) {
+    return (char *)((uintptr_t)block & ~(uintptr_t)(page_size() - 1));
+}
+
+/**
+ * Get the end of the mapping of a block that has one of its own
+ *
+ * @param block The mmap'd block
+ * @return One past the last byte of the mapping
+ */
+static inline char *mmap_end(free_block *block) {
+    return (char *)next_block(block) + ALIGNMENT - BLOCK_HEADER;
+}
+
+/**
+ * Get the bytes of the guard page behind every mapping of its own, in a TUALLOC_GUARD_PAGES build
+ *
+ * @return The size of a page, or 0 without guard pages
+ */
+static inline size_t guard_size(void) {
+#ifdef TUALLOC_GUARD_PAGES
+    return page_size();
+#else
+    return 0;
+#endif
+}
+
+#ifdef TUALLOC_GUARD_PAGES
+/**
+ * Give an allocation a mapping of its own that ends right at an inaccessible page
+ *
+ * The payload is pushed up against the guard page, so writing past the
+ * block faults once it gets past the block's padding and the BLOCK_HEADER
+ * bytes in front of the page, which a TUALLOC_CANARIES build checks on free. Freeing unmaps the block and its guard, so touching it
+ * afterwards faults too until the addresses are mapped again. Every block
+ * costs two kernel mappings and at least two pages: this is for debugging.
+ *
+ * @param size The aligned size to allocate
+ * @param align The alignment, a power of two of at least ALIGNMENT
+ * @param node The NUMA node to bind the mapping to, -1 to leave it to first touch
+ * @return A pointer to the payload or NULL if it would go past the soft limit or mmap failed
+ */
+static void *guarded_alloc(size_t size, size_t align, int node) {
+    size_t page = page_size();
+    if (size > SIZE_MAX - align - ALIGNMENT - 2 * page) {
+        return NULL;
+    }
+
+    // Room for the header in front and to move the payload down to its alignment
+    size_t length = (size + BLOCK_HEADER + align + page - 1) & ~(page - 1);
+    char *map = map_memory(length + page);
+    if (map == NULL) {
+        return NULL;
+    }
+    char *guard = map + length;
+    if (mprotect(guard, page, PROT_NONE) != 0) {
+        unmap_memory(map, length + page);
+        return NULL;
+    }
+
+    // The block ends BLOCK_HEADER short of the guard, where mmap_end expects its mapping to end
+    char *payload = (char *)(((uintptr_t)guard - BLOCK_HEADER - size) & ~(uintptr_t)(align - 1));
+    free_block *block = (free_block *)(payload - BLOCK_HEADER);
+    char *base = mmap_base(block);
+    if (base > map) {
+        unmap_memory(map, base - map);
+    }
+    if (node >= 0) {
+        bind_to_node(base, guard - base, node);
+    }
+    block->size = size_to_word(guard - BLOCK_HEADER - payload) | IN_USE | MMAPPED;
+
+    stat_add(&thread_counters.mallocs, 1);
+    stat_add(&thread_counters.mmaps, 1);
+    stat_add(&thread_counters.held, block_size(block));
+    stat_add(&thread_counters.mmapped, guard + page - base);
+    return payload;
+}
+#endif
+
+/**
+ * Give a large allocation a mapping of its own
+ *
+ * The header sits in the first ALIGNMENT bytes of the mapping and its size
+ * covers the rest, so tufree can munmap it without touching any heap.
+ *
+ * @param size The aligned size to allocate
+ * @param node The NUMA node to bind the mapping to, -1 to leave it to first touch
+ * @return A pointer to the payload or NULL if it would go past the soft limit or mmap failed
+ */
+static void *mmap_alloc(size_t size, int node) {
+#ifdef TUALLOC_GUARD_PAGES
+    return guarded_alloc(size, ALIGNMENT, node);
+#else
+    size_t length = mmap_length(size);
+    if (length == 0) {
+        return NULL;
+    }
+
+    char *map = map_memory(length);
+    if (map == NULL) {
+        return NULL;
+    }
+    if (node >= 0) {
+        bind_to_node(map, length, node);
+    }
+    advise_huge(map, length);
+
+    free_block *block = (free_block *)(map + ALIGNMENT - BLOCK_HEADER);
+    block->size = size_to_word(length - 2 * ALIGNMENT + BLOCK_HEADER) | IN_USE | MMAPPED;
+
+    stat_add(&thread_counters.mallocs, 1);
+    stat_add(&thread_counters.mmaps, 1);
+    stat_add(&thread_counters.held, block_size(block));
+    stat_add(&thread_counters.mmapped, length);
+    return (char *)block + BLOCK_HEADER;
+#endif
+}
+
+/**
+ * Give a large allocation aligned to more than a header a mapping of its own
+ *
+ * Enough is mapped to place the payload anywhere, then the whole pages in
+ * front of the header and behind the payload are unmapped again.
+ *
+ * @param size The aligned size to allocate
+ * @param align The alignment, a power of two above ALIGNMENT
+ * @return A pointer to the payload or NULL if it would go past the soft limit or mmap failed
+ */
+static void *mmap_aligned_alloc(size_t size, size_t align) {
+#ifdef TUALLOC_GUARD_PAGES
+    return guarded_alloc(size, align, -1);
+#else
+    size_t length = mmap_length(size + align);
+    if (length == 0) {
+        return NULL;
+    }
+
+    char *map = map_memory(length);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    uintptr_t page_mask = page_size() - 1;
+    char *payload = (char *)(((uintptr_t)map + BLOCK_HEADER + align - 1) & ~(uintptr_t)(align - 1));
+    char *base = (char *)(((uintptr_t)payload - BLOCK_HEADER) & ~page_mask);
+    char *end = (char *)(((uintptr_t)payload + size + ALIGNMENT - BLOCK_HEADER + page_mask) & ~page_mask);
+    if (base > map) {
+        unmap_memory(map, base - map);
+    }
+    if (end < map + length) {
+        unmap_memory(end, map + length - end);
+    }
+
+    free_block *block = (free_block *)(payload - BLOCK_HEADER);
+    block->size = size_to_word((size_t)(end - payload) - (ALIGNMENT - BLOCK_HEADER)) | IN_USE | MMAPPED;
+
+    stat_add(&thread_counters.mallocs, 1);
+    stat_add(&thread_counters.mmaps, 1);
+    stat_add(&thread_counters.held, block_size(block));
+    stat_add(&thread_counters.mmapped, end - base);
+    return payload;
+#endif
+}
+
+#ifndef TUALLOC_GUARD_PAGES
+/**
+ * Resize a block that has a mapping of its own, letting the kernel move the pages instead of copying them
+ *
+ * Shrinking unmaps the whole pages past the new end in place.
+ *
+ * @param block The mmap'd block
+ * @param size The new aligned size
+ * @return A pointer to the payload, NULL if growing would go past the soft limit or mremap failed and the block is untouched
+ */
+static void *mmap_realloc(free_block *block, size_t size) {
+    // The header keeps its offset into the first page, moving keeps any alignment up to a page
+    char *base = mmap_base(block);
+    size_t offset = (char *)block - base;
+    size_t length = mmap_length(size + offset);
+    if (length == 0) {
+        return NULL;
+    }
+
+    size_t old_length = mmap_end(block) - base;
+    if (length > old_length && charge(length - old_length) != 0) {
+        return NULL;
+    }
+    char *moved = mremap(base, old_length, length, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+        if (length > old_length) {
+            uncharge(length - old_length);
+        }
+        return NULL;
+    }
+    if (length < old_length) {
+        uncharge(old_length - length);
+    }
+
+    block = (free_block *)(moved + offset);
+    block->size = size_to_word(length - offset - ALIGNMENT) | IN_USE | MMAPPED;
+    return (char *)block + BLOCK_HEADER;
+}
+#endif
+
+/**
+ * Tune the allocator
+ *
+ * @param param Which setting to change, one of the TU_M_* constants
+ * @param value The new value
+ * @return 1 on success, 0 if param is unknown
+ */
+int tumallopt(int param, size_t value) {
+    switch (param) {
+        case TU_M_MMAP_THRESHOLD:
+            __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+            return 1;
+        case TU_M_TRIM_THRESHOLD:
+            __atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+            return 1;
+        case TU_M_TOP_PAD:
+            __atomic_store_n(&top_pad, value, __ATOMIC_RELAXED);
+            return 1;
+        case TU_M_MXFAST:
+            // Blocks already in fast bins stay there until their heap consolidates
+            __atomic_store_n(&fast_limit, value == 0 ? 0 : payload_size(value < SMALL_MAX ? value : SMALL_MAX),
+                             __ATOMIC_RELAXED);
+            return 1;
+        case TU_M_FAST_TRIGGER:
+            __atomic_store_n(&fast_trigger, value, __ATOMIC_RELAXED);
+            return 1;
+        case TU_M_SOFT_LIMIT:
+            // Memory committed already stays, even above a lower limit
+            __atomic_store_n(&soft_limit, value, __ATOMIC_RELAXED);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Give every free page of every heap back to the OS
+ *
+ * Shrinks the main heap down to pad free bytes at its top and releases the
+ * whole pages inside every free block, whatever the thresholds say. Takes
+ * heaps_lock and then each heap's lock in turn.
+ *
+ * @param pad Free bytes to keep at the top of the main heap
+ * @return 1 if any memory was released, 0 otherwise
+ */
+int tumalloc_trim(size_t pad) {
+    size_t released = 0;
+
+    pthread_mutex_lock(&heaps_lock);
+    for (heap *h = &main_heap; h != NULL; h = h->next_heap) {
+        pthread_mutex_lock(&h->lock);
+        drain_remote(h);
+        consolidate(h);
+        if (h == &main_heap) {
+            released += trim_top(pad);
+        }
+        released += release_free_pages(h, 0);
+        pthread_mutex_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&heaps_lock);
+
+    return released != 0;
+}
+
+/**
+ * Register the low-memory handler
+ *
+ * @param fn Called with the size of a failing allocation, NULL for none
+ * @param arg Passed to fn
+ */
+void tumalloc_set_low_memory_handler(tualloc_low_memory_fn fn, void *arg) {
+    pthread_mutex_lock(&heaps_lock);
+    low_memory_fn = fn;
+    low_memory_arg = arg;
+    pthread_mutex_unlock(&heaps_lock);
+}
+
+/**
+ * Try to make room for an allocation that failed, before giving up on it
+ *
+ * The first stage gives the calling thread's cache back to its heap and
+ * trims every heap, which lowers what the main heap commits and lets free
+ * neighbours merge into a block big enough. The second calls the low-memory
+ * handler. Allocations made from inside either fail right away. Must be
+ * called without any heap's lock held.
+ *
+ * @param size The aligned size that failed
+ * @param stage 0 the first time an allocation failed, 1 the second
+ * @return 1 if the allocation should be tried again, 0 if it fails
+ */
+static int relieve_pressure(size_t size, int stage) {
+    if (relieving || stage > 1) {
+        return 0;
+    }
+    relieving = 1;
+
+    int retry = 1;
+    if (stage == 0) {
+        __atomic_fetch_add(&pressure_events, 1, __ATOMIC_RELAXED);
+        if (thread_heap != NULL) {
+            tcache_flush(&thread_cache, thread_heap);
+        }
+        tumalloc_trim(0);
+    } else {
+        pthread_mutex_lock(&heaps_lock);
+        tualloc_low_memory_fn fn = low_memory_fn;
+        void *arg = low_memory_arg;
+        pthread_mutex_unlock(&heaps_lock);
+
+        if (fn != NULL) {
+            fn(size, arg);
+        } else {
+            retry = 0;
+        }
+    }
+
+    relieving = 0;
+    return retry;
+}
+
+#define LAYOUT_WINDOW (CHUNK_SIZE / (MIN_PAYLOAD + BLOCK_HEADER) + 2) /**< Entries of the dump buffer, a whole chunk's blocks and its region fit */
+
+/**
+ * Where tumalloc_dump_layout is and what it copied out but did not write yet
+ */
+typedef struct layout_walk {
+    tualloc_layout_entry *entries; /**< LAYOUT_WINDOW entries, mapped for the dump */
+    size_t count; /**< Entries in use */
+    uint32_t heap; /**< Number of the heap being walked */
+    int fd; /**< Where the dump goes */
+    int failed; /**< Set once a write failed, nothing more is written after */
+} layout_walk;
+
+/**
+ * Write out the entries copied so far, never called with a heap's lock held
+ *
+ * @param w The walk
+ */
+static void layout_flush(layout_walk *w) {
+    const char *buf = (const char *)w->entries;
+    size_t len = w->count * sizeof(tualloc_layout_entry);
+    while (len > 0 && !w->failed) {
+        ssize_t n = write(w->fd, buf, len);
+        if (n < 0) {
+            w->failed = 1;
+            break;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    w->count = 0;
+}
+
+/**
+ * Add an entry to the buffer, which must have room for it
+ *
+ * @param w The walk
+ * @param addr The region or block header
+ * @param size Bytes of the region or payload of the block
+ * @param kind One of tualloc_layout_kind
+ * @param list The entry's list, see tualloc_layout_entry
+ */
+static void layout_add(layout_walk *w, const void *addr, size_t size, int kind, int list) {
+    tualloc_layout_entry *e = &w->entries[w->count++];
+    e->addr = (uintptr_t)addr;
+    e->size = size;
+    e->heap = w->heap;
+    e->kind = (uint16_t)kind;
+    e->list = (int16_t)list;
+}
+
+/**
+ * Copy blocks into the buffer until it is full or the walk reaches an epilogue,
+ * then find which of them wait in fast bins
+ *
+ * Fast bin blocks look allocated from their headers, so each bin's list is
+ * walked and its blocks looked up among the ones just copied, which are in
+ * address order. Must be called with the heap's lock held.
+ *
+ * @param w The walk
+ * @param h The heap the blocks belong to
+ * @param block The first block to copy
+ * @return The block to resume at, or NULL once the epilogue was reached
+ */
+static free_block *layout_blocks(layout_walk *w, heap *h, free_block *block) {
+    size_t first = w->count;
+    while (!is_epilogue(block) && w->count < LAYOUT_WINDOW) {
+        size_t size = block_size(block);
+        if (block->size & IN_USE) {
+            layout_add(w, block, size, TU_LAYOUT_USED, -1);
+        } else {
+#ifdef TUALLOC_BEST_FIT
+            layout_add(w, block, size, TU_LAYOUT_FREE, size > SMALL_PAYLOAD ? TU_LAYOUT_TREE : bin_index(size));
+#else
+            layout_add(w, block, size, TU_LAYOUT_FREE, bin_index(size));
+#endif
+        }
+        block = next_block(block);
+    }
+
+    if (w->count > first) {
+        uintptr_t low = w->entries[first].addr, high = w->entries[w->count - 1].addr;
+        for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+            for (free_block *f = h->fast[bin]; f != NULL; f = get_next(h, f)) {
+                if ((uintptr_t)f < low || (uintptr_t)f > high) {
+                    continue;
+                }
+                size_t lo = first, hi = w->count;
+                while (lo < hi) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (w->entries[mid].addr < (uintptr_t)f) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                if (lo < w->count && w->entries[lo].addr == (uintptr_t)f) {
+                    w->entries[lo].kind = TU_LAYOUT_FAST;
+                    w->entries[lo].list = (int16_t)bin;
+                }
+            }
+        }
+    }
+
+    return is_epilogue(block) ? NULL : block;
+}
+
+/**
+ * Dump the main heap's segments a window at a time, newest first
+ *
+ * Between windows the lock is dropped, and if a boundary went away meanwhile
+ * the block to resume at may be gone, so the walk starts over from the
+ * segment's first block and skips to the first one at or past it.
+ *
+ * @param w The walk
+ */
+static void layout_main_heap(layout_walk *w) {
+    pthread_mutex_lock(&main_heap.lock);
+    heap_segment *segment = heap_segments;
+    char *end = heap_end;
+    pthread_mutex_unlock(&main_heap.lock);
+
+    // A segment's links never change once it exists, and segments are never given back
+    for (; segment != NULL && !w->failed; end = segment->prev_end, segment = segment->prev) {
+        free_block *first = (free_block *)((char *)segment + sizeof(heap_segment) + ALIGNMENT - BLOCK_HEADER);
+        free_block *block = first;
+
+        pthread_mutex_lock(&main_heap.lock);
+        size_t version = main_heap.layout_version;
+        layout_add(w, segment, (size_t)(end - (char *)segment), TU_LAYOUT_REGION, -1);
+        for (;;) {
+            if (main_heap.layout_version != version) {
+                free_block *resume = block;
+                block = first;
+                while (!is_epilogue(block) && block < resume) {
+                    block = next_block(block);
+                }
+                if (is_epilogue(block)) {
+                    pthread_mutex_unlock(&main_heap.lock);
+                    break;
+                }
+            }
+            block = layout_blocks(w, &main_heap, block);
+            version = main_heap.layout_version;
+            pthread_mutex_unlock(&main_heap.lock);
+
+            layout_flush(w);
+            if (block == NULL || w->failed) {
+                break;
+            }
+            pthread_mutex_lock(&main_heap.lock);
+        }
+    }
+}
+
+/**
+ * Dump a chunk heap, each chunk in one go, and a handle's large mappings
+ *
+ * @param w The walk
+ * @param h The heap, kept in the registry by heaps_lock
+ */
+static void layout_chunk_heap(layout_walk *w, heap *h) {
+    pthread_mutex_lock(&h->lock);
+    chunk *c = h->chunks;
+    pthread_mutex_unlock(&h->lock);
+
+    // New chunks go in front, so the ones after the snapshot keep their links
+    for (; c != NULL && !w->failed; c = c->next) {
+        pthread_mutex_lock(&h->lock);
+        layout_add(w, c, CHUNK_SIZE, TU_LAYOUT_REGION, -1);
+        layout_blocks(w, h, (free_block *)((char *)c + CHUNK_HEADER));
+        pthread_mutex_unlock(&h->lock);
+        layout_flush(w);
+    }
+
+    // Each mapping takes two entries and a window holds thousands, more than memory allows for
+    pthread_mutex_lock(&h->lock);
+    for (large_link *link = h->large; link != NULL && w->count + 2 <= LAYOUT_WINDOW; link = link->next) {
+        free_block *block = (free_block *)((char *)link + 2 * ALIGNMENT - BLOCK_HEADER);
+        layout_add(w, link, (size_t)(mmap_end(block) - (char *)link), TU_LAYOUT_REGION, -1);
+        layout_add(w, block, block_size(block), TU_LAYOUT_USED, -1);
+    }
+    pthread_mutex_unlock(&h->lock);
+    layout_flush(w);
+}
+
+int tumalloc_dump_layout(int fd) {
+    layout_walk w = { .fd = fd };
+    w.entries = mmap(NULL, LAYOUT_WINDOW * sizeof(tualloc_layout_entry), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w.entries == MAP_FAILED) {
+        return -1;
+    }
+
+    // Holding heaps_lock keeps every heap and its chunks in place, heap locks come and go per window
+    pthread_mutex_lock(&heaps_lock);
+    for (heap *h = &main_heap; h != NULL && !w.failed; h = h->next_heap, w.heap++) {
+        if (h == &main_heap) {
+            layout_main_heap(&w);
+        } else {
+            layout_chunk_heap(&w, h);
+        }
+    }
+    pthread_mutex_unlock(&heaps_lock);
+
+    munmap(w.entries, LAYOUT_WINDOW * sizeof(tualloc_layout_entry));
+    return w.failed ? -1 : 0;
+}
+
+_Static_assert(TU_STATS_CLASSES == NUM_BINS, "tualloc_stats needs one free list length per bin");
+
+/**
+ * Add up every heap's and every thread's counters
+ *
+ * Takes heaps_lock and then each heap's lock in turn, and stats_lock for
+ * the threads' counters.
+ *
+ * @param stats Where to store the snapshot
+ */
+void tumalloc_stats(tualloc_stats *stats) {
+    *stats = (tualloc_stats){ 0 };
+
+    pthread_mutex_lock(&heaps_lock);
+    for (heap *h = &main_heap; h != NULL; h = h->next_heap) {
+        pthread_mutex_lock(&h->lock);
+        for (int bin = 0; bin < NUM_BINS; bin++) {
+            stats->free_blocks[bin] += h->stats.free_blocks[bin];
+        }
+        stats->free_bytes += h->stats.free_bytes;
+        stats->fast_bytes += h->stats.fast_bytes;
+        stats->reserved += h->stats.reserved;
+        if (h->node >= 0) {
+            stats->nodes[h->node].heaps++;
+            stats->nodes[h->node].reserved += h->stats.reserved;
+            stats->nodes[h->node].free_bytes += h->stats.free_bytes;
+        }
+        stats->heap_grows += h->stats.grows;
+        stats->splits += h->stats.splits;
+        stats->coalesces += h->stats.coalesces;
+        stats->consolidations += h->stats.consolidations;
+        stats->consolidated += h->stats.consolidated;
+        stats->consolidate_ns += h->stats.consolidate_ns;
+        stats->fit_searches += h->stats.fit_searches;
+        stats->fit_hits += h->stats.fit_hits;
+        stats->fit_steps += h->stats.fit_steps;
+        if (h->stats.fit_max_steps > stats->fit_max_steps) {
+            stats->fit_max_steps = h->stats.fit_max_steps;
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&heaps_lock);
+
+    pthread_mutex_lock(&stats_lock);
+    thread_stats total = retired_stats;
+    size_t cached_blocks = 0;
+    for (thread_stats *st = stats_threads; st != NULL; st = st->next) {
+        total.requested += __atomic_load_n(&st->requested, __ATOMIC_RELAXED);
+        total.mallocs += __atomic_load_n(&st->mallocs, __ATOMIC_RELAXED);
+        total.frees += __atomic_load_n(&st->frees, __ATOMIC_RELAXED);
+        total.cache_frees += __atomic_load_n(&st->cache_frees, __ATOMIC_RELAXED);
+        total.cache_fills += __atomic_load_n(&st->cache_fills, __ATOMIC_RELAXED);
+        total.cache_flushes += __atomic_load_n(&st->cache_flushes, __ATOMIC_RELAXED);
+        total.held += __atomic_load_n(&st->held, __ATOMIC_RELAXED);
+        total.mmapped += __atomic_load_n(&st->mmapped, __ATOMIC_RELAXED);
+        total.mmaps += __atomic_load_n(&st->mmaps, __ATOMIC_RELAXED);
+
+        // Blocks still sitting in the cache, a block split off bigger than its class counts with its own size
+        for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+            cached_blocks += __atomic_load_n(&st->cache->count[bin], __ATOMIC_RELAXED);
+        }
+        stats->cached += __atomic_load_n(&st->cache->bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    // Every block that went into a cache and is no longer there was handed out by it
+    size_t tcache_hits = total.cache_fills + total.cache_frees - total.cache_flushes - cached_blocks;
+
+    stats->requested = total.requested;
+    stats->mallocs = total.mallocs + tcache_hits;
+    stats->frees = total.frees + total.cache_frees;
+    stats->allocated = total.held - stats->cached;
+    stats->tcache_hits = tcache_hits;
+    stats->mmapped = total.mmapped;
+    stats->mmaps = total.mmaps;
+    stats->reserved += total.mmapped;
+    stats->committed = __atomic_load_n(&committed, __ATOMIC_RELAXED);
+    stats->pressure_events = __atomic_load_n(&pressure_events, __ATOMIC_RELAXED);
+
+    // Counters are read one by one, don't let a torn snapshot go below zero
+    if (stats->allocated > stats->reserved) {
+        stats->allocated = stats->reserved;
+    }
+    stats->fragmentation = stats->reserved ? 1.0 - (double)stats->allocated / (double)stats->reserved : 0;
+}
+
+/**
+ * Print a summary of the allocator's counters
+ *
+ * @param fd Where to write the summary
+ * @return 0 on success, -1 on a write error
+ */
+int tumalloc_stats_print(int fd) {
+    tualloc_stats stats;
+    tumalloc_stats(&stats);
+
+    int ok = dprintf(fd, "requested      %zu bytes since start in %zu allocations, %zu frees\n",
+                     stats.requested, stats.mallocs, stats.frees) >= 0;
+    ok &= dprintf(fd, "allocated      %zu bytes (%zu cached by threads, %zu on free lists)\n",
+                  stats.allocated, stats.cached, stats.free_bytes) >= 0;
+    ok &= dprintf(fd, "reserved       %zu bytes (%zu in %zu large mappings)\n",
+                  stats.reserved, stats.mmapped, stats.mmaps) >= 0;
+    size_t limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+    if (limit != 0) {
+        ok &= dprintf(fd, "committed      %zu bytes of a %zu byte soft limit, %zu allocations had to trim\n",
+                      stats.committed, limit, stats.pressure_events) >= 0;
+    } else {
+        ok &= dprintf(fd, "committed      %zu bytes, no soft limit, %zu allocations had to trim\n", stats.committed,
+                      stats.pressure_events) >= 0;
+    }
+    ok &= dprintf(fd, "fragmentation  %.1f%%\n", stats.fragmentation * 100) >= 0;
+    ok &= dprintf(fd, "thread cache   %zu hits\n", stats.tcache_hits) >= 0;
+    ok &= dprintf(fd, "fit searches   %zu, %zu reused a free block, %zu grew a heap\n",
+                  stats.fit_searches, stats.fit_hits, stats.heap_grows) >= 0;
+    ok &= dprintf(fd, "search length  %.2f blocks on average, %zu at most\n",
+                  stats.fit_searches ? (double)stats.fit_steps / (double)stats.fit_searches : 0.0,
+                  stats.fit_max_steps) >= 0;
+    ok &= dprintf(fd, "splits         %zu\ncoalesces      %zu\n", stats.splits, stats.coalesces) >= 0;
+    ok &= dprintf(fd, "fast bins      %zu bytes waiting, %zu consolidations merged %zu blocks in %.3f ms\n",
+                  stats.fast_bytes, stats.consolidations, stats.consolidated, stats.consolidate_ns / 1e6) >= 0;
+
+    for (int node = 0; node < TU_MAX_NODES; node++) {
+        if (stats.nodes[node].heaps != 0) {
+            ok &= dprintf(fd, "node %-9d %zu heaps, %zu bytes reserved, %zu on free lists\n", node,
+                          stats.nodes[node].heaps, stats.nodes[node].reserved, stats.nodes[node].free_bytes) >= 0;
+        }
+    }
+
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+        if (stats.free_blocks[bin] == 0) {
+            continue;
+        }
+        if (bin < NUM_SMALL_BINS) {
+            ok &= dprintf(fd, "free list      %zu bytes: %zu blocks\n", bin_min_size(bin),
+                          stats.free_blocks[bin]) >= 0;
+        } else if (bin == NUM_BINS - 1) {
+            ok &= dprintf(fd, "free list      %zu+ bytes: %zu blocks\n", bin_min_size(bin),
+                          stats.free_blocks[bin]) >= 0;
+        } else {
+            ok &= dprintf(fd, "free list      %zu-%zu bytes: %zu blocks\n", bin_min_size(bin),
+                          bin_min_size(bin + 1) - ALIGNMENT, stats.free_blocks[bin]) >= 0;
+        }
+    }
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * Allocate a block, the part of tumalloc shared with tucalloc and turealloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+static void *allocate(size_t size) {
+    // Nothing this big can be allocated, and aligning it would wrap around
+    if (size > PTRDIFF_MAX) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, size);
+        return NULL;
+    }
+
+    size_t requested = size;
+
+    // Round the size up so the next header keeps the payload after it aligned
+    size = payload_size(size);
+
+    heap *h = get_thread_heap();
+
+    void *ptr;
+    for (int stage = 0;; stage++) {
+        if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            // Large blocks get their own mapping so they go back to the OS as soon as they are freed
+            ptr = mmap_alloc(size, -1);
+        } else if (size <= SMALL_PAYLOAD) {
+            // Small sizes are served by this thread's cache without touching the heap lock
+            ptr = tcache_alloc(h, size);
+        } else {
+            ptr = locked_alloc(h, size);
+        }
+
+        // Out of memory, or up against the soft limit: trim, then ask the program to free some
+        if (ptr != NULL || !relieve_pressure(size, stage)) {
+            break;
+        }
+    }
+
+    if (ptr == NULL) {
+        // Record the failure
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, requested);
+        return NULL;
+    }
+
+    // Each path counted the block itself, the thread registered its counters when it picked a heap
+    stat_add(&thread_counters.requested, requested);
+    set_canary(ptr);
+    PROFILE_ALLOC(ptr, requested);
+
+    // Record the allocation
+    TRACE(TU_TRACE_MALLOC, ptr, requested);
+
+    // Return the allocated memory
+    return ptr;
+}
+
+/**
+ * Allocate an aligned block, the body of tualigned_alloc and tuposix_memalign
+ *
+ * @param align The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory, aligned to align
+ */
+static void *aligned_allocate(size_t align, size_t size) {
+    if (align <= ALIGNMENT) {
+        return allocate(size);
+    }
+
+    // Room for the slack must not wrap around either
+    if (size > PTRDIFF_MAX || align > PTRDIFF_MAX - size - 2 * ALIGNMENT) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, size);
+        return NULL;
+    }
+
+    size_t requested = size;
+
+    size = payload_size(size);
+
+    heap *h = get_thread_heap();
+
+    void *ptr;
+    for (int stage = 0;; stage++) {
+        if (size + align >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            ptr = mmap_aligned_alloc(size, align);
+        } else {
+            ptr = aligned_locked_alloc(h, size, align);
+        }
+        if (ptr != NULL || !relieve_pressure(size, stage)) {
+            break;
+        }
+    }
+
+    if (ptr == NULL) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, requested);
+        return NULL;
+    }
+
+    stat_add(&thread_counters.requested, requested);
+    set_canary(ptr);
+    PROFILE_ALLOC(ptr, requested);
+    TRACE(TU_TRACE_MALLOC, ptr, requested);
+    return ptr;
+}
+
+/**
+ * Free a block, the part of tufree shared with turealloc
+ *
+ * @param ptr Pointer to the allocated piece of memory, not NULL
+ */
+static void release(void *ptr) {
+    // Get the header that precedes the pointer
+    free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+
+    size_t size_word = allocated_size_word(block);
+    size_t size = word_size(size_word);
+    heap *h = heap_of(block, size_word);
+
+    check_free(block, size_word);
+    PROFILE_FREE(ptr);
+
+    // A thread may free without ever allocating, so it may not have registered yet
+    thread_stats *st = my_stats();
+
+    if (size_word & MMAPPED) {
+        // Not part of any heap, the pages go straight back to the OS
+        char *base = mmap_base(block);
+        size_t length = mmap_end(block) - base + guard_size();
+        stat_add(&st->frees, 1);
+        stat_add(&st->held, -size);
+        stat_add(&st->mmapped, -length);
+        unmap_memory(base, length);
+    } else if (h != thread_heap) {
+        // Someone else's block: one CAS onto its heap's remote stack
+        stat_add(&st->frees, 1);
+        stat_add(&st->held, -size);
+        mark_pending(block);
+        remote_free(h, block, block);
+    } else if (size <= SMALL_PAYLOAD) {
+        // Still held, just by the cache now
+        tcache_free(h, block, size);
+    } else {
+        stat_add(&st->frees, 1);
+        stat_add(&st->held, -size);
+        pthread_mutex_lock(&h->lock);
+        heap_free(h, block);
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    // Record the free
+    TRACE(TU_TRACE_FREE, ptr, size);
+}
+
+#ifndef NDEBUG
+/**
+ * Abort if a size given to a sized free or realloc is more than its block holds
+ *
+ * A smaller size is harmless, the block just serves smaller requests in the
+ * thread cache; a bigger one would hand it out for requests it can't hold.
+ *
+ * @param ptr Pointer to the allocated piece of memory, not NULL
+ * @param size The size the caller claims it has
+ * @param fn The public function that was called, for the message
+ */
+static void check_size(void *ptr, size_t size, const char *fn) {
+    size_t usable = allocated_size((free_block *)((char *)ptr - BLOCK_HEADER)) - CANARY_SIZE;
+    if (size > usable) {
+        dprintf(STDERR_FILENO, "%s: size %zu of %p is more than the %zu bytes of its block\n", fn, size, ptr, usable);
+        abort();
+    }
+}
+#endif
+
+/**
+ * Free a block whose size the caller knows, the body of tufree_sized
+ *
+ * The size picks the thread cache class, and a block in a chunk the cache
+ * was refilled from is known to belong to this thread's heap, so such a
+ * block is cached without reading its header at all. Everything else is
+ * released as usual.
+ *
+ * @param ptr Pointer to the allocated piece of memory, not NULL
+ * @param size At most the usable size of the block
+ */
+static void release_sized(void *ptr, size_t size) {
+    free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+    uintptr_t base = (uintptr_t)block & ~(uintptr_t)(CHUNK_SIZE - 1);
+
+    if (size <= SMALL_MAX && thread_cache.chunks[(base >> CHUNK_SHIFT) % TCACHE_CHUNKS] == base) {
+        check_not_pending(block);
+#ifdef TUALLOC_CANARIES
+        // The one check that can't do without the header
+        check_canary(block, allocated_size_word(block));
+#endif
+        PROFILE_FREE(ptr);
+        tcache_free(thread_heap, block, payload_size(size));
+        TRACE(TU_TRACE_FREE, ptr, allocated_size(block));
+        return;
+    }
+    release(ptr);
+}
+
+/**
+ * Zero a block of memory
+ *
+ * Big blocks are cleared with non-temporal stores where SSE2 has them, so
+ * zeroing a table bigger than the caches does not evict everything else
+ * from them first. Everything else goes to memset.
+ *
+ * @param ptr The memory, ALIGNMENT aligned
+ * @param size The number of bytes to zero
+ */
+static void clear_block(void *ptr, size_t size) {
+#ifdef __SSE2__
+    if (size >= CLEAR_STREAM_MIN) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i *p = ptr;
+        __m128i *end = p + size / (4 * sizeof(__m128i)) * 4;
+        for (; p < end; p += 4) {
+            _mm_stream_si128(p, zero);
+            _mm_stream_si128(p + 1, zero);
+            _mm_stream_si128(p + 2, zero);
+            _mm_stream_si128(p + 3, zero);
+        }
+        // Streaming stores are weakly ordered, the caller may hand the block to another thread next
+        _mm_sfence();
+        memset(end, 0, (char *)ptr + size - (char *)end);
+        return;
+    }
+#endif
+    memset(ptr, 0, size);
+}
+
+/**
+ * Allocates and initializes a list of elements for the end user
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the requested block of initialized memory
+ */
+void *tucalloc(size_t num, size_t size) {
+    // Check for overflow to prevent multiplication from wrapping around
+    if (size != 0 && num > SIZE_MAX / size) {
+        // If overflow would occur, return NULL to indicate failure
+        return NULL;
+    }
+
+    // Calculate the total size of the memory to be allocated
+    size_t total_size = num * size;
+
+    // Allocate the memory the same way tumalloc does, a block fresh from the heap says how much of it is still zero
+    zeroed_block = NULL;
+    void *ptr = allocate(total_size);
+
+    // Check if the allocation was successful
+    if (ptr != NULL) {
+        free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+        size_t size_word = allocated_size_word(block);
+
+        if (size_word & MMAPPED) {
+            // A fresh mapping, the kernel already zeroed it
+        } else if (block == zeroed_block) {
+            // Only the memory before the untouched mark and a footer left in the last word can be dirty
+            char *end = (char *)ptr + word_size(size_word);
+            size_t dirty = zeroed_from > (char *)ptr ? (size_t)(zeroed_from - (char *)ptr) : 0;
+            clear_block(ptr, dirty < total_size ? dirty : total_size);
+            if (end - sizeof(size_t) < (char *)ptr + total_size) {
+                memset(end - sizeof(size_t), 0, sizeof(size_t));
+            }
+        } else {
+            // Recycled by the thread cache
+            clear_block(ptr, total_size);
+        }
+    }
+
+    RECORD(TU_RECORD_CALLOC, ptr, num, size);
+
+    // Return the pointer to the allocated and initialized memory
+    return ptr;
+}
 
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdint.h>
-#include <string.h>
+/**
+ * Resize a block, the body of turealloc
+ *
+ * @param ptr A pointer to an already allocated piece of memory
+ * @param new_size The new requested size to allocate
+ * @return A new pointer containing the contents of ptr, but with the new_size
+ */
+static void *reallocate(void *ptr, size_t new_size) {
+    // If the original pointer is NULL, allocate a new block of memory
+    if (!ptr) {
+        return allocate(new_size);
+    }
 
-#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+    // Get the header that precedes the original pointer
+    free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+
+    size_t size_word = allocated_size_word(block);
+    size_t old_size = word_size(size_word);
+
+    // The old block is as good as freed, so it gets the same checks
+    check_free(block, size_word);
+
+    // Nothing this big can be allocated, and aligning it would wrap around
+    if (new_size > PTRDIFF_MAX) {
+        return NULL;
+    }
+
+    size_t size = payload_size(new_size);
+    size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+
+    if (size_word & MMAPPED) {
+        // Keep small slack like a heap block does; a block that fits the heap now moves there
+        if (old_size >= size && old_size - size < old_size / 4) {
+            return ptr;
+        }
+
+#ifndef TUALLOC_GUARD_PAGES
+        // A mapping that stays above the threshold shrinks in place, or grows in place or moves without a copy
+        if (size >= threshold) {
+            void *moved;
+            for (int stage = 0; (moved = mmap_realloc(block, size)) == NULL && relieve_pressure(size, stage); stage++) {
+            }
+            if (moved != NULL) {
+                // Wraps below zero when the mapping shrank, the counters add up modulo 2^64
+                size_t grown = allocated_size((free_block *)((char *)moved - BLOCK_HEADER)) - old_size;
+                thread_stats *st = my_stats();
+                stat_add(&st->requested, new_size);
+                stat_add(&st->held, grown);
+                stat_add(&st->mmapped, grown);
+                set_canary(moved);
+                // Sampled again like any allocation, in case it moved
+                PROFILE_FREE(ptr);
+                PROFILE_ALLOC(moved, new_size);
+            }
+            return moved;
+        }
+#endif
+    } else if (size <= old_size || size < threshold) {
+        // Shrink, or grow into the free space right behind the block
+        heap *h = heap_of(block, size_word);
+
+        pthread_mutex_lock(&h->lock);
+        int resized = resize_in_place(h, block, size);
+        size_t resized_size = block_size(block);
+        pthread_mutex_unlock(&h->lock);
+
+        if (resized) {
+            thread_stats *st = my_stats();
+            stat_add(&st->requested, new_size);
+            stat_add(&st->held, resized_size - old_size);
+            set_canary(ptr);
+            return ptr;
+        }
+    }
+
+    // Allocate a new block of memory of the specified size
+    void *new_ptr = allocate(new_size);
+
+    // If the allocation was successful, copy the contents of the original block to the new block
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        // Free the original block
+        release(ptr);
+    }
 
-static free_block *HEAD = NULL; /**< Pointer to the first element of the free list */
+    // Return the new pointer
+    return new_ptr;
+}
 
 /**
- * Split a free block into two blocks
+ * Allocates memory for the end user
  *
- * @param block The block to split
- * @param size The size of the first new split block
- * @return A pointer to the first block or NULL if the block cannot be split
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+void *tumalloc(size_t size) {
+    void *ptr = allocate(size);
+    RECORD(TU_RECORD_MALLOC, ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * Allocate a block on a NUMA node, the body of tumalloc_onnode
+ *
+ * A thread whose own heap is on the node allocates as usual. Otherwise the
+ * block comes from the least shared heap bound to the node, created the
+ * first time one is needed, and goes back to it like any block freed by a
+ * thread that does not own its heap. Blocks too big for a chunk get a
+ * mapping bound to the node.
+ *
+ * @param size The amount of memory to allocate
+ * @param node The node, known to exist
+ * @return A pointer to the requested block of memory
  */
-void *split(free_block *block, int size) {
-    if((block->size < size + sizeof(free_block))) {
+static void *node_allocate(size_t size, int node) {
+    heap *h = get_thread_heap();
+    if (h->node == node || node_count() == 1) {
+        // Everything is on the only node there is
+        return allocate(size);
+    }
+
+    if (size > PTRDIFF_MAX) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, size);
         return NULL;
     }
 
-    void *split_pnt = (char *)block + size + sizeof(free_block);
-    free_block *new_block = (free_block *) split_pnt;
+    size_t requested = size;
 
-    new_block->size = block->size - size - sizeof(free_block);
-    new_block->next = block->next;
+    size = payload_size(size);
 
-    block->size = size;
+    void *ptr;
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || size > CHUNK_MAX) {
+        ptr = mmap_alloc(size, node);
+    } else {
+        pthread_mutex_lock(&heaps_lock);
+        int fewest = 0;
+        h = least_shared_heap(node, &fewest);
+        if (h == NULL) {
+            // Placement was asked for explicitly, so this may go past MAX_HEAPS, by at most one heap per node
+            h = heap_new(node, 0);
+        }
+        pthread_mutex_unlock(&heaps_lock);
 
-    return block;
+        ptr = h != NULL ? locked_alloc(h, size) : NULL;
+    }
+
+    if (ptr == NULL) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, requested);
+        return NULL;
+    }
+
+    stat_add(&thread_counters.requested, requested);
+    set_canary(ptr);
+    PROFILE_ALLOC(ptr, requested);
+    TRACE(TU_TRACE_MALLOC, ptr, requested);
+    return ptr;
 }
 
 /**
- * Find the previous neighbor of a block
+ * Allocates aligned memory for the end user
  *
- * @param block The block to find the previous neighbor of
- * @return A pointer to the previous neighbor or NULL if there is none
+ * @param align The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory, NULL if align is not a power of two or memory ran out
  */
-free_block *find_prev(free_block *block) {
-    free_block *curr = HEAD;
-    while(curr != NULL) {
-        char *next = (char *)curr + curr->size + sizeof(free_block);
-        if(next == (char *)block)
-            return curr;
-        curr = curr->next;
+void *tualigned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
     }
-    return NULL;
+
+    void *ptr = aligned_allocate(align, size);
+    RECORD(TU_RECORD_ALIGNED, ptr, align, size);
+    return ptr;
 }
 
 /**
- * Find the next neighbor of a block
+ * Allocates aligned memory for the end user, POSIX style
  *
- * @param block The block to find the next neighbor of
- * @return A pointer to the next neighbor or NULL if there is none
+ * @param memptr Where to store the pointer, left alone on failure
+ * @param align The alignment, a power of two multiple of sizeof(void *)
+ * @param size The amount of memory to allocate
+ * @return 0 on success, EINVAL if align is invalid, ENOMEM if memory ran out
  */
-free_block *find_next(free_block *block) {
-    char *block_end = (char*)block + block->size + sizeof(free_block);
-    free_block *curr = HEAD;
+int tuposix_memalign(void **memptr, size_t align, size_t size) {
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0 || align == 0) {
+        return EINVAL;
+    }
 
-    while(curr != NULL) {
-        if((char *)curr == block_end)
-            return curr;
-        curr = curr->next;
+    void *ptr = aligned_allocate(align, size);
+    RECORD(TU_RECORD_ALIGNED, ptr, align, size);
+    if (ptr == NULL) {
+        return ENOMEM;
     }
-    return NULL;
+
+    *memptr = ptr;
+    return 0;
 }
 
 /**
- * Remove a block from the free list
+ * Allocates memory on a NUMA node for the end user
  *
- * @param block The block to remove
+ * @param size The amount of memory to allocate
+ * @param node The node
+ * @return A pointer to the requested block of memory, NULL if the node does not exist or memory ran out
+ */
+void *tumalloc_onnode(size_t size, int node) {
+    if (node < 0 || node >= node_count()) {
+        return NULL;
+    }
+
+    void *ptr = node_allocate(size, node);
+    RECORD(TU_RECORD_MALLOC, ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * Reallocates a chunk of memory with a bigger size
+ *
+ * @param ptr A pointer to an already allocated piece of memory
+ * @param new_size The new requested size to allocate
+ * @return A new pointer containing the contents of ptr, but with the new_size
+ */
+void *turealloc(void *ptr, size_t new_size) {
+    void *new_ptr = reallocate(ptr, new_size);
+    RECORD(TU_RECORD_REALLOC, new_ptr, (uintptr_t)ptr, new_size);
+    return new_ptr;
+}
+
+/**
+ * Removes used chunk of memory and returns it to the free list
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ */
+void tufree(void *ptr) {
+    // Check if pointer is NULL
+    if (!ptr) {
+        return;
+    }
+
+    // Recorded first, so the block can't show up in another thread's record before its free
+    RECORD(TU_RECORD_FREE, ptr, 0, 0);
+    release(ptr);
+}
+
+/**
+ * Removes used chunk of memory whose size is known and returns it to the free list
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @param size The size it was allocated or last reallocated with
  */
-void remove_free_block(free_block *block) {
-    free_block *curr = HEAD;
-    if(curr == block) {
-        HEAD = block->next;
+void tufree_sized(void *ptr, size_t size) {
+    if (!ptr) {
         return;
     }
-    while(curr != NULL) {
-        if(curr->next == block) {
-            curr->next = block->next;
-            return;
+
+#ifndef NDEBUG
+    check_size(ptr, size, "tufree_sized");
+#endif
+
+    RECORD(TU_RECORD_FREE, ptr, 0, 0);
+    release_sized(ptr, size);
+}
+
+/**
+ * Reallocates memory whose old size is known for the end user
+ *
+ * A resize within the rounding of the old size, or a shrink by less than
+ * a quarter, keeps the block as it is without reading its header, just as
+ * turealloc would keep it.
+ *
+ * @param ptr A pointer to an already allocated piece of memory, or NULL
+ * @param old_size The size it was allocated or last reallocated with, ignored for NULL
+ * @param new_size The new requested size to allocate
+ * @return A new pointer containing the contents of ptr, but with the new_size
+ */
+void *turealloc_sized(void *ptr, size_t old_size, size_t new_size) {
+    void *new_ptr = NULL;
+
+#ifndef NDEBUG
+    if (ptr != NULL) {
+        check_size(ptr, old_size, "turealloc_sized");
+    }
+#endif
+
+    if (ptr != NULL && old_size <= PTRDIFF_MAX && new_size <= PTRDIFF_MAX) {
+        // The block holds at least old_payload bytes, and resize_in_place would leave this much slack alone
+        size_t old_payload = payload_size(old_size);
+        size_t size = payload_size(new_size);
+        if (size <= old_payload && old_payload - size < old_payload / 4) {
+            stat_add(&my_stats()->requested, new_size);
+            new_ptr = ptr;
         }
-        curr = curr->next;
     }
+    if (new_ptr == NULL) {
+        new_ptr = reallocate(ptr, new_size);
+    }
+
+    RECORD(TU_RECORD_REALLOC, new_ptr, (uintptr_t)ptr, new_size);
+    return new_ptr;
 }
 
 /**
- * Coalesce neighboring free blocks
+ * Get the usable size of a block for the end user
  *
- * @param block The block to coalesce
- * @return A pointer to the first block of the coalesced blocks
+ * @param ptr Pointer to the allocated piece of memory, NULL is allowed
+ * @return The number of bytes that can be used at ptr, 0 for NULL
  */
-void *coalesce(free_block *block) {
-    if (block == NULL) {
-        return NULL;
+size_t tumalloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
     }
+    return allocated_size((free_block *)((char *)ptr - BLOCK_HEADER)) - CANARY_SIZE;
+}
 
-    free_block *prev = find_prev(block);
-    free_block *next = find_next(block);
+/**
+ * Allocate blocks of one size in a batch, the body of tumalloc_bulk
+ *
+ * Blocks are carved out of regions of up to CHUNK_MAX bytes, each taken
+ * from the heap in one search and split into blocks with headers of their
+ * own, all under a single lock round trip. Once no region can be had, the
+ * rest is allocated one by one, so trimming and the low-memory handler get
+ * their chance before the batch comes up short.
+ *
+ * @param size The size of every block
+ * @param n How many blocks to allocate
+ * @param out Where to store the pointers
+ * @return The number of blocks allocated, less than n if memory ran out
+ */
+static size_t bulk_allocate(size_t size, size_t n, void **out) {
+    if (n == 0 || size > PTRDIFF_MAX) {
+        return 0;
+    }
 
-    // Coalesce with previous block if it is contiguous.
-    if (prev != NULL) {
-        char *end_of_prev = (char *)prev + prev->size + sizeof(free_block);
-        if (end_of_prev == (char *)block) {
-            prev->size += block->size + sizeof(free_block);
+    size_t requested = size;
 
-            // Ensure prev->next is updated to skip over 'block', only if 'block' is directly next to 'prev'.
-            if (prev->next == block) {
-                prev->next = block->next;
-            }
-            block = prev; // Update block to point to the new coalesced block.
+    size = payload_size(size);
+
+    // Blocks that need a mapping or a region of their own gain nothing from carving
+    size_t stride = size + BLOCK_HEADER;
+    size_t per_region = (CHUNK_MAX + BLOCK_HEADER) / stride;
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || per_region < 2) {
+        size_t count = 0;
+        while (count < n && (out[count] = allocate(requested)) != NULL) {
+            count++;
         }
+        return count;
     }
 
-    // Coalesce with next block if it is contiguous.
-    if (next != NULL) {
-        char *end_of_block = (char *)block + block->size + sizeof(free_block);
-        if (end_of_block == (char *)next) {
-            block->size += next->size + sizeof(free_block);
+    heap *h = get_thread_heap();
+    size_t count = 0;
+    size_t held = 0;
+
+    pthread_mutex_lock(&h->lock);
+    while (count < n) {
+        size_t k = n - count < per_region ? n - count : per_region;
+        char *region = heap_alloc(h, k * stride - BLOCK_HEADER);
+        if (region == NULL) {
+            break;
+        }
 
-            // Ensure block->next is updated to skip over 'next'.
-            block->next = next->next;
+        // The first block keeps the region's flags, the last one whatever the split left over
+        free_block *block = (free_block *)(region - BLOCK_HEADER);
+        size_t total = block_size(block);
+        size_t flags = block->size & FLAG_MASK;
+        for (size_t j = 0; j < k; j++) {
+            free_block *b = (free_block *)((char *)block + j * stride);
+            size_t b_size = j == k - 1 ? total - (k - 1) * stride : size;
+            b->size = size_to_word(b_size) | (j == 0 ? flags : (flags & IN_CHUNK) | IN_USE | PREV_IN_USE);
+            out[count++] = (char *)b + BLOCK_HEADER;
+            set_canary((char *)b + BLOCK_HEADER);
         }
+        h->stats.splits += k - 1;
+        held += total;
     }
+    pthread_mutex_unlock(&h->lock);
 
-    return block;
+    stat_add(&thread_counters.mallocs, count);
+    stat_add(&thread_counters.held, held);
+    stat_add(&thread_counters.requested, count * requested);
+
+    for (size_t i = 0; i < count; i++) {
+        PROFILE_ALLOC(out[i], requested);
+        TRACE(TU_TRACE_MALLOC, out[i], requested);
+    }
+
+    // Out of memory or up against the soft limit: one at a time, each trying what allocate tries before failing
+    while (count < n && (out[count] = allocate(requested)) != NULL) {
+        count++;
+    }
+    return count;
 }
 
 /**
- * Call sbrk to get memory from the OS
+ * Allocates many blocks of one size for the end user
  *
- * @param size The amount of memory to allocate
- * @return A pointer to the allocated memory
+ * @param size The size of every block
+ * @param n How many blocks to allocate
+ * @param out Where to store the n pointers
+ * @return The number of pointers stored, less than n if memory ran out
  */
-void *do_alloc(size_t size) {
-    void *block = sbrk(size + sizeof(free_block));
-    if (block == (void *)-1) {
-        return NULL;
+size_t tumalloc_bulk(size_t size, size_t n, void **out) {
+    size_t count = bulk_allocate(size, n, out);
+    for (size_t i = 0; i < count; i++) {
+        RECORD(TU_RECORD_MALLOC, out[i], 0, size);
     }
-    
-    free_block *new_block = (free_block *)block;
-    new_block->size = size;
-    new_block->next = HEAD;
-    HEAD = new_block;
+    return count;
+}
 
-    HEAD = (free_block *)coalesce(HEAD);
+/**
+ * Frees many blocks for the end user
+ *
+ * Runs of blocks from this thread's heap are freed under one lock round
+ * trip, straight into the heap instead of the thread cache, and runs of
+ * blocks of another heap go onto its remote stack with one CAS.
+ *
+ * @param ptrs The blocks, NULL entries are ignored
+ * @param n How many entries ptrs has
+ */
+void tufree_bulk(void **ptrs, size_t n) {
+    thread_stats *st = my_stats();
+    heap *locked = NULL; // This thread's heap while a run of its blocks is being freed
+    heap *remote = NULL; // Another heap while a run of its blocks is being chained
+    free_block *first = NULL, *last = NULL;
 
-    return (void *)((char *)new_block + sizeof(free_block));
-}
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
 
-// extra cred: this is the pointer to the last allocated block
-static free_block *next_fit_ptr = NULL;
+        // Recorded first, so the block can't show up in another thread's record before its free
+        RECORD(TU_RECORD_FREE, ptrs[i], 0, 0);
 
+        free_block *block = (free_block *)((char *)ptrs[i] - BLOCK_HEADER);
+        size_t size_word = allocated_size_word(block);
+        size_t size = word_size(size_word);
+        heap *h = size_word & MMAPPED ? NULL : heap_of(block, size_word);
 
+        check_free(block, size_word);
+        PROFILE_FREE(ptrs[i]);
 
-/**
- * Allocates memory for the end user
- *
- * @param size The amount of memory to allocate
- * @return A pointer to the requested block of memory
- */
-void *tumalloc(size_t size) {
-    // Print debug information
-    printf("Allocating %d bytes\n", size);
-    printf("Next fit ptr: %p\n", next_fit_ptr);
-
-    // Align the size to the nearest multiple of ALIGNMENT
-    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-
-    // Start searching for a free block from the next fit pointer
-    free_block *curr = next_fit_ptr ? next_fit_ptr : HEAD;
-    free_block *prev = NULL;
-
-    // Traverse the free list to find a block that fits the requested size
-    while (curr != NULL) {
-        // Check if the current block is large enough
-        if (curr->size >= size) {
-            // Split the block if it's larger than the requested size
-            if (curr->size > size + sizeof(free_block)) {
-                split(curr, size);
-            }
+        // A run ends when the next block belongs elsewhere, so at most one of the two is open at a time
+        if (remote != NULL && h != remote) {
+            remote_free(remote, first, last);
+            remote = NULL;
+        }
+        if (locked != NULL && h != locked) {
+            pthread_mutex_unlock(&locked->lock);
+            locked = NULL;
+        }
+
+        stat_add(&st->frees, 1);
+        stat_add(&st->held, -size);
 
-            // Remove the block from the free list
-            if (prev != NULL) {
-                prev->next = curr->next;
+        if (h == NULL) {
+            char *base = mmap_base(block);
+            size_t length = mmap_end(block) - base + guard_size();
+            stat_add(&st->mmapped, -length);
+            unmap_memory(base, length);
+        } else if (h != thread_heap) {
+            mark_pending(block);
+            if (remote == NULL) {
+                remote = h;
+                first = block;
             } else {
-                HEAD = curr->next;
+                set_next(h, last, block);
             }
+            last = block;
+        } else {
+            if (locked == NULL) {
+                pthread_mutex_lock(&h->lock);
+                locked = h;
+            }
+            heap_free(h, block);
+        }
 
-            // Update the next fit pointer
-            next_fit_ptr = curr->next ? curr->next : HEAD;
-
-            // Print debug information
-            printf("allocated memory: %p\n", (void *)(curr + 1));
+        TRACE(TU_TRACE_FREE, ptrs[i], size);
+    }
 
-            // Return the allocated memory
-            return (void *)(curr + 1);
-        }
+    if (remote != NULL) {
+        remote_free(remote, first, last);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
 
-        // Move to the next block in the free list
-        prev = curr;
-        curr = curr->next;
+/**
+ * Map a block above CHUNK_MAX for a tuheap and put the mapping on its list
+ *
+ * The mapping starts with the list links, so the header sits ALIGNMENT
+ * further in than in mmap_alloc; mmap_base and mmap_end still find both
+ * ends of the mapping.
+ *
+ * @param h The heap, a handle
+ * @param size The aligned size to allocate
+ * @return A pointer to the payload or NULL if it would go past the soft limit or mmap failed
+ */
+static void *handle_large_alloc(heap *h, size_t size) {
+    size_t length = size <= SIZE_MAX - ALIGNMENT ? mmap_length(size + ALIGNMENT) : 0;
+    if (length == 0) {
+        return NULL;
     }
 
-    // If no free block is found, allocate new memory from the OS
-    free_block *new_block = (free_block *)sbrk(size + sizeof(free_block));
-    if (new_block == (void *)-1) {
-        // Print error message if allocation fails
-        printf("Failed to allocate memory\n");
+    char *map = map_memory(length);
+    if (map == NULL) {
         return NULL;
     }
+    advise_huge(map, length);
 
-    // Initialize the new block
-    new_block->size = size;
-    new_block->next = HEAD;
+    free_block *block = (free_block *)(map + 2 * ALIGNMENT - BLOCK_HEADER);
+    block->size = size_to_word(length - 3 * ALIGNMENT + BLOCK_HEADER) | IN_USE | MMAPPED;
 
-    // Reset the next fit pointer
-    next_fit_ptr = NULL;
+    large_link *link = (large_link *)map;
+    pthread_mutex_lock(&h->lock);
+    link->prev = NULL;
+    link->next = h->large;
+    if (h->large != NULL) {
+        h->large->prev = link;
+    }
+    h->large = link;
+    h->handle_mapped += length;
+    h->handle_held += block_size(block);
+    h->handle_blocks++;
+    pthread_mutex_unlock(&h->lock);
 
-    // Print debug information
-    printf("allocated memory: %p\n", (void *)(new_block + 1));
+    thread_stats *st = my_stats();
+    stat_add(&st->mmaps, 1);
+    stat_add(&st->mmapped, length);
+    return (char *)block + BLOCK_HEADER;
+}
 
-    // Return the allocated memory
-    return (void *)(new_block + 1);
+/**
+ * Create a heap of its own for the end user
+ *
+ * The heap grows in chunks like a thread's heap and is on the registry, so
+ * tumalloc_stats, tumalloc_trim and the fork handlers see it, but no thread
+ * ever adopts it.
+ *
+ * @return The heap, NULL if memory ran out
+ */
+tuheap *tuheap_create(void) {
+    pthread_mutex_lock(&heaps_lock);
+#ifdef TUALLOC_SECRETS
+    init_secrets();
+#endif
+    heap *h = heap_new(-1, 1);
+    pthread_mutex_unlock(&heaps_lock);
+    return (tuheap *)h;
 }
 
 /**
- * Allocates and initializes a list of elements for the end user
+ * Allocates memory from a heap of its own for the end user
  *
- * @param num How many elements to allocate
- * @param size The size of each element
- * @return A pointer to the requested block of initialized memory
+ * Every size takes the heap's lock: blocks up to CHUNK_MAX come from its
+ * chunks whatever the mmap threshold, bigger ones get a mapping that the
+ * heap keeps track of.
+ *
+ * @param handle The heap
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory, NULL if memory ran out
  */
-void *tucalloc(size_t num, size_t size) {
-    // Check for overflow to prevent multiplication from wrapping around
-    if (num > SIZE_MAX / size) {
-        // If overflow would occur, return NULL to indicate failure
+void *tuheap_malloc(tuheap *handle, size_t size) {
+    heap *h = (heap *)handle;
+
+    if (size > PTRDIFF_MAX) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, size);
         return NULL;
     }
 
-    // Calculate the total size of the memory to be allocated
-    size_t total_size = num * size;
+    size_t requested = size;
 
-    // Allocate the memory using tumalloc
-    void *ptr = tumalloc(total_size);
+    size = payload_size(size);
 
-    // Check if the allocation was successful
-    if (ptr != NULL) {
-        // Initialize the allocated memory to zero using memset
-        memset(ptr, 0, total_size);
+    void *ptr;
+    for (int stage = 0;; stage++) {
+        if (size > CHUNK_MAX) {
+            ptr = handle_large_alloc(h, size);
+        } else {
+            pthread_mutex_lock(&h->lock);
+            ptr = heap_alloc(h, size);
+            if (ptr != NULL) {
+                h->handle_held += allocated_size((free_block *)((char *)ptr - BLOCK_HEADER));
+                h->handle_blocks++;
+            }
+            pthread_mutex_unlock(&h->lock);
+        }
+        if (ptr != NULL || !relieve_pressure(size, stage)) {
+            break;
+        }
     }
 
-    // Return the pointer to the allocated and initialized memory
+    if (ptr == NULL) {
+        TRACE(TU_TRACE_MALLOC_FAILED, NULL, requested);
+        return NULL;
+    }
+
+    thread_stats *st = my_stats();
+    stat_add(&st->mallocs, 1);
+    stat_add(&st->held, allocated_size((free_block *)((char *)ptr - BLOCK_HEADER)));
+    stat_add(&st->requested, requested);
+    set_canary(ptr);
+    PROFILE_ALLOC(ptr, requested);
+    TRACE(TU_TRACE_MALLOC, ptr, requested);
     return ptr;
 }
 
 /**
- * Reallocates a chunk of memory with a bigger size
+ * Returns memory to the heap of its own it came from for the end user
  *
- * @param ptr A pointer to an already allocated piece of memory
- * @param new_size The new requested size to allocate
- * @return A new pointer containing the contents of ptr, but with the new_size
+ * @param handle The heap
+ * @param ptr A block tuheap_malloc returned for the same heap, or NULL
  */
-void *turealloc(void *ptr, size_t new_size) {
-    // If the original pointer is NULL, allocate a new block of memory
+void tuheap_free(tuheap *handle, void *ptr) {
     if (!ptr) {
-        return tumalloc(new_size);
+        return;
     }
 
-    // Get the free_block struct that precedes the original pointer
-    free_block *block = (free_block *)ptr - 1;
+    heap *h = (heap *)handle;
+    free_block *block = (free_block *)((char *)ptr - BLOCK_HEADER);
+    size_t size_word = allocated_size_word(block);
+    size_t size = word_size(size_word);
 
-    // If the original block is large enough, return the original pointer
-    if (block->size >= new_size) {
-        return ptr;
+    check_free(block, size_word);
+    if (!(size_word & MMAPPED) && heap_of(block, size_word) != h) {
+        dprintf(STDERR_FILENO, "tuheap_free: %p is not a block of heap %p\n", ptr, (void *)h);
+        abort();
     }
+    PROFILE_FREE(ptr);
 
-    // Allocate a new block of memory of the specified size
-    void *new_ptr = tumalloc(new_size);
+    thread_stats *st = my_stats();
+    stat_add(&st->frees, 1);
+    stat_add(&st->held, -size);
 
-    // If the allocation was successful, copy the contents of the original block to the new block
-    if (new_ptr) {
-        memcpy(new_ptr, ptr, block->size);
-        // Free the original block
-        tufree(ptr);
+    pthread_mutex_lock(&h->lock);
+    h->handle_held -= size;
+    h->handle_blocks--;
+    if (size_word & MMAPPED) {
+        large_link *link = (large_link *)mmap_base(block);
+        size_t length = mmap_end(block) - (char *)link;
+        if (link->prev != NULL) {
+            link->prev->next = link->next;
+        } else {
+            h->large = link->next;
+        }
+        if (link->next != NULL) {
+            link->next->prev = link->prev;
+        }
+        h->handle_mapped -= length;
+        pthread_mutex_unlock(&h->lock);
+
+        stat_add(&st->mmapped, -length);
+        unmap_memory(link, length);
+    } else {
+        heap_free(h, block);
+        pthread_mutex_unlock(&h->lock);
     }
 
-    // Return the new pointer
-    return new_ptr;
+    TRACE(TU_TRACE_FREE, ptr, size);
 }
 
 /**
- * Removes used chunk of memory and returns it to the free list
+ * Release a heap of its own and every block still allocated from it for the end user
  *
- * @param ptr Pointer to the allocated piece of memory
+ * The heap leaves the registry first, then its chunks and mappings are
+ * unmapped without looking at the blocks inside.
+ *
+ * @param handle The heap, NULL is ignored
  */
-void tufree(void *ptr) {
-    // Print freed memory address
-    printf("freed memory: %p\n", ptr);
-
-    // Check if pointer is NULL
-    if (!ptr) {
+void tuheap_destroy(tuheap *handle) {
+    heap *h = (heap *)handle;
+    if (h == NULL) {
         return;
     }
 
-    // Get free_block struct
-    free_block *block = (free_block *)ptr - 1;
+    pthread_mutex_lock(&heaps_lock);
+    for (heap *prev = &main_heap; prev != NULL; prev = prev->next_heap) {
+        if (prev->next_heap == h) {
+            prev->next_heap = h->next_heap;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heaps_lock);
+
+    // Whatever is still allocated is freed now, as far as the counters go
+    thread_stats *st = my_stats();
+    stat_add(&st->frees, h->handle_blocks);
+    stat_add(&st->held, -h->handle_held);
+    stat_add(&st->mmapped, -h->handle_mapped);
 
-    // Add block to free list
-    block->next = HEAD;
-    HEAD = block;
+    for (large_link *link = h->large, *next; link != NULL; link = next) {
+        next = link->next;
+        free_block *block = (free_block *)((char *)link + 2 * ALIGNMENT - BLOCK_HEADER);
+        unmap_memory(link, mmap_end(block) - (char *)link);
+    }
+    for (chunk *c = h->chunks, *next; c != NULL; c = next) {
+        next = c->next;
+        unmap_memory(c, CHUNK_SIZE);
+    }
 
-    // Print completion message
-    printf("Free operation complete: %p\n", ptr);
+    pthread_mutex_destroy(&h->lock);
+    munmap(h, sizeof(heap));
 }
@@ -2,26 +2,473 @@
 #define CYB3053_PROJECT2_ALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
- * Header for allocated blocks
+ * Header for allocated blocks, a single word right in front of the 16-byte aligned payload
  */
 typedef struct header {
-    size_t size; /**< Size of the block */
-    int magic; /**< Magic number for error checking */
+    size_t size; /**< Bytes from this header to the next one, flags in the low four bits */
 } header;
 
 /**
  * Free block structure
+ *
+ * The first word is the header. The low bits of size are flags (this block
+ * in use, previous block in use), next and prev take the first two words of
+ * the payload only while the block is free, and a free block repeats its
+ * payload size in the last word of its payload as a boundary tag so its
+ * successor can find it.
  */
 typedef struct free_block {
-    size_t size; /**< Size of the block */
+    size_t size; /**< Bytes from this header to the next one, same as in header */
     struct free_block *next; /**< Pointer to the next free block */
+    struct free_block *prev; /**< Pointer to the previous free block */
 } free_block;
 
+#define TU_M_MMAP_THRESHOLD 1 /**< tumallopt: allocations of at least this many bytes get their own mapping */
+#define TU_M_TRIM_THRESHOLD 2 /**< tumallopt: free blocks bigger than this give their pages back to the OS, SIZE_MAX never */
+#define TU_M_TOP_PAD 3 /**< tumallopt: free bytes kept at the top of the main heap and at the front of large free blocks */
+#define TU_M_MXFAST 4 /**< tumallopt: blocks for requests up to this many bytes (at most 512) go into fast bins uncoalesced, 0 turns fast bins off */
+#define TU_M_FAST_TRIGGER 5 /**< tumallopt: a heap merges its fast bins into the free lists once they hold more than this many bytes */
+#define TU_M_SOFT_LIMIT 6 /**< tumallopt: bytes the heaps and large mappings may commit in total, 0 for no limit */
+
+/*
+ * Thread safety: all four functions may be called concurrently from any
+ * number of threads. Sizes up to 512 bytes are served from a per-thread
+ * cache and only take the shared heap lock once per batch refill or flush;
+ * larger sizes take the shared heap lock for every call. A block may be
+ * freed or reallocated by a different thread than the one that allocated
+ * it, but a given block must not be passed to turealloc or tufree by two
+ * threads at the same time.
+ */
+
+/**
+ * Allocate size bytes aligned to 16 bytes. Thread-safe.
+ */
 void *tumalloc(size_t size);
+
+/**
+ * Allocate num * size zeroed bytes, or NULL if the product overflows. Memory
+ * that is fresh from the OS is not cleared again, so large callocs stay out
+ * of RSS until they are written. Thread-safe.
+ */
 void *tucalloc(size_t num, size_t size);
+
+/**
+ * Resize ptr to new_size bytes, moving it if needed. Thread-safe, as long as
+ * no other thread is using ptr at the same time.
+ */
 void *turealloc(void *ptr, size_t new_size);
+
+/**
+ * Free ptr, which may come from any thread. Thread-safe, as long as no other
+ * thread is using ptr at the same time.
+ */
 void tufree(void *ptr);
 
+/**
+ * Free ptr like tufree, given the size it was allocated or last reallocated
+ * with (anything up to tumalloc_usable_size(ptr) works). Up to 512 bytes,
+ * a block of the calling thread's own heap goes into its cache without its
+ * header being read. Builds without NDEBUG abort on a size bigger than the
+ * block. Thread-safe, as long as no other thread is using ptr at the same
+ * time.
+ */
+void tufree_sized(void *ptr, size_t size);
+
+/**
+ * Resize ptr like turealloc, given the size it was allocated or last
+ * reallocated with. A new size that needs no change to the block returns
+ * ptr without its header being read. Builds without NDEBUG abort on an old
+ * size bigger than the block. Thread-safe, as long as no other thread is
+ * using ptr at the same time.
+ */
+void *turealloc_sized(void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Return how many bytes the block at ptr can hold, at least what was asked
+ * for, or 0 for NULL. Thread-safe.
+ */
+size_t tumalloc_usable_size(void *ptr);
+
+/**
+ * Allocate n blocks of size bytes each into out, as if by n tumalloc calls
+ * but with a single lock round trip for most sizes. Returns how many were
+ * allocated, fewer than n only if memory ran out. Thread-safe.
+ */
+size_t tumalloc_bulk(size_t size, size_t n, void **out);
+
+/**
+ * Free the n blocks in ptrs, as if by n tufree calls but taking each lock
+ * once per run of blocks from the same heap. NULL entries are skipped.
+ * Thread-safe, as long as no other thread is using the blocks.
+ */
+void tufree_bulk(void **ptrs, size_t n);
+
+/**
+ * Allocate size bytes aligned to align, a power of two, or NULL if align is
+ * not one. The block is freed with tufree like any other; the slack in front
+ * of it goes back to the heap instead of being wasted. turealloc keeps the
+ * alignment only up to 16 bytes. Thread-safe.
+ */
+void *tualigned_alloc(size_t align, size_t size);
+
+/**
+ * Allocate size bytes aligned to align into *memptr. Returns 0 on success,
+ * EINVAL if align is not a power of two multiple of sizeof(void *) and
+ * ENOMEM if memory ran out, leaving *memptr untouched. Thread-safe.
+ */
+int tuposix_memalign(void **memptr, size_t align, size_t size);
+
+#define TU_MAX_NODES 64 /**< NUMA nodes the allocator knows about, higher ones are treated as absent */
+
+/**
+ * Allocate size bytes backed by memory of NUMA node node, or NULL if there is
+ * no such node or memory ran out. Every thread already allocates from heaps
+ * bound to the node it first allocated on; this is for placing data near the
+ * threads that will use it. The block is freed with tufree and its memory
+ * stays on the node. Thread-safe.
+ */
+void *tumalloc_onnode(size_t size, int node);
+
+/**
+ * A pool of fixed-size objects, see tupool_create
+ *
+ * Objects are carved from contiguous slabs with a single header per slab
+ * and freed objects are chained through their own storage, so there is no
+ * per-object header. A pool is not thread-safe: use it from one thread at a
+ * time or guard it with a lock.
+ */
+typedef struct tupool tupool;
+
+/**
+ * Create a pool of obj_size byte objects aligned to align (a power of two,
+ * 0 for 16). Returns NULL if align is invalid or memory ran out.
+ */
+tupool *tupool_create(size_t obj_size, size_t align);
+
+/**
+ * Allocate one object from pool, or NULL if memory ran out.
+ */
+void *tupool_alloc(tupool *pool);
+
+/**
+ * Return ptr, which came from tupool_alloc on the same pool, to the pool.
+ */
+void tupool_free(tupool *pool, void *ptr);
+
+/**
+ * Release pool and every object allocated from it, one tufree per slab.
+ */
+void tupool_destroy(tupool *pool);
+
+/**
+ * A region allocator for memory that is released all at once, see tuarena_create
+ *
+ * Allocation bumps a pointer through chunks that come from tumalloc. An
+ * arena is not thread-safe: use it from one thread at a time or guard it
+ * with a lock.
+ */
+typedef struct tuarena tuarena;
+
+/**
+ * A position in an arena returned by tuarena_mark
+ */
+typedef struct tuarena_savepoint {
+    struct arena_chunk *chunk; /**< The newest chunk when the mark was taken */
+    char *top; /**< The bump pointer when the mark was taken */
+} tuarena_savepoint;
+
+/**
+ * Create an empty arena that grows in chunk_size byte chunks (0 for
+ * 64 KiB). Returns NULL if memory ran out.
+ */
+tuarena *tuarena_create(size_t chunk_size);
+
+/**
+ * Allocate size bytes, aligned to 16, from arena. They stay valid until the
+ * arena is rewound past them, reset or destroyed. Returns NULL if memory ran out.
+ */
+void *tuarena_alloc(tuarena *arena, size_t size);
+
+/**
+ * Remember the current position of arena for tuarena_rewind.
+ */
+tuarena_savepoint tuarena_mark(tuarena *arena);
+
+/**
+ * Release everything allocated from arena after mark was taken.
+ */
+void tuarena_rewind(tuarena *arena, tuarena_savepoint mark);
+
+/**
+ * Release everything allocated from arena in O(number of chunks), keeping
+ * the chunks cached for the next allocations.
+ */
+void tuarena_reset(tuarena *arena);
+
+/**
+ * Release arena and give all of its chunks back with tufree.
+ */
+void tuarena_destroy(tuarena *arena);
+
+/**
+ * A heap of its own, see tuheap_create
+ *
+ * Blocks come from chunks that belong to this heap alone and are guarded
+ * by its own lock, so a subsystem's allocations neither contend with nor
+ * fragment everyone else's, and tuheap_destroy gives them all back at
+ * once. A heap is thread-safe. Its blocks skip the thread caches.
+ */
+typedef struct tuheap tuheap;
+
+/**
+ * Create an empty heap. Returns NULL if memory ran out. Thread-safe.
+ */
+tuheap *tuheap_create(void);
+
+/**
+ * Allocate size bytes aligned to 16 from heap, or NULL if memory ran out.
+ * The block must be freed with tuheap_free on the same heap, or left for
+ * tuheap_destroy, never with tufree or turealloc. Thread-safe.
+ */
+void *tuheap_malloc(tuheap *heap, size_t size);
+
+/**
+ * Return ptr, which came from tuheap_malloc on the same heap, to the heap.
+ * NULL is ignored. Thread-safe, as long as no other thread is using ptr.
+ */
+void tuheap_free(tuheap *heap, void *ptr);
+
+/**
+ * Release heap and every block still allocated from it, unmapping its
+ * memory without touching the blocks one by one. No other thread may use
+ * the heap or its blocks meanwhile or afterwards.
+ */
+void tuheap_destroy(tuheap *heap);
+
+/**
+ * Events recorded when the allocator is built with TUALLOC_TRACE
+ */
+enum tualloc_trace_event {
+    TU_TRACE_MALLOC = 1, /**< tumalloc returned ptr for a request of size bytes */
+    TU_TRACE_MALLOC_FAILED = 2, /**< tumalloc could not allocate size bytes */
+    TU_TRACE_NEXT_FIT = 3, /**< A heap search for size bytes started at next fit pointer ptr */
+    TU_TRACE_FREE = 4, /**< tufree released ptr, size is its block size */
+};
+
+/**
+ * One record of the binary trace written by tumalloc_trace_dump
+ */
+typedef struct tualloc_trace_entry {
+    uint64_t timestamp; /**< CLOCK_MONOTONIC nanoseconds */
+    uint64_t ptr; /**< Address the event is about */
+    uint64_t size; /**< Size the event is about */
+    uint32_t event; /**< One of tualloc_trace_event */
+    uint32_t thread; /**< Small sequential id of the thread that recorded it */
+} tualloc_trace_entry;
+
+/**
+ * Write every thread's trace ring buffer to fd as an array of
+ * tualloc_trace_entry, oldest entry of each buffer first. A new thread
+ * takes over the buffer of one that exited, so a buffer may hold entries
+ * of several threads one after the other. Returns 0 on success and -1 on a
+ * write error or when tracing is compiled out.
+ * Thread-safe; entries recorded while the dump runs may be torn.
+ */
+int tumalloc_trace_dump(int fd);
+
+/**
+ * Calls logged by the allocation recorder, see tumalloc_record_start
+ */
+enum tualloc_record_op {
+    TU_RECORD_MALLOC = 1, /**< ptr = tumalloc(size) */
+    TU_RECORD_CALLOC = 2, /**< ptr = tucalloc(old, size) */
+    TU_RECORD_REALLOC = 3, /**< ptr = turealloc(old, size) */
+    TU_RECORD_FREE = 4, /**< tufree(ptr) */
+    TU_RECORD_ALIGNED = 5, /**< ptr = tualigned_alloc(old, size) or tuposix_memalign(&ptr, old, size) */
+};
+
+/**
+ * One record of the stream written by the allocation recorder
+ *
+ * Pointers identify blocks: the same address names the same block from the
+ * call that returned it until the call that freed it. A failed allocation
+ * has ptr 0.
+ */
+typedef struct tualloc_record {
+    uint64_t timestamp; /**< The order to replay records in: TSC ticks on x86, CLOCK_MONOTONIC nanoseconds elsewhere */
+    uint64_t ptr; /**< Block returned or freed */
+    uint64_t old; /**< Block passed to turealloc, element count of tucalloc, alignment of tualigned_alloc, 0 otherwise */
+    uint64_t size; /**< Size requested, element size of tucalloc, 0 for tufree */
+    uint32_t thread; /**< Small sequential id of the calling thread */
+    uint32_t op; /**< One of tualloc_record_op */
+} tualloc_record;
+
+/**
+ * Start logging every tumalloc, tucalloc, turealloc, aligned allocation and tufree call to fd
+ * as a stream of tualloc_record. Records are buffered per thread and each
+ * full buffer goes out in a single write, so a thread's records stay in
+ * order but threads interleave in blocks; sort by timestamp to merge them.
+ * Returns 0 on success and -1 if a recording is already running.
+ * Thread-safe.
+ */
+int tumalloc_record_start(int fd);
+
+/**
+ * Stop recording and write out every thread's buffered records. fd is not
+ * closed. Returns 0 on success and -1 if nothing was being recorded or a
+ * write failed. Thread-safe.
+ */
+int tumalloc_record_stop(void);
+
+/**
+ * Start sampling allocations: on average one allocation per sample_bytes
+ * bytes allocated, with exponentially distributed gaps, has its call
+ * stack captured and is tracked until it is freed. 0 picks the default of
+ * 512 KiB. Returns 0 on success and -1 if profiling is already running.
+ * Thread-safe.
+ */
+int tumalloc_profile_start(size_t sample_bytes);
+
+/**
+ * Stop sampling and forget every sample. Returns 0 on success and -1 if
+ * profiling was not running. Thread-safe.
+ */
+int tumalloc_profile_stop(void);
+
+/**
+ * Write the sampled allocations that are still live to fd as a heap
+ * profile in the legacy gperftools text format, followed by the process's
+ * mappings, so "pprof program file" can symbolise it. fd is not closed.
+ * Returns 0 on success and -1 on a write error or when profiling is not
+ * running. Thread-safe.
+ */
+int tumalloc_profile_dump(int fd);
+
+#define TU_STATS_CLASSES 64 /**< Size classes in tualloc_stats, see tumalloc_stats_print for their bounds */
+
+/**
+ * A snapshot of the allocator's counters, filled in by tumalloc_stats
+ *
+ * Blocks in thread caches and fast bins count as allocated by the heap but
+ * not by the program, so allocated + cached + fast_bytes + free_bytes plus
+ * per-block overhead adds up to what the heaps reserved. A block cached by
+ * tufree_sized counts as cached with the class of the size it was given, so
+ * whatever it holds past that (slack from a split, or more for a smaller
+ * size) counts as allocated until the block leaves the cache.
+ */
+typedef struct tualloc_stats {
+    size_t requested; /**< Bytes asked for by every successful allocation since the start */
+    size_t allocated; /**< Payload bytes of the blocks the program holds now */
+    size_t cached; /**< Payload bytes sitting in thread caches */
+    size_t reserved; /**< Bytes currently obtained from the OS: the main heap, heap chunks and large mappings */
+    size_t mmapped; /**< The part of reserved held by large allocations with a mapping of their own */
+    size_t committed; /**< Bytes counted against TU_M_SOFT_LIMIT: what reserved adds up to, read from a single counter */
+    size_t pressure_events; /**< Failed allocations that trimmed the heaps to try again */
+    size_t free_bytes; /**< Payload bytes on the free lists */
+    size_t fast_bytes; /**< Payload bytes freed into fast bins and not merged yet */
+    double fragmentation; /**< Share of reserved that is not allocated, from 0 to 1 */
+    size_t mallocs; /**< Successful allocations */
+    size_t frees; /**< Blocks freed */
+    size_t tcache_hits; /**< Allocations served by a thread cache without taking a lock */
+    size_t mmaps; /**< Allocations that got a mapping of their own */
+    size_t fit_searches; /**< Free list searches, one per allocation that reached a heap */
+    size_t fit_hits; /**< Searches that reused a free block */
+    size_t heap_grows; /**< Searches that fell through to growing the main heap or a new heap chunk */
+    size_t fit_steps; /**< Free blocks looked at by every search together */
+    size_t fit_max_steps; /**< Most free blocks a single search looked at */
+    size_t splits; /**< Blocks split to fit a request */
+    size_t coalesces; /**< Free neighbors merged */
+    size_t consolidations; /**< Times a heap merged its fast bins into the free lists */
+    size_t consolidated; /**< Blocks those merges took out of fast bins */
+    uint64_t consolidate_ns; /**< Nanoseconds spent merging fast bins */
+    size_t free_blocks[TU_STATS_CLASSES]; /**< Length of the free list of each size class, over every heap */
+    struct {
+        size_t heaps; /**< Heaps whose chunks are bound to the node, 0 on a machine with a single node */
+        size_t reserved; /**< Bytes of chunks bound to the node */
+        size_t free_bytes; /**< The part of reserved on free lists */
+    } nodes[TU_MAX_NODES]; /**< Per NUMA node counters, large mappings are not included */
+} tualloc_stats;
+
+/**
+ * Fill stats with the sum of every heap's and every thread's counters.
+ * Counting is always on and costs a few thread-local stores per call; the
+ * work of adding everything up is only done here. Thread-safe, but the
+ * snapshot is not atomic while other threads allocate.
+ */
+void tumalloc_stats(tualloc_stats *stats);
+
+/**
+ * Write a human-readable summary of tumalloc_stats to fd. Returns 0 on
+ * success and -1 on a write error. Thread-safe.
+ */
+int tumalloc_stats_print(int fd);
+
+/**
+ * Give free memory back to the OS: merge the fast bins, shrink the main
+ * heap down to pad free bytes at its top and release the pages inside
+ * every free block. Frees do
+ * this on their own past TU_M_TRIM_THRESHOLD. Returns 1 if any memory was
+ * released and 0 otherwise. Thread-safe.
+ */
+int tumalloc_trim(size_t pad);
+
+/**
+ * Called when an allocation of size bytes failed even after the heaps were
+ * trimmed, typically because it would have gone past TU_M_SOFT_LIMIT. arg
+ * is what was registered with the handler. The handler may free memory, and
+ * the allocation is tried once more when it returns; allocations it makes
+ * itself fail rather than call it again.
+ */
+typedef void (*tualloc_low_memory_fn)(size_t size, void *arg);
+
+/**
+ * Register the low-memory handler, replacing the previous one; NULL
+ * removes it. Thread-safe.
+ */
+void tumalloc_set_low_memory_handler(tualloc_low_memory_fn fn, void *arg);
+
+/**
+ * What a tualloc_layout_entry describes
+ */
+enum tualloc_layout_kind {
+    TU_LAYOUT_REGION = 1, /**< A stretch of a heap, the blocks in it follow: the main heap's segments, chunks, large mappings of a tuheap */
+    TU_LAYOUT_USED = 2, /**< A block held by the program or a thread cache */
+    TU_LAYOUT_FREE = 3, /**< A block on a free list */
+    TU_LAYOUT_FAST = 4, /**< A freed block waiting in a fast bin, not coalesced yet */
+};
+
+#define TU_LAYOUT_TREE (-2) /**< tualloc_layout_entry.list of a free block in the best-fit tree */
+
+/**
+ * One record of the map written by tumalloc_dump_layout
+ */
+typedef struct tualloc_layout_entry {
+    uint64_t addr; /**< Address of the block's header, or of the region's first byte */
+    uint64_t size; /**< Payload bytes of the block, or bytes of the region */
+    uint32_t heap; /**< Heap the block belongs to, numbered in registry order from 0 for the main heap */
+    uint16_t kind; /**< One of tualloc_layout_kind */
+    int16_t list; /**< Size class of the free list or fast bin the block is on, TU_LAYOUT_TREE, or -1 */
+} tualloc_layout_entry;
+
+/**
+ * Write a map of every heap to fd as an array of tualloc_layout_entry in
+ * address order within each region: a TU_LAYOUT_REGION entry, then one
+ * entry per block in it, found by walking the boundary tags. Blocks with a
+ * mapping of their own from tumalloc are left out. Each heap's lock is
+ * held only while one chunk, or a chunk's worth of the main heap's blocks,
+ * is copied out; where main heap blocks merged across the end of such a
+ * window meanwhile, the walk picks up at the next block past it. Returns 0
+ * on success and -1 on a write error. Thread-safe.
+ */
+int tumalloc_dump_layout(int fd);
+
+/**
+ * Change an allocator setting, param is one of the TU_M_* constants.
+ * Returns 1 on success and 0 if param is unknown. Thread-safe.
+ */
+int tumallopt(int param, size_t value);
+
 #endif //CYB3053_PROJECT2_ALLOC_H
@@ -0,0 +1,167 @@
+#include "alloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT 16 /**< Alignment of everything tuarena_alloc returns, same as tumalloc */
+#define ARENA_CHUNK_SIZE (64 * 1024) /**< Default bytes per chunk, including its header */
+#define ARENA_HEADER ((sizeof(arena_chunk) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1)) /**< Bytes before the first allocation of a chunk */
+
+/**
+ * Header at the start of every arena chunk
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next; /**< Older chunk in the used list, or next chunk in the cache */
+    char *end; /**< One past the last usable byte */
+} arena_chunk;
+
+/**
+ * A region allocator: bump allocation out of a list of chunks
+ */
+struct tuarena {
+    size_t chunk_size; /**< Bytes requested from tumalloc for an ordinary chunk */
+    arena_chunk *chunks; /**< Chunks in use, newest (the one being bumped) first */
+    char *top; /**< Next free byte in the newest chunk */
+    arena_chunk *cache; /**< Chunks released by rewind or reset, kept for reuse */
+};
+
+/**
+ * Make a chunk with at least size usable bytes the newest one
+ *
+ * A cached chunk that is big enough is reused before asking tumalloc for a
+ * new one; requests bigger than the chunk size get a chunk of their own size.
+ *
+ * @param arena The arena
+ * @param size The aligned number of bytes needed
+ * @return 0 on success, -1 if memory ran out
+ */
+static int arena_grow(tuarena *arena, size_t size) {
+    arena_chunk **link = &arena->cache;
+    while (*link != NULL && (size_t)((*link)->end - ((char *)*link + ARENA_HEADER)) < size) {
+        link = &(*link)->next;
+    }
+
+    arena_chunk *c = *link;
+    if (c != NULL) {
+        *link = c->next;
+    } else {
+        size_t length = size + ARENA_HEADER > arena->chunk_size ? size + ARENA_HEADER : arena->chunk_size;
+
+        c = tumalloc(length);
+        if (c == NULL) {
+            return -1;
+        }
+        c->end = (char *)c + length;
+    }
+
+    c->next = arena->chunks;
+    arena->chunks = c;
+    arena->top = (char *)c + ARENA_HEADER;
+    return 0;
+}
+
+/**
+ * Create an empty arena
+ *
+ * @param chunk_size Bytes per chunk, 0 for the 64 KiB default
+ * @return The new arena or NULL if memory ran out
+ */
+tuarena *tuarena_create(size_t chunk_size) {
+    tuarena *arena = tumalloc(sizeof(tuarena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->chunk_size = chunk_size != 0 ? chunk_size : ARENA_CHUNK_SIZE;
+    arena->chunks = NULL;
+    arena->top = NULL;
+    arena->cache = NULL;
+
+    return arena;
+}
+
+/**
+ * Allocate from an arena by bumping a pointer
+ *
+ * @param arena The arena
+ * @param size The number of bytes to allocate
+ * @return A 16-byte aligned pointer valid until the arena is rewound past it, reset or destroyed
+ */
+void *tuarena_alloc(tuarena *arena, size_t size) {
+    if (size > PTRDIFF_MAX) {
+        return NULL;
+    }
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (arena->chunks == NULL || (size_t)(arena->chunks->end - arena->top) < size) {
+        if (arena_grow(arena, size) != 0) {
+            return NULL;
+        }
+    }
+
+    void *ptr = arena->top;
+    arena->top += size;
+    return ptr;
+}
+
+/**
+ * Remember how much of an arena is in use
+ *
+ * @param arena The arena
+ * @return A savepoint to pass to tuarena_rewind
+ */
+tuarena_savepoint tuarena_mark(tuarena *arena) {
+    tuarena_savepoint mark = { arena->chunks, arena->top };
+    return mark;
+}
+
+/**
+ * Release everything allocated after a savepoint
+ *
+ * Chunks that become unused go to the arena's cache.
+ *
+ * @param arena The arena
+ * @param mark A savepoint taken on this arena that has not been rewound past since
+ */
+void tuarena_rewind(tuarena *arena, tuarena_savepoint mark) {
+    while (arena->chunks != NULL && arena->chunks != mark.chunk) {
+        arena_chunk *c = arena->chunks;
+        arena->chunks = c->next;
+        c->next = arena->cache;
+        arena->cache = c;
+    }
+
+    arena->top = mark.top;
+}
+
+/**
+ * Release everything allocated from an arena, keeping its chunks for reuse
+ *
+ * @param arena The arena
+ */
+void tuarena_reset(tuarena *arena) {
+    tuarena_savepoint empty = { NULL, NULL };
+    tuarena_rewind(arena, empty);
+}
+
+/**
+ * Destroy an arena and give all of its chunks back to the allocator
+ *
+ * @param arena The arena, NULL is ignored
+ */
+void tuarena_destroy(tuarena *arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    tuarena_reset(arena);
+
+    arena_chunk *c = arena->cache;
+    while (c != NULL) {
+        arena_chunk *next = c->next;
+        tufree(c);
+        c = next;
+    }
+
+    tufree(arena);
+}
@@ -0,0 +1,873 @@
+#define _GNU_SOURCE
+#include "alloc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OPS 200000 // Default timed operations per thread
+#define BENCH_THREADS 4 // Default number of threads
+#define BENCH_SLOTS 4096 // Live objects a churn thread keeps around
+#define LARSON_SLOTS 1000 // Live objects per larson thread
+#define LARSON_ROUNDS 10 // Times every larson thread hands its objects to a neighbour
+#define MSTRESS_TRANSFER 1024 // Objects shared between all mstress threads
+#define RING_SIZE 1024 // Capacity of a producer/consumer ring, a power of two
+#define REALLOC_BUFFERS 8 // Buffers grown in turn by the realloc benchmark
+#define REALLOC_MAX (256 * 1024) // A realloc buffer starts over once it is this big
+#define LIVE_PUBLISH 1024 // Operations between two updates of the shared live byte counts
+#define MAX_THREADS 64 // Most threads a benchmark can use
+#define BENCH_THRESHOLD 25.0 // Default percent a ratio may drop below its baseline before -b fails
+#define BENCH_RETRIES 2 // Extra runs a benchmark gets to get back over its baseline, so one noisy run doesn't fail it
+
+/**
+ * An allocator under test
+ */
+typedef struct bench_allocator {
+    const char *name; // Name printed in the report
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} bench_allocator;
+
+static const bench_allocator ALLOCATORS[] = {
+    { "tualloc", tumalloc, tufree, turealloc },
+    { "glibc", malloc, free, realloc },
+};
+
+/**
+ * An object a benchmark keeps alive, with the size it asked for
+ */
+typedef struct bench_object {
+    void *ptr;
+    size_t size;
+} bench_object;
+
+/**
+ * Per-thread state handed to every benchmark thread
+ */
+typedef struct bench_thread {
+    const bench_allocator *alloc; // Allocator under test
+    int id; // Index of the thread in the run
+    size_t ops; // Timed operations to perform
+    uint64_t rng; // xorshift state
+    uint32_t *samples; // Latency of every operation in nanoseconds
+    size_t nsamples; // Samples recorded so far
+    long live; // Requested bytes this thread allocated minus the ones it freed
+    long peak; // Highest sum of every thread's live seen by this thread
+    size_t counter; // Operations since live was last published
+} bench_thread;
+
+/**
+ * What a benchmark child process reports back to the driver
+ */
+typedef struct bench_result {
+    double ops_per_sec;
+    uint32_t p50, p99, p999; // Latency percentiles in nanoseconds
+    long rss_kib; // Peak resident memory increase while the benchmark ran
+    double fragmentation; // rss_kib divided by the peak live requested bytes
+} bench_result;
+
+/**
+ * A benchmark: setup and thread body
+ */
+typedef struct benchmark {
+    const char *name; // Name used on the command line and in the report
+    const char *description; // One line for the usage message
+    int (*threads)(int requested); // Number of threads for a requested thread count
+    void (*prepare)(int nthreads); // Shared state setup before the threads start, may be NULL
+    void *(*run)(void *arg); // Thread body, arg is a bench_thread
+} benchmark;
+
+static long shared_live[MAX_THREADS]; // Published live byte counts of every thread
+static int live_threads; // Number of used entries of shared_live
+static pthread_barrier_t start_barrier; // Released once every thread is ready
+
+/**
+ * Advance a xorshift generator
+ *
+ * @param t The thread owning the generator
+ * @return The next pseudo-random number
+ */
+static uint64_t next_random(bench_thread *t) {
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return t->rng;
+}
+
+/**
+ * Pick a size with a small-biased distribution: mostly up to 256 bytes,
+ * some up to 4 KiB and a few up to 64 KiB
+ *
+ * @param t The thread picking the size
+ * @return The size in bytes, at least 16
+ */
+static size_t random_size(bench_thread *t) {
+    uint64_t r = next_random(t);
+    unsigned bucket = r % 100;
+    r >>= 8;
+    if (bucket < 70) {
+        return 16 + r % 241;
+    }
+    if (bucket < 95) {
+        return 257 + r % 3840;
+    }
+    return 4097 + r % 61440;
+}
+
+/**
+ * Get the current time
+ *
+ * @return Nanoseconds of CLOCK_MONOTONIC
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Record the latency of one operation
+ *
+ * @param t The thread that performed it
+ * @param start When it started
+ */
+static void record(bench_thread *t, uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    if (t->nsamples < t->ops) {
+        t->samples[t->nsamples++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    }
+}
+
+/**
+ * Account for requested bytes, publishing the thread's count now and then
+ *
+ * @param t The thread that allocated (delta > 0) or freed (delta < 0)
+ * @param delta The requested bytes gained or lost
+ */
+static void account(bench_thread *t, long delta) {
+    t->live += delta;
+    if (++t->counter < LIVE_PUBLISH) {
+        return;
+    }
+    t->counter = 0;
+
+    __atomic_store_n(&shared_live[t->id], t->live, __ATOMIC_RELAXED);
+    long total = 0;
+    for (int i = 0; i < live_threads; i++) {
+        total += __atomic_load_n(&shared_live[i], __ATOMIC_RELAXED);
+    }
+    if (total > t->peak) {
+        t->peak = total;
+    }
+}
+
+/**
+ * Allocate and touch an object, timing the allocation
+ *
+ * @param t The allocating thread
+ * @param size The size to request
+ * @return The object, ptr is NULL if memory ran out
+ */
+static bench_object timed_alloc(bench_thread *t, size_t size) {
+    uint64_t start = now_ns();
+    bench_object o = { t->alloc->malloc(size), size };
+    record(t, start);
+
+    if (o.ptr != NULL) {
+        // Touch both ends so the memory really is resident
+        ((char *)o.ptr)[0] = 1;
+        ((char *)o.ptr)[size - 1] = 1;
+        account(t, (long)size);
+    }
+    return o;
+}
+
+/**
+ * Free an object, timing the free
+ *
+ * @param t The freeing thread
+ * @param o The object, a NULL ptr is ignored
+ */
+static void timed_free(bench_thread *t, bench_object *o) {
+    if (o->ptr == NULL) {
+        return;
+    }
+
+    uint64_t start = now_ns();
+    t->alloc->free(o->ptr);
+    record(t, start);
+
+    account(t, -(long)o->size);
+    o->ptr = NULL;
+}
+
+/**
+ * Free every object of an array without timing it
+ *
+ * @param t The freeing thread
+ * @param objects The array
+ * @param count Number of objects in it
+ */
+static void release_all(bench_thread *t, bench_object *objects, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (objects[i].ptr != NULL) {
+            t->alloc->free(objects[i].ptr);
+            objects[i].ptr = NULL;
+        }
+    }
+}
+
+/**
+ * Thread count for benchmarks that run the requested number of threads
+ */
+static int same_threads(int requested) {
+    return requested;
+}
+
+/**
+ * Shared churn loop: pick a slot at random, free it if it is used,
+ * otherwise fill it, so about half of the slots stay live
+ *
+ * @param t The thread
+ * @param fixed The size of every object, 0 for random sizes
+ */
+static void churn(bench_thread *t, size_t fixed) {
+    bench_object slots[BENCH_SLOTS] = { 0 };
+
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < t->ops; i++) {
+        bench_object *slot = &slots[next_random(t) % BENCH_SLOTS];
+        if (slot->ptr != NULL) {
+            timed_free(t, slot);
+        } else {
+            *slot = timed_alloc(t, fixed != 0 ? fixed : random_size(t));
+        }
+    }
+
+    release_all(t, slots, BENCH_SLOTS);
+}
+
+/**
+ * Fixed-size churn: 64-byte objects only
+ */
+static void *fixed_run(void *arg) {
+    churn(arg, 64);
+    return NULL;
+}
+
+/**
+ * Random-size churn: sizes from random_size
+ */
+static void *random_run(void *arg) {
+    churn(arg, 0);
+    return NULL;
+}
+
+/**
+ * A single-producer single-consumer ring of objects
+ */
+typedef struct ring {
+    bench_object items[RING_SIZE];
+    size_t head; // Next slot the consumer reads, written by the consumer
+    size_t tail; // Next slot the producer writes, written by the producer
+} ring;
+
+static ring *rings; // One ring per producer/consumer pair
+
+/**
+ * Producer/consumer uses pairs of threads, at least one
+ */
+static int pair_threads(int requested) {
+    return requested < 2 ? 2 : requested & ~1;
+}
+
+/**
+ * Allocate the rings of the producer/consumer pairs
+ */
+static void prodcon_prepare(int nthreads) {
+    rings = mmap(NULL, sizeof(ring) * (size_t)(nthreads / 2), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED) {
+        perror("mmap");
+        _exit(1);
+    }
+}
+
+/**
+ * Producer/consumer: even threads allocate, the next odd thread frees, so
+ * every free is a cross-thread free
+ */
+static void *prodcon_run(void *arg) {
+    bench_thread *t = arg;
+    ring *r = &rings[t->id / 2];
+    int producer = t->id % 2 == 0;
+
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < t->ops; i++) {
+        if (producer) {
+            size_t tail = r->tail;
+            while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+                sched_yield();
+            }
+            r->items[tail % RING_SIZE] = timed_alloc(t, random_size(t) % 512 + 16);
+            __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+        } else {
+            size_t head = r->head;
+            while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+                sched_yield();
+            }
+            timed_free(t, &r->items[head % RING_SIZE]);
+            __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Realloc growth: grow buffers in turn by a quarter at a time until they
+ * reach REALLOC_MAX, then start them over
+ */
+static void *realloc_run(void *arg) {
+    bench_thread *t = arg;
+    bench_object buffers[REALLOC_BUFFERS] = { 0 };
+
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < t->ops; i++) {
+        bench_object *b = &buffers[next_random(t) % REALLOC_BUFFERS];
+        if (b->size >= REALLOC_MAX) {
+            timed_free(t, b);
+            b->size = 0;
+            continue;
+        }
+
+        size_t size = b->size + b->size / 4 + 16;
+        uint64_t start = now_ns();
+        void *ptr = t->alloc->realloc(b->ptr, size);
+        record(t, start);
+        if (ptr == NULL) {
+            continue;
+        }
+
+        ((char *)ptr)[size - 1] = 1;
+        account(t, (long)(size - b->size));
+        b->ptr = ptr;
+        b->size = size;
+    }
+
+    release_all(t, buffers, REALLOC_BUFFERS);
+    return NULL;
+}
+
+static bench_object (*larson_slots)[LARSON_SLOTS]; // Object arrays, passed on every round
+static pthread_barrier_t round_barrier; // Separates larson and mstress rounds
+
+/**
+ * Allocate the larson object arrays
+ */
+static void larson_prepare(int nthreads) {
+    larson_slots = mmap(NULL, sizeof(*larson_slots) * (size_t)nthreads, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (larson_slots == MAP_FAILED) {
+        perror("mmap");
+        _exit(1);
+    }
+    pthread_barrier_init(&round_barrier, NULL, (unsigned)nthreads);
+}
+
+/**
+ * Larson: replace random objects of 16..512 bytes, and every round pass the
+ * whole array to the next thread, which frees what the previous one allocated
+ */
+static void *larson_run(void *arg) {
+    bench_thread *t = arg;
+    size_t per_round = t->ops / LARSON_ROUNDS;
+
+    pthread_barrier_wait(&start_barrier);
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        bench_object *slots = larson_slots[(t->id + round) % live_threads];
+        for (size_t i = 0; i < per_round / 2; i++) {
+            bench_object *slot = &slots[next_random(t) % LARSON_SLOTS];
+            timed_free(t, slot);
+            *slot = timed_alloc(t, 16 + next_random(t) % 497);
+        }
+        pthread_barrier_wait(&round_barrier);
+    }
+
+    // Arrays are shifted by LARSON_ROUNDS, so each is released exactly once
+    release_all(t, larson_slots[(t->id + LARSON_ROUNDS) % live_threads], LARSON_SLOTS);
+    return NULL;
+}
+
+static bench_object *transfer; // Objects any mstress thread may take over
+
+/**
+ * Allocate the shared mstress transfer array and the barrier before it is emptied
+ */
+static void mstress_prepare(int nthreads) {
+    transfer = mmap(NULL, sizeof(bench_object) * MSTRESS_TRANSFER, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (transfer == MAP_FAILED) {
+        perror("mmap");
+        _exit(1);
+    }
+    pthread_barrier_init(&round_barrier, NULL, (unsigned)nthreads);
+}
+
+/**
+ * mstress: objects with mixed sizes and lifetimes, a tenth of them handed
+ * over through a shared array and freed by whichever thread finds them
+ */
+static void *mstress_run(void *arg) {
+    bench_thread *t = arg;
+    bench_object slots[BENCH_SLOTS] = { 0 };
+    static pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < t->ops; i++) {
+        uint64_t r = next_random(t);
+        bench_object *slot = &slots[(r >> 8) % BENCH_SLOTS];
+        unsigned action = r % 100;
+
+        if (action < 10 && slot->ptr != NULL) {
+            // Swap with the shared array, the lock is not timed
+            pthread_mutex_lock(&transfer_lock);
+            bench_object *shared = &transfer[(r >> 20) % MSTRESS_TRANSFER];
+            bench_object taken = *shared;
+            *shared = *slot;
+            pthread_mutex_unlock(&transfer_lock);
+
+            // The live bytes move with the object
+            account(t, (long)taken.size - (long)slot->size);
+            *slot = taken;
+            timed_free(t, slot);
+        } else if (action < 60 && slot->ptr == NULL) {
+            *slot = timed_alloc(t, random_size(t));
+        } else {
+            timed_free(t, slot);
+        }
+    }
+
+    release_all(t, slots, BENCH_SLOTS);
+    pthread_barrier_wait(&round_barrier);
+    if (t->id == 0) {
+        release_all(t, transfer, MSTRESS_TRANSFER);
+    }
+    return NULL;
+}
+
+static const benchmark BENCHMARKS[] = {
+    { "fixed", "fixed-size churn of 64-byte objects", same_threads, NULL, fixed_run },
+    { "random", "random-size churn, mostly small objects", same_threads, NULL, random_run },
+    { "prodcon", "producer/consumer pairs, every free is cross-thread", pair_threads, prodcon_prepare, prodcon_run },
+    { "realloc", "buffers grown by a quarter at a time with realloc", same_threads, NULL, realloc_run },
+    { "larson", "larson: random replacement, arrays passed between threads", same_threads, larson_prepare,
+      larson_run },
+    { "mstress", "mstress: mixed lifetimes, objects migrate between threads", same_threads, mstress_prepare,
+      mstress_run },
+};
+
+#define NUM_BENCHMARKS (sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]))
+#define NUM_ALLOCATORS (sizeof(ALLOCATORS) / sizeof(ALLOCATORS[0]))
+
+/**
+ * Compare two latency samples for qsort
+ */
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Get the resident set size of the process
+ *
+ * @return Resident memory in KiB
+ */
+static long resident_kib(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Run one benchmark against one allocator, in the calling process
+ *
+ * Sample buffers come from mmap and are touched before the baseline resident
+ * size is taken, so neither allocator is charged for them.
+ *
+ * @param b The benchmark
+ * @param alloc The allocator
+ * @param requested Requested number of threads
+ * @param ops Timed operations per thread
+ * @param seed Seed of the random generators
+ * @param result Filled in on success
+ * @return 0 on success, -1 on failure
+ */
+static int run_benchmark(const benchmark *b, const bench_allocator *alloc, int requested, size_t ops,
+                         uint64_t seed, bench_result *result) {
+    int nthreads = b->threads(requested);
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+    live_threads = nthreads;
+
+    size_t total = (size_t)nthreads * ops;
+    uint32_t *samples = mmap(NULL, total * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+        return -1;
+    }
+    memset(samples, 0, total * sizeof(uint32_t));
+
+    bench_thread threads[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = (bench_thread){
+            .alloc = alloc,
+            .id = i,
+            .ops = ops,
+            .rng = seed + 0x9e3779b97f4a7c15u * (uint64_t)(i + 1),
+            .samples = samples + (size_t)i * ops,
+        };
+    }
+
+    if (b->prepare != NULL) {
+        b->prepare(nthreads);
+    }
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1);
+    long baseline = resident_kib();
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&ids[i], NULL, b->run, &threads[i]) != 0) {
+            return -1;
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    // Compact the samples of every thread into one array
+    size_t count = 0;
+    long peak = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memmove(samples + count, threads[i].samples, threads[i].nsamples * sizeof(uint32_t));
+        count += threads[i].nsamples;
+        if (threads[i].peak > peak) {
+            peak = threads[i].peak;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+    qsort(samples, count, sizeof(uint32_t), compare_samples);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    result->ops_per_sec = (double)count / seconds;
+    result->p50 = samples[count / 2];
+    result->p99 = samples[count * 99 / 100];
+    result->p999 = samples[count * 999 / 1000];
+    result->rss_kib = usage.ru_maxrss > baseline ? usage.ru_maxrss - baseline : 0;
+    result->fragmentation = peak > 0 ? (double)result->rss_kib * 1024 / (double)peak : 0;
+    return 0;
+}
+
+/**
+ * Run one benchmark against one allocator in a child process, so both
+ * allocators start from a fresh heap and peak RSS is measured separately
+ *
+ * @return 0 on success, -1 if the child failed
+ */
+static int run_isolated(const benchmark *b, const bench_allocator *alloc, int threads, size_t ops, uint64_t seed,
+                        bench_result *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        bench_result r;
+        int ok = run_benchmark(b, alloc, threads, ops, seed, &r) == 0
+            && write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r);
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return n == (ssize_t)sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * Read the tualloc/glibc throughput ratios a run with -w stored
+ *
+ * Lines are "benchmark ratio", # starts a comment. Benchmarks the file
+ * doesn't name keep a baseline of 0 and are never checked.
+ *
+ * @param path The baseline file
+ * @param baseline Where to store the ratio of each benchmark
+ * @return 0 on success, -1 if the file can't be read or has a bad line
+ */
+static int read_baseline(const char *path, double *baseline) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char name[32];
+        double ratio;
+        int n = sscanf(line, " %31s %lf", name, &ratio);
+        if (n <= 0) {
+            continue;
+        }
+        size_t i = 0;
+        while (i < NUM_BENCHMARKS && strcmp(name, BENCHMARKS[i].name) != 0) {
+            i++;
+        }
+        if (n != 2 || i == NUM_BENCHMARKS || ratio <= 0) {
+            fprintf(stderr, "%s:%d: expected a benchmark and a positive ratio\n", path, number);
+            fclose(f);
+            return -1;
+        }
+        baseline[i] = ratio;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Store the ratios of a run as a baseline for -b
+ *
+ * @param path The baseline file
+ * @param ratios The ratio of each benchmark, 0 for the ones that did not run
+ * @param threads The -t the run used
+ * @param ops The -n the run used
+ * @return 0 on success, -1 if the file can't be written
+ */
+static int write_baseline(const char *path, const double *ratios, int threads, size_t ops) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "# tualloc/glibc throughput ratios from tualloc_bench -t %d -n %zu, compare with the same options\n",
+            threads, ops);
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+        if (ratios[i] > 0) {
+            fprintf(f, "%-8s %.2f\n", BENCHMARKS[i].name, ratios[i]);
+        }
+    }
+
+    if (fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Print how to run the benchmark
+ *
+ * @param prog The program name
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-a tualloc|glibc] [-t threads] [-n ops] [-s seed] [-p bytes] [-b baseline [-r percent]]\n"
+                    "       [-w baseline] [benchmark...]\n\n", prog);
+    fprintf(stderr, "  -a  only run one allocator (default: both, tualloc first)\n");
+    fprintf(stderr, "  -t  threads per benchmark (default %d)\n", BENCH_THREADS);
+    fprintf(stderr, "  -n  timed operations per thread (default %d)\n", BENCH_OPS);
+    fprintf(stderr, "  -s  random seed (default 1)\n");
+    fprintf(stderr, "  -p  run with the heap profiler sampling every bytes on average (0: its default)\n");
+    fprintf(stderr, "  -b  fail if a tualloc/glibc throughput ratio drops below the one stored in baseline\n");
+    fprintf(stderr, "  -r  percent a ratio may drop below its baseline (default %.0f)\n", BENCH_THRESHOLD);
+    fprintf(stderr, "  -w  store the ratios of this run in baseline\n\n");
+    fprintf(stderr, "benchmarks (default: all):\n");
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+        fprintf(stderr, "  %-8s %s\n", BENCHMARKS[i].name, BENCHMARKS[i].description);
+    }
+}
+
+/**
+ * Run the selected benchmarks against the selected allocators and print a
+ * table, with the tualloc/glibc throughput ratio when both ran
+ *
+ * Comparing against glibc on the same machine in the same run keeps a
+ * stored baseline meaningful across machines. A benchmark whose ratio
+ * drops more than the threshold below its baseline is run again up to
+ * BENCH_RETRIES times, and counts as a regression if none of the runs
+ * gets back over it.
+ *
+ * @return 0 if every run succeeded and nothing regressed, 1 otherwise
+ */
+int main(int argc, char **argv) {
+    const char *only = NULL;
+    int threads = BENCH_THREADS;
+    size_t ops = BENCH_OPS;
+    uint64_t seed = 1;
+    long long profile = -1;
+    const char *baseline_path = NULL, *write_path = NULL;
+    double threshold = BENCH_THRESHOLD;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:t:n:s:p:b:r:w:h")) != -1) {
+        switch (opt) {
+        case 'a':
+            only = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10) | 1;
+            break;
+        case 'p':
+            profile = strtoll(optarg, NULL, 10);
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'r':
+            threshold = strtod(optarg, NULL);
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    // Ratios need both allocators
+    if (threads < 1 || threads > MAX_THREADS || ops < LARSON_ROUNDS * 2 || threshold < 0 || threshold >= 100
+            || (only != NULL && (baseline_path != NULL || write_path != NULL))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    double baseline[NUM_BENCHMARKS] = { 0 };
+    if (baseline_path != NULL && read_baseline(baseline_path, baseline) != 0) {
+        return 1;
+    }
+
+    // Every run forks from here, so each one profiles from its start
+    if (profile >= 0) {
+        tumalloc_profile_start((size_t)profile);
+    }
+
+    int selected[NUM_BENCHMARKS] = { 0 };
+    int any = 0;
+    for (int i = optind; i < argc; i++) {
+        size_t j = 0;
+        while (j < NUM_BENCHMARKS && strcmp(argv[i], BENCHMARKS[j].name) != 0) {
+            j++;
+        }
+        if (j == NUM_BENCHMARKS) {
+            fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+        selected[j] = any = 1;
+    }
+
+    printf("%-8s %-8s %7s %12s %8s %8s %8s %10s %6s\n", "bench", "alloc", "threads", "ops/s", "p50ns", "p99ns",
+           "p999ns", "rss_kib", "frag");
+
+    int failed = 0;
+    double ratios[NUM_BENCHMARKS] = { 0 };
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+        if (any && !selected[i]) {
+            continue;
+        }
+
+        for (int attempt = 0; attempt <= BENCH_RETRIES; attempt++) {
+            double throughput[NUM_ALLOCATORS] = { 0 };
+            for (size_t j = 0; j < NUM_ALLOCATORS; j++) {
+                if (only != NULL && strcmp(only, ALLOCATORS[j].name) != 0) {
+                    continue;
+                }
+
+                bench_result r;
+                if (run_isolated(&BENCHMARKS[i], &ALLOCATORS[j], threads, ops, seed, &r) != 0) {
+                    printf("%-8s %-8s failed\n", BENCHMARKS[i].name, ALLOCATORS[j].name);
+                    failed = 1;
+                    continue;
+                }
+
+                throughput[j] = r.ops_per_sec;
+                printf("%-8s %-8s %7d %12.0f %8u %8u %8u %10ld %6.2f\n", BENCHMARKS[i].name, ALLOCATORS[j].name,
+                       BENCHMARKS[i].threads(threads), r.ops_per_sec, r.p50, r.p99, r.p999, r.rss_kib,
+                       r.fragmentation);
+            }
+
+            if (throughput[0] > 0 && throughput[1] > 0) {
+                double ratio = throughput[0] / throughput[1];
+                if (ratio > ratios[i]) {
+                    ratios[i] = ratio;
+                }
+                printf("%-8s %-8s %7s %11.2fx\n", BENCHMARKS[i].name, "ratio", "", ratio);
+            }
+
+            if (baseline[i] == 0 || ratios[i] >= baseline[i] * (1 - threshold / 100)) {
+                break;
+            }
+        }
+
+        if (baseline[i] > 0) {
+            int regressed = ratios[i] < baseline[i] * (1 - threshold / 100);
+            printf("%-8s %-8s %7s %11.2fx %s\n", BENCHMARKS[i].name, "baseline", "", baseline[i],
+                   regressed ? "REGRESSED" : "ok");
+            failed |= regressed;
+        }
+    }
+
+    if (write_path != NULL && write_baseline(write_path, ratios, threads, ops) != 0) {
+        failed = 1;
+    }
+
+    return failed;
+}
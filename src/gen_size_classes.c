@@ -0,0 +1,249 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// These mirror alloc.c, which checks the generated SIZE_CLASS_* values against its own
+#define ALIGNMENT 16 // The alignment of the memory blocks
+#define BLOCK_HEADER 8 // Bytes in front of every payload
+#define SMALL_MAX 512 // Largest request size with a class of its own
+#define MIN_PAYLOAD (ALIGNMENT + BLOCK_HEADER) // Smallest payload
+#define NUM_SMALL_BINS (SMALL_MAX / ALIGNMENT) // One bin per payload up to SMALL_MAX + BLOCK_HEADER
+
+/**
+ * Get the payload of a bin
+ *
+ * @param bin The bin
+ * @return Its payload size
+ */
+static size_t bin_payload(int bin) {
+    return MIN_PAYLOAD + (size_t)bin * ALIGNMENT;
+}
+
+/**
+ * Get the bin a request lands in before it is rounded up to a class
+ *
+ * @param size The request size, at most SMALL_MAX
+ * @return The bin of its payload
+ */
+static int request_bin(size_t size) {
+    size_t payload = ((size + BLOCK_HEADER + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - BLOCK_HEADER;
+    if (payload < MIN_PAYLOAD) {
+        payload = MIN_PAYLOAD;
+    }
+    return (int)((payload - MIN_PAYLOAD) / ALIGNMENT);
+}
+
+/**
+ * Read the config: "max_waste = percent", "hot_share = percent" and any
+ * number of "class = size" lines, # starts a comment
+ *
+ * @param path The config file
+ * @param max_waste Where to store max_waste
+ * @param hot_share Where to store hot_share
+ * @param required Set for the bin of every class line
+ * @return 0 on success, -1 if the file can't be read or has a bad line
+ */
+static int read_config(const char *path, double *max_waste, double *hot_share, int *required) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char key[32];
+        double value;
+        int n = sscanf(line, " %31[a-z_] = %lf", key, &value);
+        if (n <= 0) {
+            continue;
+        }
+        if (n == 2 && strcmp(key, "max_waste") == 0 && value >= 0 && value < 100) {
+            *max_waste = value / 100;
+        } else if (n == 2 && strcmp(key, "hot_share") == 0 && value > 0 && value <= 100) {
+            *hot_share = value / 100;
+        } else if (n == 2 && strcmp(key, "class") == 0 && value >= 0 && value <= SMALL_MAX) {
+            required[request_bin((size_t)value)] = 1;
+        } else {
+            fprintf(stderr, "%s:%d: expected max_waste, hot_share or class with a value in range\n", path, number);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Count the small requests of a recording made with tumalloc_record_start by bin
+ *
+ * @param path The recording
+ * @param counts Where to add the count of each bin
+ * @return The number of small requests, or -1 if the file can't be read
+ */
+static long long read_histogram(const char *path, unsigned long long *counts) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    long long total = 0;
+    tualloc_record r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        uint64_t size;
+        switch (r.op) {
+        case TU_RECORD_MALLOC:
+        case TU_RECORD_REALLOC:
+        case TU_RECORD_ALIGNED:
+            size = r.size;
+            break;
+        case TU_RECORD_CALLOC:
+            size = r.old != 0 && r.size > SMALL_MAX / r.old ? SMALL_MAX + 1 : r.old * r.size;
+            break;
+        default:
+            continue;
+        }
+        if (size <= SMALL_MAX) {
+            counts[request_bin(size)]++;
+            total++;
+        }
+    }
+
+    fclose(f);
+    return total;
+}
+
+/**
+ * Generate the size class table alloc.c includes
+ *
+ * Classes are picked from the smallest payload up: each one covers as many
+ * bins as it can while rounding the smallest of them up to it wastes at
+ * most max_waste of the class, and never reaches past a required class.
+ * Explicit classes from the config are required, and so is every bin that
+ * has at least hot_share of the histogram's small requests. The largest
+ * small payload is always a class, so every small request has one.
+ *
+ * usage: gen_size_classes -o size_classes.h config [histogram]
+ *
+ * @return 0 if the header was written, 1 otherwise
+ */
+int main(int argc, char **argv) {
+    if (argc < 4 || argc > 5 || strcmp(argv[1], "-o") != 0) {
+        fprintf(stderr, "usage: %s -o size_classes.h config [histogram]\n", argv[0]);
+        return 1;
+    }
+    const char *out_path = argv[2], *config = argv[3], *histogram = argc == 5 ? argv[4] : NULL;
+
+    double max_waste = 0, hot_share = 0.01;
+    int required[NUM_SMALL_BINS] = { 0 };
+    if (read_config(config, &max_waste, &hot_share, required) != 0) {
+        return 1;
+    }
+    required[NUM_SMALL_BINS - 1] = 1;
+
+    unsigned long long counts[NUM_SMALL_BINS] = { 0 };
+    long long total = 0;
+    if (histogram != NULL) {
+        total = read_histogram(histogram, counts);
+        if (total < 0) {
+            return 1;
+        }
+        for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+            if (total > 0 && counts[bin] >= hot_share * (double)total) {
+                required[bin] = 1;
+            }
+        }
+    }
+
+    int ceil_bin[NUM_SMALL_BINS];
+    int floor_bin[NUM_SMALL_BINS];
+    int classes = 0;
+    for (int start = 0; start < NUM_SMALL_BINS;) {
+        int end = start;
+        while (!required[end] && (double)(bin_payload(end + 1) - bin_payload(start)) <= max_waste * (double)bin_payload(end + 1)) {
+            end++;
+        }
+        for (int bin = start; bin <= end; bin++) {
+            ceil_bin[bin] = end;
+        }
+        classes++;
+        start = end + 1;
+    }
+    for (int bin = 0, last = -1; bin < NUM_SMALL_BINS; bin++) {
+        if (ceil_bin[bin] == bin) {
+            last = bin;
+        }
+        floor_bin[bin] = last;
+    }
+
+    // What rounding costs the recorded requests, against exact classes
+    unsigned long long exact = 0, rounded = 0;
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        exact += counts[bin] * bin_payload(bin);
+        rounded += counts[bin] * bin_payload(ceil_bin[bin]);
+    }
+
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL) {
+        perror(out_path);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by gen_size_classes from %s", config);
+    if (histogram != NULL) {
+        fprintf(out, " and %s, whose %lld small requests take %.2f%% more payload than with exact classes",
+                histogram, total, exact != 0 ? 100.0 * (double)(rounded - exact) / (double)exact : 0.0);
+    }
+    fprintf(out, ", do not edit\n");
+    fprintf(out, "#ifndef CYB3053_PROJECT2_SIZE_CLASSES_H\n#define CYB3053_PROJECT2_SIZE_CLASSES_H\n\n");
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "#define SIZE_CLASS_BINS %d /**< Small bins the tables cover, one per payload */\n", NUM_SMALL_BINS);
+    fprintf(out, "#define SIZE_CLASS_MAX_PAYLOAD %zu /**< Payload of the last small bin, always a class */\n",
+            bin_payload(NUM_SMALL_BINS - 1));
+    fprintf(out, "#define SIZE_CLASS_COUNT %d /**< Small payloads that are classes */\n\n", classes);
+
+    fprintf(out, "/**\n * Payload of the class a payload is rounded up to, for constant expressions\n */\n");
+    fprintf(out, "#define SIZE_CLASS_CEIL(payload) \\\n    (");
+    for (int bin = 0; bin < NUM_SMALL_BINS - 1; bin++) {
+        if (ceil_bin[bin] == bin) {
+            fprintf(out, "(payload) <= %zu ? %zu : \\\n     ", bin_payload(bin), bin_payload(bin));
+        }
+    }
+    fprintf(out, "%zu)\n\n", bin_payload(NUM_SMALL_BINS - 1));
+
+    // Entry i covers sizes up to i * ALIGNMENT - BLOCK_HEADER + 1, so entries 0 and 1 both fall in bin 0
+    fprintf(out, "/**\n * Payload of the class a size of at most SIZE_CLASS_MAX_PAYLOAD is rounded up to,\n");
+    fprintf(out, " * indexed by (size + %d) / %d\n */\n", BLOCK_HEADER - 1, ALIGNMENT);
+    fprintf(out, "static const uint16_t size_class_payload[SIZE_CLASS_BINS + 1] = {");
+    for (int i = 0; i <= NUM_SMALL_BINS; i++) {
+        fprintf(out, "%s%zu", i % 8 == 0 ? "\n    " : " ", bin_payload(ceil_bin[i > 0 ? i - 1 : 0]));
+        fprintf(out, i < NUM_SMALL_BINS ? "," : "\n");
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "/**\n * Bin of the largest class at most each small bin's payload, -1 below the smallest class\n */\n");
+    fprintf(out, "static const int8_t size_class_floor_bin[SIZE_CLASS_BINS] = {");
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        fprintf(out, "%s%d", bin % 8 == 0 ? "\n    " : " ", floor_bin[bin]);
+        fprintf(out, bin < NUM_SMALL_BINS - 1 ? "," : "\n");
+    }
+    fprintf(out, "};\n\n#endif //CYB3053_PROJECT2_SIZE_CLASSES_H\n");
+
+    if (fclose(out) != 0) {
+        perror(out_path);
+        return 1;
+    }
+    return 0;
+}
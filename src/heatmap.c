@@ -0,0 +1,208 @@
+#include "alloc.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_LISTS 64 // Free lists reported, more than the allocator has bins
+
+static const char SHADES[] = " .:-=+*#%@"; // Cell characters from all free to all used
+
+/**
+ * What a region's blocks add up to
+ */
+typedef struct region_totals {
+    uint64_t used; // Bytes of allocated blocks, headers included
+    uint64_t free; // Bytes of free and fast bin blocks, headers included
+    uint64_t fast; // Bytes of those that wait in fast bins
+    uint64_t largest; // Biggest free block, header included
+    uint64_t blocks; // Blocks in the region
+} region_totals;
+
+/**
+ * Get the fragmentation of some free memory: the share of it a request for
+ * the largest free block could not use
+ *
+ * @param free Free bytes
+ * @param largest The biggest free block
+ * @return The fragmentation in percent
+ */
+static double fragmentation(uint64_t free, uint64_t largest) {
+    return free != 0 ? 100.0 * (1.0 - (double)largest / (double)free) : 0.0;
+}
+
+/**
+ * Print one region as rows of cells, each shaded by the share of its bytes
+ * that are in use
+ *
+ * @param region The region's entry
+ * @param blocks The entries of its blocks, in address order
+ * @param count How many
+ * @param cell Bytes per cell
+ * @param width Cells per row
+ * @param totals Where to add up the region's blocks
+ */
+static void print_region(const tualloc_layout_entry *region, const tualloc_layout_entry *blocks, size_t count,
+                         uint64_t cell, int width, region_totals *totals) {
+    uint64_t cells = (region->size + cell - 1) / cell;
+    uint64_t *used = calloc(cells, sizeof(uint64_t));
+    uint64_t *covered = calloc(cells, sizeof(uint64_t));
+    if (used == NULL || covered == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const tualloc_layout_entry *b = &blocks[i];
+        uint64_t start = b->addr - region->addr, end = start + sizeof(uint64_t) + b->size;
+        if (end > region->size) {
+            end = region->size;
+        }
+        for (uint64_t at = start; at < end;) {
+            uint64_t c = at / cell, stop = (c + 1) * cell < end ? (c + 1) * cell : end;
+            covered[c] += stop - at;
+            if (b->kind == TU_LAYOUT_USED) {
+                used[c] += stop - at;
+            }
+            at = stop;
+        }
+
+        uint64_t bytes = sizeof(uint64_t) + b->size;
+        totals->blocks++;
+        if (b->kind == TU_LAYOUT_USED) {
+            totals->used += bytes;
+        } else {
+            totals->free += bytes;
+            if (b->kind == TU_LAYOUT_FAST) {
+                totals->fast += bytes;
+            }
+            if (bytes > totals->largest) {
+                totals->largest = bytes;
+            }
+        }
+    }
+
+    printf("heap %u region 0x%llx, %llu KiB: %llu blocks, %llu KiB used, %llu KiB free (%llu in fast bins), "
+           "largest free %llu KiB, fragmentation %.1f%%\n",
+           region->heap, (unsigned long long)region->addr, (unsigned long long)(region->size / 1024),
+           (unsigned long long)totals->blocks, (unsigned long long)(totals->used / 1024),
+           (unsigned long long)(totals->free / 1024), (unsigned long long)(totals->fast / 1024),
+           (unsigned long long)(totals->largest / 1024), fragmentation(totals->free, totals->largest));
+
+    for (uint64_t row = 0; row < cells; row += (uint64_t)width) {
+        printf("  +%010llx |", (unsigned long long)(row * cell));
+        for (uint64_t c = row; c < row + (uint64_t)width && c < cells; c++) {
+            // Bytes no block covers, like a segment's header, count as neither
+            int shade = covered[c] == 0 ? 0 : (int)((used[c] * (sizeof(SHADES) - 2) + covered[c] - 1) / covered[c]);
+            putchar(SHADES[shade]);
+        }
+        printf("|\n");
+    }
+
+    free(used);
+    free(covered);
+}
+
+/**
+ * Render a map written by tumalloc_dump_layout as a fragmentation heatmap
+ *
+ * Every region gets a summary line and rows of cells shaded from ' ' (all
+ * free) to '@' (all in use), then the free lists are summed up over all
+ * regions.
+ *
+ * usage: tualloc_heatmap [-c cell_bytes] [-w cells_per_row] layout
+ *
+ * @return 0 on success, 1 on a usage or file error
+ */
+int main(int argc, char **argv) {
+    uint64_t cell = 4096;
+    int width = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:w:h")) != -1) {
+        if (opt == 'c' && (cell = strtoull(optarg, NULL, 0)) != 0) {
+            continue;
+        }
+        if (opt == 'w' && (width = atoi(optarg)) > 0) {
+            continue;
+        }
+        fprintf(stderr, "usage: %s [-c cell_bytes] [-w cells_per_row] layout\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-c cell_bytes] [-w cells_per_row] layout\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t count = (size_t)st.st_size / sizeof(tualloc_layout_entry);
+    if (count == 0) {
+        fprintf(stderr, "%s: no entries\n", argv[optind]);
+        return 1;
+    }
+    const tualloc_layout_entry *entries = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (entries == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    region_totals all = { 0 };
+    uint64_t list_blocks[MAX_LISTS + 1] = { 0 }, list_bytes[MAX_LISTS + 1] = { 0 };
+    for (size_t i = 0; i < count;) {
+        if (entries[i].kind != TU_LAYOUT_REGION) {
+            fprintf(stderr, "%s: entry %zu is not in a region\n", argv[optind], i);
+            return 1;
+        }
+        size_t first = i + 1, end = first;
+        while (end < count && entries[end].kind != TU_LAYOUT_REGION) {
+            // The tree has no size classes, it is reported after them
+            int list = entries[end].list == TU_LAYOUT_TREE ? MAX_LISTS : entries[end].list;
+            if (entries[end].kind != TU_LAYOUT_USED && list >= 0 && list <= MAX_LISTS) {
+                list_blocks[list]++;
+                list_bytes[list] += entries[end].size;
+            }
+            end++;
+        }
+
+        region_totals totals = { 0 };
+        print_region(&entries[i], &entries[first], end - first, cell, width, &totals);
+        all.used += totals.used;
+        all.free += totals.free;
+        all.fast += totals.fast;
+        all.blocks += totals.blocks;
+        if (totals.largest > all.largest) {
+            all.largest = totals.largest;
+        }
+        i = end;
+    }
+
+    printf("total %llu blocks, %llu KiB used, %llu KiB free (%llu in fast bins), fragmentation %.1f%%\n",
+           (unsigned long long)all.blocks, (unsigned long long)(all.used / 1024),
+           (unsigned long long)(all.free / 1024), (unsigned long long)(all.fast / 1024),
+           fragmentation(all.free, all.largest));
+    for (int list = 0; list <= MAX_LISTS; list++) {
+        if (list_blocks[list] == 0) {
+            continue;
+        }
+        if (list == MAX_LISTS) {
+            printf("tree          ");
+        } else {
+            printf("list %-8d ", list);
+        }
+        printf(" %llu blocks, %llu KiB\n", (unsigned long long)list_blocks[list],
+               (unsigned long long)(list_bytes[list] / 1024));
+    }
+
+    munmap((void *)entries, (size_t)st.st_size);
+    return 0;
+}
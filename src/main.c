@@ -1,6 +1,7 @@
 #include "alloc.h"
 
 #include <stdio.h>
+#include <unistd.h>
 
 /**
  * A simple linked list implementation to test the allocator
@@ -108,7 +109,7 @@ void list_remove_all(node *list) {
     node *curr = list;
     while (curr) {
         node *next = curr->next;
-        tufree(curr);
+        tufree_sized(curr, sizeof(node));
         curr = next;
     }
 }
@@ -132,7 +133,7 @@ static node *HEAD = NULL;
 /**
  * Main function to test the allocator
  */
-int main(int argc, char** argv) {
+int main(void) {
     // Allocate some memory
     int *thing = tumalloc(5*sizeof(int));
 
@@ -252,8 +253,15 @@ int main(int argc, char** argv) {
         printf("%d\n", bigger_things[i]);
     }
 
-    // Free the allocated memory
-    tufree(more_things);
+    // Free the allocated memory, more_things was already released by turealloc
+    tufree(bigger_things);
+
+    // Show what all of the above did to the heaps
+    fflush(stdout);
+    if(tumalloc_stats_print(STDOUT_FILENO) != 0) {
+        printf("Stats failed\n");
+        return 1;
+    }
 
     return 0;
 }
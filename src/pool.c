@@ -0,0 +1,150 @@
+#include "alloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_SLAB_SIZE (64 * 1024) /**< Default bytes per slab, including its header */
+#define POOL_MIN_OBJECTS 32 /**< Slabs grow past POOL_SLAB_SIZE to hold at least this many objects */
+
+/**
+ * Header at the start of every slab, the only per-slab metadata
+ */
+typedef struct slab {
+    struct slab *next; /**< Previously created slab of the same pool */
+} slab;
+
+/**
+ * A free object, the link lives in the object itself
+ */
+typedef struct pool_object {
+    struct pool_object *next; /**< Next free object */
+} pool_object;
+
+/**
+ * A pool of fixed-size objects carved from contiguous slabs
+ */
+struct tupool {
+    size_t stride; /**< Distance between objects, obj_size rounded up to align */
+    size_t align; /**< Alignment of every object */
+    size_t slab_size; /**< Bytes requested from tumalloc per slab */
+    slab *slabs; /**< Every slab of the pool, newest first */
+    pool_object *free_list; /**< Objects returned with tupool_free */
+    char *bump; /**< Next never-used object in the newest slab */
+    char *bump_end; /**< End of the newest slab */
+};
+
+/**
+ * Create a pool of objects of one size
+ *
+ * @param obj_size The size of every object
+ * @param align The alignment of every object, a power of two, 0 for the tumalloc default
+ * @return The new pool or NULL if align is invalid or memory ran out
+ */
+tupool *tupool_create(size_t obj_size, size_t align) {
+    if (align == 0) {
+        align = 16;
+    }
+    if ((align & (align - 1)) != 0 || obj_size > PTRDIFF_MAX / POOL_MIN_OBJECTS) {
+        return NULL;
+    }
+
+    // Free objects hold a link, so they can't be smaller than one
+    if (obj_size < sizeof(pool_object)) {
+        obj_size = sizeof(pool_object);
+    }
+    if (align < _Alignof(pool_object)) {
+        align = _Alignof(pool_object);
+    }
+
+    tupool *pool = tumalloc(sizeof(tupool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->align = align;
+    pool->stride = (obj_size + align - 1) & ~(align - 1);
+
+    // Room for the header, the padding to reach align, and at least POOL_MIN_OBJECTS objects
+    size_t needed = sizeof(slab) + align + POOL_MIN_OBJECTS * pool->stride;
+    pool->slab_size = needed > POOL_SLAB_SIZE ? needed : POOL_SLAB_SIZE;
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+
+    return pool;
+}
+
+/**
+ * Allocate one object from a pool
+ *
+ * Freed objects are reused first, then objects are carved from the newest
+ * slab in address order, and a new slab is only allocated once it is used up.
+ *
+ * @param pool The pool
+ * @return A pointer to the object or NULL if memory ran out
+ */
+void *tupool_alloc(tupool *pool) {
+    pool_object *object = pool->free_list;
+    if (object != NULL) {
+        pool->free_list = object->next;
+        return object;
+    }
+
+    if (pool->bump == NULL || (size_t)(pool->bump_end - pool->bump) < pool->stride) {
+        slab *s = tumalloc(pool->slab_size);
+        if (s == NULL) {
+            return NULL;
+        }
+
+        s->next = pool->slabs;
+        pool->slabs = s;
+
+        uintptr_t first = ((uintptr_t)(s + 1) + pool->align - 1) & ~(uintptr_t)(pool->align - 1);
+        pool->bump = (char *)first;
+        pool->bump_end = (char *)s + pool->slab_size;
+    }
+
+    void *ptr = pool->bump;
+    pool->bump += pool->stride;
+    return ptr;
+}
+
+/**
+ * Return an object to its pool
+ *
+ * @param pool The pool the object came from
+ * @param ptr The object, NULL is ignored
+ */
+void tupool_free(tupool *pool, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    pool_object *object = ptr;
+    object->next = pool->free_list;
+    pool->free_list = object;
+}
+
+/**
+ * Destroy a pool and every object still allocated from it
+ *
+ * Costs one tufree per slab, no matter how many objects are live.
+ *
+ * @param pool The pool, NULL is ignored
+ */
+void tupool_destroy(tupool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    slab *s = pool->slabs;
+    while (s != NULL) {
+        slab *next = s->next;
+        tufree(s);
+        s = next;
+    }
+
+    tufree(pool);
+}
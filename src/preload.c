@@ -0,0 +1,189 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * The C allocation functions on top of the tu* ones, built into libtualloc.so
+ * for LD_PRELOAD. The allocator never calls back into malloc or stdio: its
+ * locks are statically initialized and everything else it needs comes from
+ * mmap, so these are safe to call from the very first allocation in
+ * the dynamic loader on. glibc uses whichever of these the program's symbols
+ * resolve to, so all of them have to be replaced together.
+ */
+
+/**
+ * Round an alignment up to a power of two of at least sizeof(void *), like glibc's memalign
+ *
+ * @param align The alignment asked for
+ * @return The alignment to use, 0 if there is no such power of two
+ */
+static size_t round_alignment(size_t align) {
+    size_t pow = sizeof(void *);
+    while (pow < align && pow != 0) {
+        pow <<= 1;
+    }
+    return pow;
+}
+
+/**
+ * Allocate memory, replacing malloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, NULL with errno set to ENOMEM if memory ran out
+ */
+void *malloc(size_t size) {
+    void *ptr = tumalloc(size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Free memory, replacing free
+ *
+ * @param ptr Pointer to the allocated piece of memory, NULL is ignored
+ */
+void free(void *ptr) {
+    tufree(ptr);
+}
+
+/**
+ * Free memory whose size is known, replacing C23's free_sized
+ *
+ * @param ptr Pointer to the allocated piece of memory, NULL is ignored
+ * @param size The size it was allocated with
+ */
+void free_sized(void *ptr, size_t size) {
+    tufree_sized(ptr, size);
+}
+
+/**
+ * Free aligned memory whose size is known, replacing C23's free_aligned_sized
+ *
+ * @param ptr Pointer to memory from aligned_alloc, NULL is ignored
+ * @param align The alignment it was allocated with, aligned blocks are freed like any other
+ * @param size The size it was allocated with
+ */
+void free_aligned_sized(void *ptr, size_t align, size_t size) {
+    (void)align;
+    tufree_sized(ptr, size);
+}
+
+/**
+ * Allocate zeroed memory, replacing calloc
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the memory, NULL with errno set to ENOMEM if the product overflows or memory ran out
+ */
+void *calloc(size_t num, size_t size) {
+    void *ptr = tucalloc(num, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Resize memory, replacing realloc
+ *
+ * @param ptr A pointer to an already allocated piece of memory, or NULL
+ * @param size The new size
+ * @return The resized block, NULL with errno set to ENOMEM and ptr untouched if memory ran out
+ */
+void *realloc(void *ptr, size_t size) {
+    void *new_ptr = turealloc(ptr, size);
+    if (new_ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+/**
+ * Allocate aligned memory, replacing posix_memalign
+ *
+ * @param memptr Where to store the pointer
+ * @param align The alignment, a power of two multiple of sizeof(void *)
+ * @param size The amount of memory to allocate
+ * @return 0 on success, EINVAL or ENOMEM otherwise
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    return tuposix_memalign(memptr, align, size);
+}
+
+/**
+ * Allocate aligned memory, replacing aligned_alloc
+ *
+ * @param align The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, NULL with errno set to EINVAL or ENOMEM otherwise
+ */
+void *aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *ptr = tualigned_alloc(align, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Allocate aligned memory, replacing the obsolete memalign
+ *
+ * @param align The alignment, rounded up to a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, NULL with errno set to EINVAL or ENOMEM otherwise
+ */
+void *memalign(size_t align, size_t size) {
+    align = round_alignment(align);
+    if (align == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_alloc(align, size);
+}
+
+/**
+ * Allocate page aligned memory, replacing the obsolete valloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the memory, NULL with errno set to ENOMEM if memory ran out
+ */
+void *valloc(size_t size) {
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+/**
+ * Allocate whole pages, replacing the obsolete pvalloc
+ *
+ * @param size The amount of memory to allocate, rounded up to whole pages
+ * @return A pointer to the memory, NULL with errno set to ENOMEM if memory ran out
+ */
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+/**
+ * Get the usable size of a block, replacing malloc_usable_size
+ *
+ * @param ptr Pointer to the allocated piece of memory, or NULL
+ * @return The number of bytes that can be used at ptr, 0 for NULL
+ */
+size_t malloc_usable_size(void *ptr) {
+    return tumalloc_usable_size(ptr);
+}
@@ -0,0 +1,342 @@
+#include "profile.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h> // For dprintf
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PROFILE_DEPTH 32 /**< Frames kept per sample */
+#define PROFILE_DEFAULT_PERIOD (512 * 1024) /**< Mean bytes between samples when tumalloc_profile_start gets 0 */
+#define PROFILE_IDLE_PERIOD (1 << 20) /**< Bytes between checks of whether profiling started, while it is off */
+#define PROFILE_MIN_CAPACITY 1024 /**< Entries of the first sample table */
+
+/**
+ * A sampled block that is still allocated
+ *
+ * A ptr of 0 marks an empty entry.
+ */
+typedef struct sample {
+    uintptr_t ptr; /**< The block */
+    size_t size; /**< The size requested */
+    uint32_t depth; /**< Entries of frames used */
+    void *frames[PROFILE_DEPTH]; /**< Return addresses, innermost first */
+} sample;
+
+_Thread_local int64_t profile_countdown = 0;
+size_t profile_live = 0;
+uint8_t profile_filter[1 << PROFILE_FILTER_BITS];
+
+static size_t period = 0; /**< Mean bytes between samples, 0 while profiling is off */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; /**< Guards the table and every counter below */
+static sample *table = NULL; /**< Open addressing table of live samples keyed by ptr, linear probing */
+static size_t capacity = 0; /**< Entries of table, a power of two */
+static size_t total_samples = 0; /**< Samples taken since tumalloc_profile_start */
+static size_t total_bytes = 0; /**< Bytes of those samples */
+
+static _Thread_local uint64_t rng_state; /**< xorshift state of the calling thread, 0 until its first draw */
+static _Thread_local int in_profiler; /**< Set while the thread takes a sample, so allocations backtrace makes are not */
+
+/**
+ * Draw the bytes to the next sample, exponentially distributed
+ *
+ * Exponential gaps make samples a Poisson process over the bytes
+ * allocated, so every byte is equally likely to be sampled whatever the
+ * pattern of sizes around it.
+ *
+ * @param mean The mean gap
+ * @return The gap, at least 1
+ */
+static int64_t next_interval(size_t mean) {
+    if (rng_state == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rng_state = ((uintptr_t)&rng_state ^ (uint64_t)now.tv_nsec * 0x9E3779B97F4A7C15ULL) | 1;
+    }
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    // Uniform in (0, 1], so the logarithm is finite
+    double u = (double)((rng_state >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = -log(u) * (double)mean;
+    return gap < 1.0 ? 1 : (int64_t)gap;
+}
+
+/**
+ * Get the table entry a block hashes to
+ *
+ * @param ptr The block
+ * @param cap Entries of the table, a power of two
+ * @return The index to start probing at
+ */
+static size_t home_slot(uintptr_t ptr, size_t cap) {
+    return (size_t)(((ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 17) & (cap - 1);
+}
+
+/**
+ * Find a block in the table, called with profile_lock held
+ *
+ * @param ptr The block
+ * @return Its entry, or the empty entry that ended the probe
+ */
+static sample *table_find(uintptr_t ptr) {
+    size_t i = home_slot(ptr, capacity);
+    while (table[i].ptr != 0 && table[i].ptr != ptr) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &table[i];
+}
+
+/**
+ * Make the table room for one more sample, doubling it when half full,
+ * called with profile_lock held
+ *
+ * @return 0 on success, -1 if no memory was left for a bigger table
+ */
+static int table_reserve(void) {
+    size_t live = __atomic_load_n(&profile_live, __ATOMIC_RELAXED);
+    if (table != NULL && (live + 1) * 2 <= capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = capacity == 0 ? PROFILE_MIN_CAPACITY : capacity * 2;
+    sample *new_table = mmap(NULL, new_capacity * sizeof(sample), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (new_table == MAP_FAILED) {
+        return -1;
+    }
+
+    sample *old_table = table;
+    size_t old_capacity = capacity;
+    table = new_table;
+    capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_table[i].ptr != 0) {
+            *table_find(old_table[i].ptr) = old_table[i];
+        }
+    }
+    if (old_table != NULL) {
+        munmap(old_table, old_capacity * sizeof(sample));
+    }
+    return 0;
+}
+
+/**
+ * Empty an entry, shifting back the entries after it that probed past it,
+ * called with profile_lock held
+ *
+ * @param entry The entry
+ */
+static void table_remove(sample *entry) {
+    size_t hole = (size_t)(entry - table);
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & (capacity - 1);
+        if (table[i].ptr == 0) {
+            break;
+        }
+        // The entry may fill the hole only if its home is not in (hole, i]
+        size_t home = home_slot(table[i].ptr, capacity);
+        if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole].ptr = 0;
+}
+
+void profile_sample(void *ptr, size_t size) {
+    size_t mean = __atomic_load_n(&period, __ATOMIC_RELAXED);
+    if (mean == 0 || in_profiler) {
+        // Look again once another PROFILE_IDLE_PERIOD bytes went by
+        profile_countdown = mean == 0 ? PROFILE_IDLE_PERIOD : next_interval(mean);
+        return;
+    }
+    profile_countdown = next_interval(mean);
+
+    in_profiler = 1;
+
+    // The first frame is this function, the allocator's own frames stay so pprof can fold them
+    void *frames[PROFILE_DEPTH + 1];
+    int depth = backtrace(frames, PROFILE_DEPTH + 1);
+
+    pthread_mutex_lock(&profile_lock);
+    // Profiling may have stopped meanwhile, which dropped the table
+    if (__atomic_load_n(&period, __ATOMIC_RELAXED) != 0 && table_reserve() == 0) {
+        sample *entry = table_find((uintptr_t)ptr);
+        if (entry->ptr == 0) {
+            __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+            uint8_t *count = &profile_filter[profile_slot(ptr)];
+            if (*count < UINT8_MAX) {
+                __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+            }
+        }
+        entry->ptr = (uintptr_t)ptr;
+        entry->size = size;
+        entry->depth = depth > 1 ? (uint32_t)depth - 1 : 0;
+        memcpy(entry->frames, frames + 1, entry->depth * sizeof(void *));
+        total_samples++;
+        total_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    in_profiler = 0;
+}
+
+void profile_forget(void *ptr) {
+    pthread_mutex_lock(&profile_lock);
+    if (table != NULL) {
+        sample *entry = table_find((uintptr_t)ptr);
+        if (entry->ptr != 0) {
+            table_remove(entry);
+            __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
+            // A saturated count no longer knows how many blocks it stands for, so it stays
+            uint8_t *count = &profile_filter[profile_slot(ptr)];
+            if (*count < UINT8_MAX) {
+                __atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+void profile_fork_lock(void) {
+    pthread_mutex_lock(&profile_lock);
+}
+
+void profile_fork_unlock(void) {
+    pthread_mutex_unlock(&profile_lock);
+}
+
+int tumalloc_profile_start(size_t sample_bytes) {
+    if (sample_bytes > INT64_MAX) {
+        return -1;
+    }
+
+    // backtrace loads libgcc and allocates the first time, which must not happen inside a sample
+    void *warm[1];
+    backtrace(warm, 1);
+
+    pthread_mutex_lock(&profile_lock);
+    int result = -1;
+    if (period == 0) {
+        total_samples = 0;
+        total_bytes = 0;
+        __atomic_store_n(&period, sample_bytes == 0 ? PROFILE_DEFAULT_PERIOD : sample_bytes, __ATOMIC_RELAXED);
+        result = 0;
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // The calling thread starts sampling right away, others after their idle countdown runs out
+    if (result == 0) {
+        profile_countdown = 0;
+    }
+    return result;
+}
+
+int tumalloc_profile_stop(void) {
+    pthread_mutex_lock(&profile_lock);
+    int result = -1;
+    if (period != 0) {
+        __atomic_store_n(&period, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile_live, 0, __ATOMIC_RELAXED);
+        memset(profile_filter, 0, sizeof(profile_filter));
+        if (table != NULL) {
+            munmap(table, capacity * sizeof(sample));
+        }
+        table = NULL;
+        capacity = 0;
+        result = 0;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return result;
+}
+
+/**
+ * Write all of a buffer
+ *
+ * @param fd Where to write
+ * @param buf The bytes
+ * @param len How many
+ * @return 0 on success, -1 on a write error
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int tumalloc_profile_dump(int fd) {
+    // Copy the samples out, so the lock is not held across writes that may allocate
+    pthread_mutex_lock(&profile_lock);
+    size_t mean = period;
+    size_t samples = total_samples, bytes = total_bytes;
+    size_t count = 0, length = 0;
+    sample *copy = NULL;
+    if (mean != 0 && profile_live != 0) {
+        length = profile_live * sizeof(sample);
+        copy = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            pthread_mutex_unlock(&profile_lock);
+            return -1;
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            if (table[i].ptr != 0) {
+                copy[count++] = table[i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    if (mean == 0) {
+        return -1;
+    }
+
+    size_t live_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        live_bytes += copy[i].size;
+    }
+
+    // gperftools' legacy heap profile, which pprof reads; unsampling to estimate totals is pprof's job
+    int result = dprintf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                         count, live_bytes, samples, bytes, mean) < 0 ? -1 : 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        char line[64 + PROFILE_DEPTH * 20];
+        int len = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", copy[i].size, copy[i].size);
+        for (uint32_t j = 0; j < copy[i].depth; j++) {
+            len += snprintf(line + len, sizeof(line) - len, " %p", copy[i].frames[j]);
+        }
+        line[len++] = '\n';
+        result = write_all(fd, line, (size_t)len);
+    }
+
+    if (copy != NULL) {
+        munmap(copy, length);
+    }
+
+    // pprof maps the addresses back to symbols through the mappings
+    if (result == 0) {
+        result = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    }
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        char buf[4096];
+        ssize_t n;
+        while (result == 0 && (n = read(maps, buf, sizeof(buf))) > 0) {
+            result = write_all(fd, buf, (size_t)n);
+        }
+        close(maps);
+    }
+    return result;
+}
@@ -0,0 +1,70 @@
+#ifndef CYB3053_PROJECT2_PROFILE_H
+#define CYB3053_PROJECT2_PROFILE_H
+
+#include "alloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROFILE_FILTER_BITS 16 /**< log2 of the entries in profile_filter */
+
+extern _Thread_local int64_t profile_countdown; /**< Bytes this thread allocates before its next sample, see PROFILE_ALLOC */
+extern size_t profile_live; /**< Sampled blocks that are still allocated */
+extern uint8_t profile_filter[1 << PROFILE_FILTER_BITS]; /**< Sampled blocks per address hash, saturating at 255 */
+
+/**
+ * Get the entry of profile_filter that counts a block
+ *
+ * @param ptr The block
+ * @return The index into profile_filter
+ */
+static inline size_t profile_slot(const void *ptr) {
+    return (size_t)((((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> (64 - PROFILE_FILTER_BITS));
+}
+
+/**
+ * Take a sample of an allocation if profiling is on, called once the thread's countdown ran out
+ *
+ * Captures the calling stack and starts tracking the block. Either way the
+ * countdown is set to the bytes until the next sample.
+ *
+ * @param ptr The block just allocated
+ * @param size The size requested
+ */
+void profile_sample(void *ptr, size_t size);
+
+/**
+ * Stop tracking a block that may have been sampled, called when it is freed
+ *
+ * @param ptr The block
+ */
+void profile_forget(void *ptr);
+
+/**
+ * Take the profiler's lock before fork, before any of the allocator's own
+ */
+void profile_fork_lock(void);
+
+/**
+ * Release the profiler's lock after fork, in the parent and in the child
+ */
+void profile_fork_unlock(void);
+
+// A thread-local subtraction per allocation while the countdown lasts
+#define PROFILE_ALLOC(ptr, size) \
+    do { \
+        if (__builtin_expect((profile_countdown -= (int64_t)(size)) < 0, 0)) { \
+            profile_sample((ptr), (size)); \
+        } \
+    } while (0)
+
+// A single relaxed load when nothing sampled is live, a filter lookup when something is
+#define PROFILE_FREE(ptr) \
+    do { \
+        if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0) \
+                && __atomic_load_n(&profile_filter[profile_slot(ptr)], __ATOMIC_RELAXED) != 0) { \
+            profile_forget(ptr); \
+        } \
+    } while (0)
+
+#endif //CYB3053_PROJECT2_PROFILE_H
@@ -0,0 +1,253 @@
+#include "record.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RECORD_BUFFER_SIZE (64 * 1024) /**< Bytes per thread buffer, written out in one write once full */
+#define RECORD_CAPACITY ((RECORD_BUFFER_SIZE - 64) / sizeof(tualloc_record)) /**< Records per buffer */
+
+/**
+ * A thread's buffer of records that have not been written yet
+ *
+ * Only the owner appends, without any lock. The spin lock is taken when the
+ * buffer is written out: by the owner once it is full and by
+ * tumalloc_record_stop for whatever is left, which only writes records
+ * [flushed, count) so it never races with the owner's appends past count.
+ */
+typedef struct record_buffer {
+    struct record_buffer *next; /**< Next buffer in the list of every buffer */
+    int lock; /**< Spin lock taken to write records out */
+    int owned; /**< Nonzero while a thread uses the buffer */
+    uint32_t thread; /**< Id of the owning thread */
+    unsigned generation; /**< Recording the records belong to, older ones are stale */
+    size_t count; /**< Records in the buffer, published with release stores */
+    size_t flushed; /**< Records already written by tumalloc_record_stop */
+    tualloc_record records[RECORD_CAPACITY];
+} record_buffer;
+
+int record_active = 0;
+
+static int record_fd = -1; /**< Where the records go */
+static unsigned generation = 0; /**< Incremented by every tumalloc_record_start */
+static int write_failed = 0; /**< Set when any write to record_fd failed */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER; /**< Serialises start and stop */
+static record_buffer *buffers = NULL; /**< Every buffer ever created, pushed with CAS and never freed */
+static uint32_t next_thread = 0; /**< Source of thread ids */
+
+static _Thread_local record_buffer *thread_buffer; /**< This thread's buffer, NULL until its first record */
+
+/**
+ * Read the clock that orders records
+ *
+ * A call's position in the trace is all the replay needs, so x86 reads the
+ * TSC, which costs a fraction of clock_gettime; the kernel only uses the
+ * TSC as its clock when it is synchronised across cores.
+ *
+ * @return A timestamp that never goes backwards across threads
+ */
+static uint64_t record_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * Take a buffer's spin lock
+ *
+ * @param buffer The buffer
+ */
+static void buffer_lock(record_buffer *buffer) {
+    while (__atomic_exchange_n(&buffer->lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&buffer->lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Release a buffer's spin lock
+ *
+ * @param buffer The buffer
+ */
+static void buffer_unlock(record_buffer *buffer) {
+    __atomic_store_n(&buffer->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write records [flushed, count) of a buffer out even though recording is
+ * stopping, the caller holds its lock
+ *
+ * Nothing is written when the records belong to an earlier recording. One
+ * write per buffer keeps a thread's records contiguous even when several
+ * threads flush at once.
+ *
+ * @param buffer The buffer
+ * @param count How many records the buffer holds
+ */
+static void buffer_write(record_buffer *buffer, size_t count) {
+    if (buffer->generation != __atomic_load_n(&generation, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    const char *data = (const char *)&buffer->records[buffer->flushed];
+    size_t length = (count - buffer->flushed) * sizeof(tualloc_record);
+    int fd = __atomic_load_n(&record_fd, __ATOMIC_RELAXED);
+
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            __atomic_store_n(&write_failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    buffer->flushed = count;
+}
+
+/**
+ * Write records [flushed, count) of a buffer out like buffer_write, unless recording stopped
+ *
+ * @param buffer The buffer, whose lock the caller holds
+ * @param count How many records the buffer holds
+ */
+static void buffer_flush(record_buffer *buffer, size_t count) {
+    if (__atomic_load_n(&record_active, __ATOMIC_RELAXED)) {
+        buffer_write(buffer, count);
+    }
+}
+
+/**
+ * Get a buffer for this thread, adopting one whose thread exited before mapping a new one
+ *
+ * Buffers come straight from mmap so recording never calls back into the allocator.
+ *
+ * @return The buffer or NULL if mmap failed
+ */
+static record_buffer *buffer_get(void) {
+    record_buffer *buffer;
+    for (buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        int unowned = 0;
+        if (__atomic_compare_exchange_n(&buffer->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = mmap(NULL, sizeof(record_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            return NULL;
+        }
+        buffer->owned = 1;
+
+        record_buffer *head = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        do {
+            buffer->next = head;
+        } while (!__atomic_compare_exchange_n(&buffers, &head, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    buffer->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void record_event(int op, const void *ptr, size_t old, size_t size) {
+    record_buffer *buffer = thread_buffer;
+    if (buffer == NULL) {
+        buffer = thread_buffer = buffer_get();
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
+    // Drop what is left over from an earlier recording
+    unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (buffer->generation != current) {
+        buffer_lock(buffer);
+        buffer->generation = current;
+        buffer->flushed = 0;
+        __atomic_store_n(&buffer->count, 0, __ATOMIC_RELAXED);
+        buffer_unlock(buffer);
+    }
+
+    size_t count = buffer->count;
+    tualloc_record *record = &buffer->records[count];
+    record->timestamp = record_clock();
+    record->ptr = (uint64_t)(uintptr_t)ptr;
+    record->old = old;
+    record->size = size;
+    record->thread = buffer->thread;
+    record->op = (uint32_t)op;
+
+    // Publish the record before it is counted, tumalloc_record_stop may write it out
+    __atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+
+    if (count + 1 == RECORD_CAPACITY) {
+        buffer_lock(buffer);
+        buffer_flush(buffer, RECORD_CAPACITY);
+        buffer->flushed = 0;
+        __atomic_store_n(&buffer->count, 0, __ATOMIC_RELAXED);
+        buffer_unlock(buffer);
+    }
+}
+
+void record_thread_exit(void) {
+    record_buffer *buffer = thread_buffer;
+    if (buffer == NULL) {
+        return;
+    }
+
+    buffer_lock(buffer);
+    buffer_flush(buffer, buffer->count);
+    buffer->flushed = 0;
+    __atomic_store_n(&buffer->count, 0, __ATOMIC_RELAXED);
+    buffer_unlock(buffer);
+
+    thread_buffer = NULL;
+    __atomic_store_n(&buffer->owned, 0, __ATOMIC_RELEASE);
+}
+
+int tumalloc_record_start(int fd) {
+    pthread_mutex_lock(&control_lock);
+    if (record_active) {
+        pthread_mutex_unlock(&control_lock);
+        return -1;
+    }
+
+    __atomic_store_n(&record_fd, fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&write_failed, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&record_active, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&control_lock);
+    return 0;
+}
+
+int tumalloc_record_stop(void) {
+    pthread_mutex_lock(&control_lock);
+    if (!record_active) {
+        pthread_mutex_unlock(&control_lock);
+        return -1;
+    }
+
+    // Owners flush under their buffer's lock and check this first, so once we held every lock nothing more is written
+    __atomic_store_n(&record_active, 0, __ATOMIC_RELAXED);
+
+    // Write out what every thread has buffered, after any flush in progress; calls racing with the stop may be left out
+    for (record_buffer *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+        buffer_lock(buffer);
+        buffer_write(buffer, __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE));
+        buffer_unlock(buffer);
+    }
+
+    int ret = __atomic_load_n(&write_failed, __ATOMIC_RELAXED) ? -1 : 0;
+    pthread_mutex_unlock(&control_lock);
+    return ret;
+}
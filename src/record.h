@@ -0,0 +1,34 @@
+#ifndef CYB3053_PROJECT2_RECORD_H
+#define CYB3053_PROJECT2_RECORD_H
+
+#include "alloc.h"
+
+#include <stddef.h>
+
+extern int record_active; /**< Nonzero between tumalloc_record_start and tumalloc_record_stop */
+
+/**
+ * Append a call to the calling thread's record buffer, writing the buffer
+ * out once it is full
+ *
+ * @param op One of the tualloc_record_op values
+ * @param ptr The block returned, or the block freed
+ * @param old The block realloc was called on, or calloc's element count
+ * @param size The size requested, calloc's element size
+ */
+void record_event(int op, const void *ptr, size_t old, size_t size);
+
+/**
+ * Write out and give up the calling thread's record buffer, called when the thread exits
+ */
+void record_thread_exit(void);
+
+// A single relaxed load when nobody is recording
+#define RECORD(op, ptr, old, size) \
+    do { \
+        if (__builtin_expect(__atomic_load_n(&record_active, __ATOMIC_RELAXED), 0)) { \
+            record_event((op), (ptr), (old), (size)); \
+        } \
+    } while (0)
+
+#endif //CYB3053_PROJECT2_RECORD_H
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE // For MAP_POPULATE
+#include "alloc.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NO_SLOT UINT32_MAX // Slot of a block that was allocated before the recording started
+
+/**
+ * One call to replay, with blocks named by dense slot numbers instead of addresses
+ */
+typedef struct replay_op {
+    uint32_t op; // One of tualloc_record_op
+    uint32_t slot; // Slot the result goes to, or the slot freed
+    uint32_t old; // Slot passed to realloc, NO_SLOT for NULL
+    uint64_t count; // calloc's element count, or the alignment of an aligned allocation
+    uint64_t size; // Size requested
+} replay_op;
+
+/**
+ * An allocator to replay against
+ */
+typedef struct replay_allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t num, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    void *(*aligned_alloc)(size_t align, size_t size);
+} replay_allocator;
+
+static const replay_allocator ALLOCATORS[] = {
+    { "tualloc", tumalloc, tucalloc, turealloc, tufree, tualigned_alloc },
+    { "glibc", malloc, calloc, realloc, free, aligned_alloc },
+};
+
+static const tualloc_record *records; // The mapped trace
+
+/**
+ * Order records by timestamp, keeping file order for equal timestamps
+ */
+static int compare_records(const void *a, const void *b) {
+    const tualloc_record *x = &records[*(const uint32_t *)a];
+    const tualloc_record *y = &records[*(const uint32_t *)b];
+    if (x->timestamp != y->timestamp) {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+/**
+ * Map of live block addresses to slots, open addressing with linear probing
+ */
+typedef struct address_map {
+    uint64_t *keys; // Addresses, 0 for an empty entry
+    uint32_t *slots;
+    size_t mask; // Capacity - 1, the capacity is a power of two
+} address_map;
+
+/**
+ * Hash an address, blocks are 16-byte aligned so the low bits carry nothing
+ */
+static size_t hash(uint64_t address) {
+    return (size_t)((address >> 4) * 0x9e3779b97f4a7c15u);
+}
+
+/**
+ * Find the entry of an address, or the empty entry it would go to
+ */
+static size_t map_find(address_map *map, uint64_t address) {
+    size_t i = hash(address) & map->mask;
+    while (map->keys[i] != 0 && map->keys[i] != address) {
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+/**
+ * Remove an address and return its slot
+ *
+ * @return The slot, NO_SLOT if the address is not live
+ */
+static uint32_t map_take(address_map *map, uint64_t address) {
+    size_t i = map_find(map, address);
+    if (map->keys[i] == 0) {
+        return NO_SLOT;
+    }
+    uint32_t slot = map->slots[i];
+
+    // Backward shift deletion keeps every probe sequence unbroken
+    map->keys[i] = 0;
+    for (size_t j = (i + 1) & map->mask; map->keys[j] != 0; j = (j + 1) & map->mask) {
+        size_t home = hash(map->keys[j]) & map->mask;
+        if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+            map->keys[i] = map->keys[j];
+            map->slots[i] = map->slots[j];
+            map->keys[j] = 0;
+            i = j;
+        }
+    }
+    return slot;
+}
+
+/**
+ * Turn the records, in timestamp order, into ops on dense slots
+ *
+ * @param order Record indices sorted by timestamp
+ * @param count Number of records
+ * @param ops Filled with the ops, count of them at most
+ * @param unmatched Set to the number of frees of blocks the trace never allocated
+ * @param nslots Set to the number of slots used
+ * @return The number of ops
+ */
+static size_t build_ops(const uint32_t *order, size_t count, replay_op *ops, size_t *unmatched, uint32_t *nslots) {
+    address_map map;
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    map.keys = calloc(capacity, sizeof(uint64_t));
+    map.slots = calloc(capacity, sizeof(uint32_t));
+    map.mask = capacity - 1;
+    if (map.keys == NULL || map.slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    size_t n = 0;
+    uint32_t next_slot = 0;
+    *unmatched = 0;
+    for (size_t i = 0; i < count; i++) {
+        const tualloc_record *r = &records[order[i]];
+        replay_op *op = &ops[n];
+        op->op = r->op;
+        op->count = r->op == TU_RECORD_CALLOC || r->op == TU_RECORD_ALIGNED ? r->old : 0;
+        op->size = r->size;
+        op->old = NO_SLOT;
+
+        if (r->op == TU_RECORD_FREE) {
+            op->slot = map_take(&map, r->ptr);
+            if (op->slot == NO_SLOT) {
+                (*unmatched)++;
+                continue;
+            }
+        } else if (r->op >= TU_RECORD_MALLOC && r->op <= TU_RECORD_ALIGNED) {
+            if (r->op == TU_RECORD_REALLOC && r->old != 0) {
+                op->old = map_take(&map, r->old);
+                if (op->old == NO_SLOT) {
+                    // Resizing a block from before the recording started: replay it as a fresh allocation
+                    op->op = TU_RECORD_MALLOC;
+                    (*unmatched)++;
+                }
+            }
+
+            // A realloc that failed keeps the old block in its slot
+            if (r->ptr == 0 && op->old != NO_SLOT) {
+                op->slot = op->old;
+            } else {
+                op->slot = next_slot++;
+            }
+
+            if (r->ptr != 0) {
+                // An address can only be live once; timestamps taken on both sides of a race can disagree
+                map_take(&map, r->ptr);
+                size_t e = map_find(&map, r->ptr);
+                map.keys[e] = r->ptr;
+                map.slots[e] = op->slot;
+            }
+        } else {
+            continue;
+        }
+        n++;
+    }
+
+    free(map.keys);
+    free(map.slots);
+    *nslots = next_slot;
+    return n;
+}
+
+/**
+ * Get the current time
+ *
+ * @return Nanoseconds of CLOCK_MONOTONIC
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Get the resident set size of the process
+ *
+ * @return Resident memory in KiB
+ */
+static long resident_kib(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Reset the kernel's peak resident set size of the process
+ *
+ * @return 1 if it was reset, 0 if the kernel doesn't support it
+ */
+static int reset_peak(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = write(fd, "5", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+/**
+ * Get the peak resident set size of the process
+ *
+ * @return VmHWM in KiB
+ */
+static long peak_kib(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long peak = 0;
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %ld", &peak) == 1) {
+            break;
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    return peak;
+}
+
+/**
+ * Replay a trace file against one allocator and print what it cost
+ *
+ * The trace is mapped, sorted by timestamp and turned into ops on dense
+ * slots before the clock starts, so only the allocator calls are timed and
+ * only the blocks they return count towards the peak footprint.
+ * Every thread's calls are replayed on one thread in timestamp order.
+ * With -l, tualloc's heaps are dumped to a layout file for tualloc_heatmap
+ * once the replay is done.
+ *
+ * @return 0 on success, 1 on a usage or file error
+ */
+int main(int argc, char **argv) {
+    const replay_allocator *alloc = &ALLOCATORS[0];
+    const char *layout = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:l:h")) != -1) {
+        if (opt == 'l') {
+            layout = optarg;
+            continue;
+        }
+        if (opt == 'a') {
+            alloc = NULL;
+            for (size_t i = 0; i < sizeof(ALLOCATORS) / sizeof(ALLOCATORS[0]); i++) {
+                if (strcmp(optarg, ALLOCATORS[i].name) == 0) {
+                    alloc = &ALLOCATORS[i];
+                }
+            }
+        }
+        if (opt != 'a' || alloc == NULL) {
+            fprintf(stderr, "usage: %s [-a tualloc|glibc] [-l layout] trace\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-a tualloc|glibc] [-l layout] trace\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t count = (size_t)st.st_size / sizeof(tualloc_record);
+    if (count == 0 || count >= NO_SLOT) {
+        fprintf(stderr, "%s: %zu records, nothing to replay\n", argv[optind], count);
+        return 1;
+    }
+    records = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (records == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    // Merge the threads' blocks of records into one global order
+    uint32_t *order = malloc(count * sizeof(uint32_t));
+    replay_op *ops = malloc(count * sizeof(replay_op));
+    if (order == NULL || ops == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    uint32_t threads = 0;
+    for (size_t i = 0; i < count; i++) {
+        order[i] = (uint32_t)i;
+        if (records[i].thread >= threads) {
+            threads = records[i].thread + 1;
+        }
+    }
+    qsort(order, count, sizeof(uint32_t), compare_records);
+
+    size_t unmatched;
+    uint32_t nslots;
+    size_t nops = build_ops(order, count, ops, &unmatched, &nslots);
+    free(order);
+    munmap((void *)records, (size_t)st.st_size);
+
+    // Zeroed and already resident, so the replay is not charged for faulting the slot tables in
+    void **slots = mmap(NULL, (nslots + 1) * sizeof(void *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    uint64_t *sizes = mmap(NULL, (nslots + 1) * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (slots == MAP_FAILED || sizes == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // Reset the peak RSS so mapping and sorting the trace don't count, without it only the final RSS is known
+    int have_peak = reset_peak();
+    long baseline = resident_kib();
+    uint64_t live = 0, peak = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nops; i++) {
+        replay_op *op = &ops[i];
+        void *ptr;
+        switch (op->op) {
+            case TU_RECORD_MALLOC:
+                ptr = alloc->malloc(op->size);
+                break;
+            case TU_RECORD_CALLOC:
+                ptr = alloc->calloc(op->count, op->size);
+                op->size *= op->count;
+                break;
+            case TU_RECORD_ALIGNED:
+                ptr = alloc->aligned_alloc(op->count, op->size);
+                break;
+            case TU_RECORD_REALLOC:
+                ptr = alloc->realloc(op->old != NO_SLOT ? slots[op->old] : NULL, op->size);
+                if (ptr != NULL && op->old != NO_SLOT) {
+                    live -= sizes[op->old];
+                    slots[op->old] = NULL;
+                }
+                break;
+            default:
+                alloc->free(slots[op->slot]);
+                slots[op->slot] = NULL;
+                live -= sizes[op->slot];
+                continue;
+        }
+
+        if (ptr != NULL) {
+            // Touch the block so the footprint is resident, like the program that was recorded
+            if (op->size > 0) {
+                ((char *)ptr)[0] = 1;
+            }
+            slots[op->slot] = ptr;
+            sizes[op->slot] = op->size;
+            live += op->size;
+            if (live > peak) {
+                peak = live;
+            }
+        }
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    long rss = (have_peak ? peak_kib() : resident_kib()) - baseline;
+
+    // The heaps as the replay left them, for tualloc_heatmap
+    if (layout != NULL && alloc == &ALLOCATORS[0]) {
+        int out = open(layout, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || tumalloc_dump_layout(out) != 0) {
+            perror(layout);
+            return 1;
+        }
+        close(out);
+    }
+
+    printf("allocator   %s\n", alloc->name);
+    printf("records     %zu from %u threads, %zu replayed, %zu unmatched\n", count, threads, nops, unmatched);
+    printf("time        %.3f s\n", seconds);
+    printf("ops/s       %.0f\n", (double)nops / seconds);
+    printf("peak live   %llu KiB requested\n", (unsigned long long)(peak / 1024));
+    printf("%s    %ld KiB\n", have_peak ? "peak rss" : "end rss ", rss);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "trace.h"
+
+#ifdef TUALLOC_TRACE
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRACE_CAPACITY 4096 /**< Entries per thread ring buffer, a power of two */
+
+/**
+ * A single thread's ring buffer
+ *
+ * Only the owning thread writes entries. head counts every event ever
+ * written, so the newest entry is at (head - 1) % TRACE_CAPACITY and a
+ * reader can tell how many entries have been overwritten. A buffer whose
+ * thread exited goes to the next new thread, which keeps writing after the
+ * entries it finds, each of which names its own thread.
+ */
+typedef struct trace_buffer {
+    struct trace_buffer *next; /**< Next buffer in the list of every thread's buffer */
+    int owned; /**< Nonzero while a thread uses the buffer */
+    uint32_t thread; /**< Small sequential id of the owning thread */
+    uint64_t head; /**< Number of events written, published with release stores */
+    tualloc_trace_entry entries[TRACE_CAPACITY]; /**< The ring itself */
+} trace_buffer;
+
+static trace_buffer *buffers = NULL; /**< Every buffer ever created, pushed with CAS and never freed */
+static uint32_t next_thread = 0; /**< Source of thread ids */
+
+static _Thread_local trace_buffer *thread_buffer; /**< This thread's buffer, NULL until its first event */
+static _Thread_local int creating; /**< Guards against recording events while the buffer is mapped */
+
+/**
+ * Get a buffer for this thread, adopting one whose thread exited before mapping a new one
+ *
+ * Buffers come straight from mmap so tracing never calls back into the allocator.
+ *
+ * @return The buffer or NULL if mmap failed
+ */
+static trace_buffer *buffer_create(void) {
+    trace_buffer *buffer;
+    for (buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        int unowned = 0;
+        if (__atomic_compare_exchange_n(&buffer->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            return NULL;
+        }
+        buffer->owned = 1;
+
+        trace_buffer *head = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        do {
+            buffer->next = head;
+        } while (!__atomic_compare_exchange_n(&buffers, &head, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    buffer->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void trace_event(int event, const void *ptr, size_t size) {
+    trace_buffer *buffer = thread_buffer;
+    if (buffer == NULL) {
+        if (creating) {
+            return;
+        }
+        creating = 1;
+        buffer = thread_buffer = buffer_create();
+        creating = 0;
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = buffer->head;
+    tualloc_trace_entry *entry = &buffer->entries[head & (TRACE_CAPACITY - 1)];
+    entry->timestamp = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    entry->ptr = (uint64_t)(uintptr_t)ptr;
+    entry->size = size;
+    entry->event = (uint32_t)event;
+    entry->thread = buffer->thread;
+
+    // Publish the entry before it is counted
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_exit(void) {
+    trace_buffer *buffer = thread_buffer;
+    if (buffer == NULL) {
+        return;
+    }
+
+    thread_buffer = NULL;
+    __atomic_store_n(&buffer->owned, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write all of a buffer to a file descriptor
+ *
+ * @param fd Where to write
+ * @param data What to write
+ * @param length How many bytes
+ * @return 0 on success, -1 on a write error
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const char *curr = data;
+    while (length > 0) {
+        ssize_t written = write(fd, curr, length);
+        if (written < 0) {
+            return -1;
+        }
+        curr += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+int tumalloc_trace_dump(int fd) {
+    for (trace_buffer *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+        uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        uint64_t count = head < TRACE_CAPACITY ? head : TRACE_CAPACITY;
+
+        // Oldest entry first, the ring wraps at most once; the owner may overwrite the oldest ones while we copy
+        uint64_t first = (head - count) & (TRACE_CAPACITY - 1);
+        uint64_t tail = count < TRACE_CAPACITY - first ? count : TRACE_CAPACITY - first;
+
+        if (write_all(fd, &buffer->entries[first], tail * sizeof(tualloc_trace_entry)) != 0
+                || write_all(fd, buffer->entries, (count - tail) * sizeof(tualloc_trace_entry)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+int tumalloc_trace_dump(int fd) {
+    (void)fd;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CYB3053_PROJECT2_TRACE_H
+#define CYB3053_PROJECT2_TRACE_H
+
+#include "alloc.h"
+
+#include <stddef.h>
+
+#ifdef TUALLOC_TRACE
+
+/**
+ * Record an event in the calling thread's trace ring buffer
+ *
+ * @param event One of the tualloc_trace_event values
+ * @param ptr The block the event is about
+ * @param size The size the event is about
+ */
+void trace_event(int event, const void *ptr, size_t size);
+
+/**
+ * Give up the calling thread's trace buffer for a new thread to take over, called when the thread exits
+ */
+void trace_thread_exit(void);
+
+#define TRACE(event, ptr, size) trace_event((event), (ptr), (size))
+#define TRACE_THREAD_EXIT() trace_thread_exit()
+
+#else
+
+// Tracing is compiled out entirely, sizeof keeps the arguments "used" without evaluating them
+#define TRACE(event, ptr, size) ((void)sizeof(ptr), (void)sizeof(size))
+#define TRACE_THREAD_EXIT() ((void)0)
+
+#endif
+
+#endif //CYB3053_PROJECT2_TRACE_H
@@ -0,0 +1,1298 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEADER sizeof(uint64_t) // Bytes of a block header in a layout dump
+#define CHURN_SLOTS 512 // Live blocks the layout churn keeps around
+#define CHURN_OPS 20000 // Allocations and frees of the layout churn
+#define STRESS_THREADS 4 // Threads of the stress test
+#define STRESS_OPS 100000 // Operations per stress thread
+#define STRESS_SLOTS 256 // Live blocks per stress thread
+#define STRESS_HANDOFF 64 // Blocks in flight from each stress thread to the next, a power of two
+#define LIMIT_SLOTS 4096 // Heap blocks the soft limit test allocates at most, far more than its limit leaves room for
+#define LIMIT_ROOM (1024 * 1024) // What the soft limit test lets the heaps commit on top of what they have
+#define LIMIT_STASH 4 // Mapped blocks of LIMIT_ROOM bytes the low-memory handler can give back
+#define REALLOC_HUGE (64 * 1024 * 1024) // A mapping the realloc test shrinks
+#define CACHED_SLOTS 64 // Live blocks of the cached test
+#define CACHED_OPS 20000 // Allocations, reallocations and frees of the cached test
+#define LIST_BATCH 64 // List nodes allocated or freed per bulk call
+#define HANDOFF_PAIRS 2 // Producer/consumer thread pairs of the list handoff test
+#define HANDOFF_NODES 5000 // Nodes each producer hands over
+#define BULK_NODES 10000 // Nodes in the bulk-allocated list
+#define SIZED_ROUNDS 1000 // Buffers grown and freed by the sized test
+#define POOL_NODES 10000 // Nodes in the pool-backed list
+#define ARENA_REQUESTS 100 // Simulated requests served from one arena
+#define ARENA_NODES 1000 // Nodes allocated per request
+#define TRIM_BLOCKS 1024 // Blocks in the burst the trim test frees, spanning whole huge pages too
+#define TRIM_BLOCK_SIZE (8 * 1024) // Below the mmap threshold, so the burst lands in the heap
+#define HEAP_NODES 10000 // List nodes the heap test allocates from a heap of its own
+#define HEAP_LARGE (2 * 1024 * 1024) // A block too big for the heap's chunks
+#define LAYOUT_BLOCKS 256 // Blocks the layout test allocates, every other one freed before the dump
+#define PROFILE_BLOCKS 64 // Blocks the profile test allocates, every one of them sampled
+#define ALIGNED_BLOCKS 64 // Buffers allocated at each alignment
+
+// Fail the test case with the line and condition
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+/**
+ * A layout dump read back into memory
+ */
+typedef struct layout {
+    tualloc_layout_entry *entries;
+    size_t count;
+} layout;
+
+/**
+ * Dump the heap layout and read it back
+ *
+ * @param l Where to store the entries, freed with tufree
+ * @return 0 on success, -1 if the dump failed
+ */
+static int read_layout(layout *l) {
+    char path[] = "/tmp/tualloc_testXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+
+    int result = -1;
+    off_t length = tumalloc_dump_layout(fd) == 0 ? lseek(fd, 0, SEEK_END) : -1;
+    l->entries = length > 0 ? tumalloc((size_t)length) : NULL;
+    l->count = l->entries != NULL ? (size_t)length / sizeof(tualloc_layout_entry) : 0;
+    if (length == 0 || (l->entries != NULL && pread(fd, l->entries, (size_t)length, 0) == length)) {
+        result = 0;
+    }
+    close(fd);
+    return result;
+}
+
+/**
+ * Find the region of a dump a block lies in
+ *
+ * @param l The dump
+ * @param ptr The block
+ * @return The index of the region's entry, or -1 if no region holds it
+ */
+static long find_region(const layout *l, const void *ptr) {
+    uint64_t header = (uintptr_t)ptr - HEADER;
+    for (size_t i = 0; i < l->count; i++) {
+        const tualloc_layout_entry *e = &l->entries[i];
+        if (e->kind == TU_LAYOUT_REGION && header >= e->addr && header < e->addr + e->size) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check the boundary tag invariants of every region of a dump: the blocks
+ * tile it, every block spans a multiple of 16 bytes, and no two free blocks
+ * are neighbors, since a free merges with its free neighbors
+ *
+ * @param l The dump
+ * @return 0 if they hold, -1 otherwise
+ */
+static int check_layout(const layout *l) {
+    const tualloc_layout_entry *region = NULL, *prev = NULL;
+    for (size_t i = 0; i < l->count; i++) {
+        const tualloc_layout_entry *e = &l->entries[i];
+        if (e->kind == TU_LAYOUT_REGION) {
+            region = e;
+            prev = NULL;
+            continue;
+        }
+        CHECK(region != NULL);
+        CHECK(e->addr >= region->addr && e->addr + 2 * HEADER + e->size <= region->addr + region->size);
+        CHECK((e->size + HEADER) % 16 == 0);
+        CHECK(e->kind == TU_LAYOUT_USED || e->size >= 16 + HEADER);
+        if (prev != NULL) {
+            CHECK(e->addr == prev->addr + HEADER + prev->size);
+            CHECK(e->kind != TU_LAYOUT_FREE || prev->kind != TU_LAYOUT_FREE);
+        }
+        // Free lists are by size class, the fast bins only take small blocks
+        CHECK(e->kind != TU_LAYOUT_FREE || e->list >= 0 || e->list == TU_LAYOUT_TREE);
+        CHECK(e->kind != TU_LAYOUT_FAST || (e->list >= 0 && e->size <= 512 + HEADER));
+        prev = e;
+    }
+    return 0;
+}
+
+/**
+ * Churn the heap with random sizes, then check the layout; then split and
+ * merge a block in a heap of its own and watch the pieces
+ *
+ * @return 0 if the invariants held, -1 otherwise
+ */
+static int split_coalesce_test(void) {
+    void *slots[CHURN_SLOTS] = { 0 };
+    unsigned seed = 1;
+    for (int i = 0; i < CHURN_OPS; i++) {
+        int slot = rand_r(&seed) % CHURN_SLOTS;
+        tufree(slots[slot]);
+        slots[slot] = tumalloc((size_t)(rand_r(&seed) % 4 == 0 ? rand_r(&seed) % 20000 : rand_r(&seed) % 600));
+        CHECK(slots[slot] != NULL);
+    }
+    for (int i = 0; i < CHURN_SLOTS; i += 2) {
+        tufree(slots[i]);
+        slots[i] = NULL;
+    }
+
+    layout l;
+    CHECK(read_layout(&l) == 0);
+    int result = check_layout(&l);
+    tufree(l.entries);
+    CHECK(result == 0);
+
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        tufree(slots[i]);
+    }
+
+    // A heap of its own has no thread cache, so its blocks go back to the free lists right away
+    tuheap *heap = tuheap_create();
+    CHECK(heap != NULL);
+    void *big = tuheap_malloc(heap, 64 * 1024);
+    CHECK(big != NULL);
+    tuheap_free(heap, big);
+    void *small = tuheap_malloc(heap, 1000);
+    CHECK(small != NULL);
+
+    // Carved from the front of the block big merged back into, the rest is split off as one free block
+    CHECK(read_layout(&l) == 0);
+    long region = find_region(&l, small);
+    CHECK(region >= 0);
+    CHECK(small == big);
+    CHECK((size_t)region + 2 < l.count && l.entries[region + 1].kind == TU_LAYOUT_USED);
+    CHECK(l.entries[region + 1].size >= 1000 && l.entries[region + 1].size < 1000 + 16 + HEADER);
+    CHECK(l.entries[region + 2].kind == TU_LAYOUT_FREE);
+    CHECK((size_t)region + 3 == l.count || l.entries[region + 3].kind == TU_LAYOUT_REGION);
+    tufree(l.entries);
+
+    // Trimming consolidates the fast bins, after which the chunk is one free block again
+    tuheap_free(heap, small);
+    tumalloc_trim(0);
+    CHECK(read_layout(&l) == 0);
+    region = find_region(&l, small);
+    CHECK(region >= 0);
+    CHECK((size_t)region + 1 < l.count && l.entries[region + 1].kind == TU_LAYOUT_FREE);
+    CHECK((size_t)region + 2 == l.count || l.entries[region + 2].kind == TU_LAYOUT_REGION);
+    tufree(l.entries);
+
+    tuheap_destroy(heap);
+    return 0;
+}
+
+/**
+ * Fill a buffer with a pattern derived from a seed
+ *
+ * @param ptr The buffer
+ * @param size Its size
+ * @param seed Picks the pattern
+ */
+static void fill(void *ptr, size_t size, unsigned seed) {
+    for (size_t i = 0; i < size; i++) {
+        ((unsigned char *)ptr)[i] = (unsigned char)(i * 31 + seed);
+    }
+}
+
+/**
+ * Check a buffer still holds the pattern fill wrote
+ *
+ * @param ptr The buffer
+ * @param size How much of it to check
+ * @param seed The seed fill was given
+ * @return 1 if it does, 0 otherwise
+ */
+static int filled(const void *ptr, size_t size, unsigned seed) {
+    for (size_t i = 0; i < size; i++) {
+        if (((const unsigned char *)ptr)[i] != (unsigned char)(i * 31 + seed)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Grow and shrink blocks across the small, large and mapped sizes, and check
+ * the contents survive and failures leave the block alone
+ *
+ * @return 0 if realloc behaved, -1 otherwise
+ */
+static int realloc_test(void) {
+    static const size_t sizes[] = { 1, 24, 100, 520, 521, 4000, 70000, 300000, 3 << 20, 64, 0 };
+
+    // NULL allocates
+    void *ptr = turealloc(NULL, 10);
+    CHECK(ptr != NULL);
+    fill(ptr, 10, 1);
+    size_t size = 10;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t kept = size < sizes[i] ? size : sizes[i];
+        void *moved = turealloc(ptr, sizes[i]);
+        CHECK(moved != NULL);
+        CHECK(filled(moved, kept, 1));
+        CHECK(tumalloc_usable_size(moved) >= sizes[i]);
+        fill(moved, sizes[i], 1);
+        ptr = moved;
+        size = sizes[i];
+    }
+
+    // A size nothing can hold fails and leaves the block as it was
+    fill(ptr, 1, 2);
+    CHECK(turealloc(ptr, SIZE_MAX - 64) == NULL);
+    CHECK(turealloc(ptr, PTRDIFF_MAX) == NULL);
+    CHECK(filled(ptr, 1, 2));
+    tufree(ptr);
+
+    // Shrinking a mapping gives the pages back, in place or by moving into the heap
+    tualloc_stats before, after;
+    tumalloc_stats(&before);
+    ptr = tumalloc(REALLOC_HUGE);
+    CHECK(ptr != NULL);
+    fill(ptr, REALLOC_HUGE / 2, 4);
+    ptr = turealloc(ptr, REALLOC_HUGE / 2);
+    CHECK(ptr != NULL && filled(ptr, REALLOC_HUGE / 2, 4));
+    tumalloc_stats(&after);
+    CHECK(after.mmapped <= before.mmapped + REALLOC_HUGE / 2 + REALLOC_HUGE / 8);
+    ptr = turealloc(ptr, 1000);
+    CHECK(ptr != NULL && filled(ptr, 1000, 4));
+    tumalloc_stats(&after);
+    CHECK(after.mmapped <= before.mmapped + REALLOC_HUGE / 8);
+    tufree(ptr);
+
+    // The sized variant agrees
+    ptr = tumalloc(200);
+    CHECK(ptr != NULL);
+    fill(ptr, 200, 3);
+    ptr = turealloc_sized(ptr, 200, 5000);
+    CHECK(ptr != NULL && filled(ptr, 200, 3));
+    ptr = turealloc_sized(ptr, 5000, 100);
+    CHECK(ptr != NULL && filled(ptr, 100, 3));
+    tufree_sized(ptr, 100);
+    return 0;
+}
+
+/**
+ * Churn small blocks through malloc, realloc and free in a fresh thread,
+ * free them all, and check the stats count none of them as allocated: the
+ * blocks are in the thread's cache, some bigger than the class they are
+ * cached with after a split left slack in them. Then hand blocks to
+ * tufree_sized with half their size, which caches them in smaller classes
+ * and leaves the slack uncounted but no more, take them back out, and give
+ * them back with tufree, after which the count is exact again
+ *
+ * @param arg Where to store 0 if they did, -1 otherwise
+ * @return NULL
+ */
+static void *cached_run(void *arg) {
+    int *result = arg;
+    *result = -1;
+
+    tualloc_stats before, after;
+    tumalloc_stats(&before);
+
+    void *slots[CACHED_SLOTS] = { 0 };
+    unsigned seed = 3;
+    for (int i = 0; i < CACHED_OPS; i++) {
+        int slot = rand_r(&seed) % CACHED_SLOTS;
+        size_t size = 1 + (size_t)(rand_r(&seed) % 500);
+        if (slots[slot] != NULL && rand_r(&seed) % 2 == 0) {
+            void *moved = turealloc(slots[slot], size);
+            if (moved == NULL) {
+                return NULL;
+            }
+            slots[slot] = moved;
+        } else {
+            tufree(slots[slot]);
+            if ((slots[slot] = tumalloc(size)) == NULL) {
+                return NULL;
+            }
+        }
+    }
+    for (int slot = 0; slot < CACHED_SLOTS; slot++) {
+        tufree(slots[slot]);
+    }
+
+    tumalloc_stats(&after);
+    if (after.allocated != before.allocated) {
+        fprintf(stderr, "allocated %zu before, %zu after\n", before.allocated, after.allocated);
+        return NULL;
+    }
+
+    // Asking for the halved sizes takes the very blocks tufree_sized cached back out, the classes are stacks
+    size_t sizes[CACHED_SLOTS];
+    for (int round = 0; round < 2; round++) {
+        for (int slot = 0; slot < CACHED_SLOTS; slot++) {
+            sizes[slot] = round == 0 ? 1 + (size_t)(rand_r(&seed) % 500) : sizes[slot];
+            if ((slots[slot] = tumalloc(sizes[slot])) == NULL) {
+                return NULL;
+            }
+        }
+        for (int slot = 0; slot < CACHED_SLOTS; slot++) {
+            if (round == 0) {
+                sizes[slot] = sizes[slot] / 2 + 1;
+                tufree_sized(slots[slot], sizes[slot]);
+            } else {
+                tufree(slots[slot]);
+            }
+        }
+
+        tumalloc_stats(&after);
+        if (round == 0 ? after.allocated < before.allocated : after.allocated != before.allocated) {
+            fprintf(stderr, "allocated %zu before, %zu after round %d\n", before.allocated, after.allocated, round);
+            return NULL;
+        }
+    }
+
+    *result = 0;
+    return NULL;
+}
+
+/**
+ * Check tumalloc_stats counts cached blocks with their real size
+ *
+ * @return 0 if it did, -1 otherwise
+ */
+static int cached_test(void) {
+    pthread_t id;
+    int result;
+
+    // This thread takes the main heap, so the other one gets a heap of chunks tufree_sized can cache from
+    tufree(tumalloc(1));
+    CHECK(pthread_create(&id, NULL, cached_run, &result) == 0);
+    pthread_join(id, NULL);
+    CHECK(result == 0);
+    return 0;
+}
+
+/**
+ * Ask tucalloc for products that overflow, and check what it hands out is
+ * zeroed even when the memory was used before
+ *
+ * @return 0 if calloc behaved, -1 otherwise
+ */
+static int calloc_test(void) {
+    CHECK(tucalloc(SIZE_MAX / 2 + 1, 2) == NULL);
+    CHECK(tucalloc(2, SIZE_MAX / 2 + 1) == NULL);
+    CHECK(tucalloc(SIZE_MAX, SIZE_MAX) == NULL);
+    CHECK(tucalloc((size_t)1 << 32, (size_t)1 << 32) == NULL);
+    tufree(tucalloc(0, SIZE_MAX));
+    tufree(tucalloc(SIZE_MAX, 0));
+
+    static const size_t sizes[] = { 8, 104, 512, 4000, 100000, 2 << 20 }; // Multiples of 8, asked for as 8-byte elements
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // Dirty blocks of the size first, so the ones calloc gets may be reused
+        for (int round = 0; round < 16; round++) {
+            char *dirty = tumalloc(sizes[i]);
+            CHECK(dirty != NULL);
+            memset(dirty, 0xAA, sizes[i]);
+            tufree(dirty);
+
+            unsigned char *zeroed = tucalloc(sizes[i] / 8, 8);
+            CHECK(zeroed != NULL);
+            for (size_t j = 0; j < sizes[i]; j++) {
+                CHECK(zeroed[j] == 0);
+            }
+            memset(zeroed, 0xAA, sizes[i]);
+            tufree(zeroed);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check every block is 16-byte aligned and explicit alignments are met,
+ * from the heap and from mappings, and bad alignments are refused
+ *
+ * @return 0 if every block was aligned, -1 otherwise
+ */
+static int alignment_test(void) {
+    for (size_t size = 0; size <= 4096; size += 7) {
+        void *ptr = tumalloc(size);
+        CHECK(ptr != NULL && (uintptr_t)ptr % 16 == 0);
+        tufree(ptr);
+    }
+
+    static const size_t sizes[] = { 1, 100, 5000, 300000 };
+    for (size_t align = 16; align <= (1 << 20); align *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            char *ptr = tualigned_alloc(align, sizes[i]);
+            CHECK(ptr != NULL && (uintptr_t)ptr % align == 0);
+            CHECK(tumalloc_usable_size(ptr) >= sizes[i]);
+            memset(ptr, 0x55, sizes[i]);
+            tufree(ptr);
+
+            void *posix = NULL;
+            CHECK(tuposix_memalign(&posix, align, sizes[i]) == 0);
+            CHECK(posix != NULL && (uintptr_t)posix % align == 0);
+            tufree(posix);
+        }
+    }
+
+    CHECK(tualigned_alloc(0, 10) == NULL);
+    CHECK(tualigned_alloc(48, 10) == NULL);
+    void *untouched = &untouched;
+    CHECK(tuposix_memalign(&untouched, 4, 10) == EINVAL);
+    CHECK(tuposix_memalign(&untouched, 24, 10) == EINVAL);
+    CHECK(untouched == &untouched);
+    return 0;
+}
+
+/**
+ * What the soft limit test's low-memory handler frees, and how often it ran
+ */
+typedef struct limit_stash {
+    void *blocks[LIMIT_STASH];
+    int calls;
+} limit_stash;
+
+/**
+ * Low-memory handler that gives back the whole stash
+ *
+ * @param size The size of the failing allocation
+ * @param arg The stash
+ */
+static void limit_release(size_t size, void *arg) {
+    (void)size;
+    limit_stash *stash = arg;
+    stash->calls++;
+    for (int i = 0; i < LIMIT_STASH; i++) {
+        tufree(stash->blocks[i]);
+        stash->blocks[i] = NULL;
+    }
+}
+
+/**
+ * Run into a soft limit from the heaps and from mappings, and check it
+ * held, a mapping that could not grow is intact, trimming lets allocations
+ * through again, and the low-memory handler gets to make room
+ *
+ * @return 0 if the limit held, -1 otherwise
+ */
+static int soft_limit_test(void) {
+    static void *blocks[LIMIT_SLOTS];
+    tualloc_stats stats;
+    tumalloc_stats(&stats);
+    size_t limit = stats.committed + LIMIT_ROOM;
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, limit) == 1);
+
+    int count = 0;
+    while (count < LIMIT_SLOTS && (blocks[count] = tumalloc(4000)) != NULL) {
+        memset(blocks[count], 0x5A, 4000);
+        count++;
+    }
+    tumalloc_stats(&stats);
+    CHECK(count < LIMIT_SLOTS);
+    CHECK(stats.committed <= limit);
+    CHECK(tumalloc(2 * LIMIT_ROOM) == NULL);
+
+    for (int i = 0; i < count; i++) {
+        tufree(blocks[i]);
+    }
+    tumalloc_trim(0);
+
+    // Chunks stay committed once mapped, so make room again; a mapping that can't grow then keeps its contents
+    tumalloc_stats(&stats);
+    CHECK(stats.committed <= limit);
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, stats.committed + LIMIT_ROOM) == 1);
+    char *mapped = tumalloc(LIMIT_ROOM / 2);
+    CHECK(mapped != NULL);
+    fill(mapped, LIMIT_ROOM / 2, 7);
+    CHECK(turealloc(mapped, 4 * LIMIT_ROOM) == NULL);
+    CHECK(filled(mapped, LIMIT_ROOM / 2, 7));
+    tufree(mapped);
+
+    // Room for two more mappings, then the handler has to give back its stash; mappings uncommit as soon as they are freed
+    limit_stash stash = { 0 };
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, 0) == 1);
+    for (int i = 0; i < LIMIT_STASH; i++) {
+        CHECK((stash.blocks[i] = tumalloc(LIMIT_ROOM)) != NULL);
+    }
+    tumalloc_stats(&stats);
+    size_t events = stats.pressure_events;
+    limit = stats.committed + 2 * LIMIT_ROOM + LIMIT_ROOM / 2;
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, limit) == 1);
+    tumalloc_set_low_memory_handler(limit_release, &stash);
+
+    count = 0;
+    while (count < 4 * LIMIT_STASH && (blocks[count] = tumalloc(LIMIT_ROOM)) != NULL) {
+        memset(blocks[count], count, LIMIT_ROOM);
+        count++;
+    }
+    tumalloc_stats(&stats);
+    tumalloc_set_low_memory_handler(NULL, NULL);
+    for (int i = 0; i < count; i++) {
+        tufree(blocks[i]);
+    }
+    CHECK(stash.calls >= 1 && stash.blocks[0] == NULL);
+    CHECK(count >= 2 + LIMIT_STASH && count < 4 * LIMIT_STASH);
+    CHECK(stats.committed <= limit);
+    CHECK(stats.pressure_events > events);
+
+    // A bulk allocation that only fits once the handler gives back its stash still comes up whole
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, 0) == 1);
+    stash.calls = 0;
+    for (int i = 0; i < LIMIT_STASH; i++) {
+        CHECK((stash.blocks[i] = tumalloc(LIMIT_ROOM)) != NULL);
+    }
+    tumalloc_trim(0);
+    tumalloc_stats(&stats);
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, stats.committed + LIMIT_ROOM / 2) == 1);
+    tumalloc_set_low_memory_handler(limit_release, &stash);
+    size_t bulk = (LIMIT_STASH - 1) * LIMIT_ROOM / 8192; // Still fits when each block is a page mapped with a guard page
+    size_t got = tumalloc_bulk(4000, bulk, blocks);
+    tumalloc_set_low_memory_handler(NULL, NULL);
+    tufree_bulk(blocks, got);
+    CHECK(stash.calls >= 1);
+    CHECK(got == bulk);
+
+    CHECK(tumallopt(TU_M_SOFT_LIMIT, 0) == 1);
+    mapped = tumalloc(4 * LIMIT_ROOM);
+    CHECK(mapped != NULL);
+    tufree(mapped);
+    return 0;
+}
+
+/**
+ * A stress thread's state: its live blocks, and the ring the thread before
+ * it hands blocks over through
+ */
+typedef struct stress_thread {
+    pthread_t id;
+    unsigned seed;
+    void *handoff[STRESS_HANDOFF]; // Blocks waiting for this thread to free them, NULL for an empty entry
+    size_t head; // Next entry the sender fills, only the sender touches it
+    size_t tail; // Next entry this thread takes from, only it touches it
+    struct stress_thread *next; // The thread this one hands blocks to
+    int failed;
+} stress_thread;
+
+/**
+ * Put a size and a pattern into a block, so whoever frees it can check nothing overwrote it
+ *
+ * @param ptr The block
+ * @param size Its size, at least sizeof(size_t)
+ */
+static void stamp(void *ptr, size_t size) {
+    memcpy(ptr, &size, sizeof(size));
+    fill((char *)ptr + sizeof(size), size - sizeof(size), (unsigned)size);
+}
+
+/**
+ * Check the stamp of a block and free it
+ *
+ * @param ptr The block
+ * @return 1 if the stamp was intact, 0 otherwise
+ */
+static int check_and_free(void *ptr) {
+    size_t size;
+    memcpy(&size, ptr, sizeof(size));
+    int ok = filled((char *)ptr + sizeof(size), size - sizeof(size), (unsigned)size);
+    tufree(ptr);
+    return ok;
+}
+
+/**
+ * Allocate, check and free random blocks, handing some to the next thread to free
+ *
+ * @param arg The stress_thread
+ * @return NULL
+ */
+static void *stress_run(void *arg) {
+    stress_thread *t = arg;
+    void *slots[STRESS_SLOTS] = { 0 };
+
+    for (int op = 0; op < STRESS_OPS; op++) {
+        // Free what the thread before handed over
+        void *given = __atomic_load_n(&t->handoff[t->tail], __ATOMIC_ACQUIRE);
+        if (given != NULL) {
+            t->failed |= !check_and_free(given);
+            __atomic_store_n(&t->handoff[t->tail], NULL, __ATOMIC_RELEASE);
+            t->tail = (t->tail + 1) & (STRESS_HANDOFF - 1);
+        }
+
+        int slot = rand_r(&t->seed) % STRESS_SLOTS;
+        if (slots[slot] != NULL) {
+            stress_thread *to = t->next;
+            if (rand_r(&t->seed) % 2 == 0 && __atomic_load_n(&to->handoff[to->head], __ATOMIC_ACQUIRE) == NULL) {
+                __atomic_store_n(&to->handoff[to->head], slots[slot], __ATOMIC_RELEASE);
+                to->head = (to->head + 1) & (STRESS_HANDOFF - 1);
+            } else {
+                t->failed |= !check_and_free(slots[slot]);
+            }
+        }
+
+        size_t size = sizeof(size_t) + (size_t)(rand_r(&t->seed) % 16 == 0 ? rand_r(&t->seed) % 70000
+                                                                             : rand_r(&t->seed) % 300);
+        slots[slot] = tumalloc(size);
+        if (slots[slot] == NULL) {
+            t->failed = 1;
+            break;
+        }
+        stamp(slots[slot], size);
+    }
+
+    for (int slot = 0; slot < STRESS_SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            t->failed |= !check_and_free(slots[slot]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run threads that allocate, free, and free each other's blocks, checking
+ * no block was handed out twice or written over while live
+ *
+ * @return 0 if every block kept its contents, -1 otherwise
+ */
+static int stress_test(void) {
+    static stress_thread threads[STRESS_THREADS];
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        threads[i].seed = (unsigned)i + 1;
+        threads[i].next = &threads[(i + 1) % STRESS_THREADS];
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        CHECK(pthread_create(&threads[i].id, NULL, stress_run, &threads[i]) == 0);
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i].id, NULL);
+    }
+
+    // Whatever is still in the rings was handed over after its receiver stopped
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        for (int j = 0; j < STRESS_HANDOFF; j++) {
+            if (threads[i].handoff[j] != NULL) {
+                threads[i].failed |= !check_and_free(threads[i].handoff[j]);
+            }
+        }
+        CHECK(!threads[i].failed);
+    }
+
+    // The heaps are still consistent after all of that
+    layout l;
+    CHECK(read_layout(&l) == 0);
+    int result = check_layout(&l);
+    tufree(l.entries);
+    return result;
+}
+
+/**
+ * A list node, what most of the cases below build their data out of
+ */
+typedef struct node {
+    int data;
+    struct node *next;
+} node;
+
+/**
+ * Free every node of a list with tufree_sized
+ *
+ * @param list The list
+ */
+static void list_free(node *list) {
+    while (list != NULL) {
+        node *next = list->next;
+        tufree_sized(list, sizeof(node));
+        list = next;
+    }
+}
+
+/**
+ * Build a list of count nodes holding 0 to count - 1 with bulk allocation
+ *
+ * @param count How many nodes the list gets
+ * @return The list, NULL if count is 0 or memory ran out
+ */
+static node *list_new_bulk(int count) {
+    void *batch[LIST_BATCH];
+    node *list = NULL;
+
+    // Built back to front, so data counts up from the head
+    for (int i = count; i > 0;) {
+        size_t want = i < LIST_BATCH ? (size_t)i : LIST_BATCH;
+        size_t got = tumalloc_bulk(sizeof(node), want, batch);
+        for (size_t j = 0; j < got; j++) {
+            node *n = batch[j];
+            n->data = --i;
+            n->next = list;
+            list = n;
+        }
+        if (got < want) {
+            list_free(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+/**
+ * Free every node of a list with bulk frees
+ *
+ * @param list The list
+ */
+static void list_free_bulk(node *list) {
+    void *batch[LIST_BATCH];
+    size_t count = 0;
+    while (list != NULL) {
+        batch[count++] = list;
+        list = list->next;
+        if (count == LIST_BATCH || list == NULL) {
+            tufree_bulk(batch, count);
+            count = 0;
+        }
+    }
+}
+
+/**
+ * A list handed from a producer thread to a consumer thread
+ */
+typedef struct list_handoff {
+    pthread_mutex_t lock; // Guards everything below
+    pthread_cond_t ready; // Signaled when nodes are added or the producer is done
+    node *list; // Nodes not yet taken by the consumer
+    int done; // Set once the producer has added all its nodes
+    long sum; // Sum of the data the consumer has seen
+} list_handoff;
+
+/**
+ * Allocate nodes and hand them to the consumer one at a time
+ *
+ * @param arg The list_handoff shared with the consumer
+ * @return NULL
+ */
+static void *handoff_producer(void *arg) {
+    list_handoff *h = arg;
+    for (int i = 0; i < HANDOFF_NODES; i++) {
+        node *n = tumalloc(sizeof(node));
+        if (n == NULL) {
+            break;
+        }
+        n->data = i;
+
+        pthread_mutex_lock(&h->lock);
+        n->next = h->list;
+        h->list = n;
+        pthread_cond_signal(&h->ready);
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->done = 1;
+    pthread_cond_signal(&h->ready);
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+/**
+ * Take whatever the producer has handed over and free it on this thread
+ *
+ * @param arg The list_handoff shared with the producer
+ * @return NULL
+ */
+static void *handoff_consumer(void *arg) {
+    list_handoff *h = arg;
+    for (;;) {
+        pthread_mutex_lock(&h->lock);
+        while (h->list == NULL && !h->done) {
+            pthread_cond_wait(&h->ready, &h->lock);
+        }
+        node *list = h->list;
+        int done = h->done;
+        h->list = NULL;
+        pthread_mutex_unlock(&h->lock);
+
+        // Every node was allocated by the producer, so these are all cross-thread frees
+        for (node *curr = list; curr != NULL; curr = curr->next) {
+            h->sum += curr->data;
+        }
+        list_free_bulk(list);
+
+        if (done && list == NULL) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Pass list nodes from producer threads to consumer threads that free them
+ *
+ * @return 0 if every node arrived intact, -1 otherwise
+ */
+static int handoff_test(void) {
+    pthread_t producers[HANDOFF_PAIRS];
+    pthread_t consumers[HANDOFF_PAIRS];
+    static list_handoff pairs[HANDOFF_PAIRS];
+
+    for (int i = 0; i < HANDOFF_PAIRS; i++) {
+        pthread_mutex_init(&pairs[i].lock, NULL);
+        pthread_cond_init(&pairs[i].ready, NULL);
+        CHECK(pthread_create(&consumers[i], NULL, handoff_consumer, &pairs[i]) == 0);
+        CHECK(pthread_create(&producers[i], NULL, handoff_producer, &pairs[i]) == 0);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < HANDOFF_PAIRS; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+
+        // Each producer hands over 0 + 1 + ... + (HANDOFF_NODES - 1)
+        failed |= pairs[i].sum != (long)HANDOFF_NODES * (HANDOFF_NODES - 1) / 2;
+        pthread_mutex_destroy(&pairs[i].lock);
+        pthread_cond_destroy(&pairs[i].ready);
+    }
+    CHECK(!failed);
+    return 0;
+}
+
+/**
+ * Build a list with bulk allocation and free it with bulk frees
+ *
+ * @return 0 if every node was distinct and kept its data, -1 otherwise
+ */
+static int bulk_test(void) {
+    node *list = list_new_bulk(BULK_NODES);
+    CHECK(list != NULL);
+
+    int i = 0;
+    for (node *curr = list; curr != NULL; curr = curr->next, i++) {
+        CHECK(curr->data == i);
+    }
+    CHECK(i == BULK_NODES);
+    list_free_bulk(list);
+
+    // Big blocks take the per-object path and NULLs are skipped
+    void *blocks[4] = { NULL };
+    CHECK(tumalloc_bulk(512 * 1024, 3, blocks) == 3);
+    for (int j = 0; j < 3; j++) {
+        memset(blocks[j], j, 512 * 1024);
+    }
+    tufree_bulk(blocks, 4);
+    return 0;
+}
+
+/**
+ * Grow small buffers with turealloc_sized and free them with tufree_sized
+ *
+ * @return 0 if every buffer kept its contents, -1 otherwise
+ */
+static int sized_test(void) {
+    for (int i = 0; i < SIZED_ROUNDS; i++) {
+        size_t size = 1 + i % 40;
+        unsigned char *buf = tumalloc(size);
+        CHECK(buf != NULL);
+        memset(buf, i & 0xff, size);
+
+        // Grows a byte at a time, most steps stay within the block
+        for (size_t grown = size + 1; grown <= size + 100; grown++) {
+            buf = turealloc_sized(buf, grown - 1, grown);
+            CHECK(buf != NULL);
+            buf[grown - 1] = i & 0xff;
+        }
+
+        for (size_t j = 0; j < size + 100; j++) {
+            CHECK(buf[j] == (i & 0xff));
+        }
+        tufree_sized(buf, size + 100);
+    }
+    return 0;
+}
+
+/**
+ * Build a list out of a pool, recycle part of it, and drop it in one go
+ *
+ * @return 0 if the list held the expected data and the freed node was reused, -1 otherwise
+ */
+static int pool_test(void) {
+    tupool *pool = tupool_create(sizeof(node), _Alignof(node));
+    CHECK(pool != NULL);
+
+    node *list = NULL;
+    for (int i = POOL_NODES - 1; i >= 0; i--) {
+        node *n = tupool_alloc(pool);
+        CHECK(n != NULL);
+        n->data = i;
+        n->next = list;
+        list = n;
+    }
+
+    // Give the first node back and reuse it for a replacement with the same data
+    node *first = list;
+    list = first->next;
+    tupool_free(pool, first);
+
+    node *replacement = tupool_alloc(pool);
+    CHECK(replacement == first);
+    replacement->data = 0;
+    replacement->next = list;
+    list = replacement;
+
+    long sum = 0;
+    for (node *curr = list; curr != NULL; curr = curr->next) {
+        sum += curr->data;
+    }
+
+    // Destroying the pool releases every node at once
+    tupool_destroy(pool);
+    CHECK(sum == (long)POOL_NODES * (POOL_NODES - 1) / 2);
+    return 0;
+}
+
+/**
+ * Serve requests from an arena, rewinding scratch data and resetting between requests
+ *
+ * @return 0 if every request saw its own data and chunks were reused, -1 otherwise
+ */
+static int arena_test(void) {
+    tuarena *arena = tuarena_create(0);
+    CHECK(arena != NULL);
+
+    void *first_start = NULL;
+    for (int r = 0; r < ARENA_REQUESTS; r++) {
+        void *start = tuarena_alloc(arena, 1);
+        if (r == 0) {
+            first_start = start;
+        }
+        CHECK(start != NULL && start == first_start);
+
+        // Scratch space that is dropped before the list is built
+        tuarena_savepoint mark = tuarena_mark(arena);
+        CHECK(tuarena_alloc(arena, 4096) != NULL);
+        tuarena_rewind(arena, mark);
+
+        node *list = NULL;
+        for (int i = 0; i < ARENA_NODES; i++) {
+            node *n = tuarena_alloc(arena, sizeof(node));
+            CHECK(n != NULL);
+            n->data = r;
+            n->next = list;
+            list = n;
+        }
+
+        long sum = 0;
+        for (node *curr = list; curr != NULL; curr = curr->next) {
+            sum += curr->data;
+        }
+        CHECK(sum == (long)r * ARENA_NODES);
+
+        // End of the request: everything goes at once, chunks stay cached
+        tuarena_reset(arena);
+    }
+
+    tuarena_destroy(arena);
+    return 0;
+}
+
+/**
+ * Allocate a burst, free it, and check the heap gave the memory back
+ *
+ * @return 0 if the reserved bytes went down after trimming, -1 otherwise
+ */
+static int trim_test(void) {
+    static void *blocks[TRIM_BLOCKS];
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        blocks[i] = tumalloc(TRIM_BLOCK_SIZE);
+        CHECK(blocks[i] != NULL);
+        memset(blocks[i], i, TRIM_BLOCK_SIZE);
+    }
+
+    tualloc_stats peak;
+    tumalloc_stats(&peak);
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        tufree(blocks[i]);
+    }
+
+    // Frees only give memory back once in a while, trimming does it right now; a guard page build mapped and unmapped every block
+    CHECK(tumalloc_trim(0) == 1 || peak.mmapped >= TRIM_BLOCKS * TRIM_BLOCK_SIZE);
+
+    tualloc_stats after;
+    tumalloc_stats(&after);
+    CHECK(after.reserved + TRIM_BLOCKS * TRIM_BLOCK_SIZE / 2 <= peak.reserved);
+    return 0;
+}
+
+/**
+ * Build a list in a heap of its own, free part of it, and drop the rest with the heap
+ *
+ * @return 0 if the list kept its data and destroying the heap gave its memory back, -1 otherwise
+ */
+static int heap_test(void) {
+    tualloc_stats before;
+    tumalloc_stats(&before);
+
+    tuheap *heap = tuheap_create();
+    CHECK(heap != NULL);
+
+    node *list = NULL;
+    for (int i = 0; i < HEAP_NODES; i++) {
+        node *n = tuheap_malloc(heap, sizeof(node));
+        CHECK(n != NULL);
+        n->data = i;
+        n->next = list;
+        list = n;
+    }
+    char *large = tuheap_malloc(heap, HEAP_LARGE);
+    char *kept = tuheap_malloc(heap, HEAP_LARGE);
+    CHECK(large != NULL && kept != NULL);
+    memset(large, 1, HEAP_LARGE);
+    memset(kept, 2, HEAP_LARGE);
+
+    // Every other node and one large block go back one by one, the rest with the heap
+    int expected = HEAP_NODES - 1;
+    for (node *curr = list; curr != NULL && curr->next != NULL; curr = curr->next, expected -= 2) {
+        CHECK(curr->data == expected);
+        node *gone = curr->next;
+        curr->next = gone->next;
+        tuheap_free(heap, gone);
+    }
+    tuheap_free(heap, large);
+
+    tualloc_stats during;
+    tumalloc_stats(&during);
+    tuheap_destroy(heap);
+    tualloc_stats after;
+    tumalloc_stats(&after);
+
+    CHECK(during.reserved >= before.reserved + HEAP_LARGE);
+    CHECK(after.reserved + HEAP_LARGE <= during.reserved);
+    return 0;
+}
+
+/**
+ * Dump the heap layout with holes punched in it, and check the blocks of
+ * each region tile it and the ones still allocated show up as such
+ *
+ * @return 0 if the map is consistent, -1 otherwise
+ */
+static int layout_test(void) {
+    void *blocks[LAYOUT_BLOCKS];
+    for (int i = 0; i < LAYOUT_BLOCKS; i++) {
+        blocks[i] = tumalloc(100 + i);
+        CHECK(blocks[i] != NULL);
+    }
+    for (int i = 0; i < LAYOUT_BLOCKS; i += 2) {
+        tufree(blocks[i]);
+    }
+
+    layout l;
+    CHECK(read_layout(&l) == 0);
+    int result = check_layout(&l);
+
+    // A block still allocated is in the map as used, unless it has a mapping of its own and no region
+    for (int i = 1; i < LAYOUT_BLOCKS && result == 0; i += 2) {
+        if (find_region(&l, blocks[i]) < 0) {
+            continue;
+        }
+        uint64_t header = (uintptr_t)blocks[i] - HEADER;
+        int used = 0;
+        for (size_t j = 0; j < l.count; j++) {
+            used |= l.entries[j].addr == header && l.entries[j].kind == TU_LAYOUT_USED;
+        }
+        result = used ? 0 : -1;
+    }
+
+    tufree(l.entries);
+    for (int i = 1; i < LAYOUT_BLOCKS; i += 2) {
+        tufree(blocks[i]);
+    }
+    CHECK(result == 0);
+    return 0;
+}
+
+/**
+ * Dump the heap profile to a scratch file and read how many live samples it starts with
+ *
+ * @return The count from its header line, -1 if the dump failed or has no header
+ */
+static long profile_samples(void) {
+    char path[] = "/tmp/tualloc_testXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+
+    char header[64] = { 0 };
+    long count = -1;
+    if (tumalloc_profile_dump(fd) != 0 || pread(fd, header, sizeof(header) - 1, 0) <= 0
+            || sscanf(header, "heap profile: %ld:", &count) != 1) {
+        count = -1;
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * Sample every allocation, free half of them, and check the profile only keeps the live ones
+ *
+ * @return 0 if the dumps counted the blocks still allocated, -1 otherwise
+ */
+static int profile_test(void) {
+    // A mean of one byte samples every allocation
+    CHECK(tumalloc_profile_start(1) == 0);
+
+    void *blocks[PROFILE_BLOCKS];
+    for (int i = 0; i < PROFILE_BLOCKS; i++) {
+        blocks[i] = tumalloc(1000);
+    }
+    long all = profile_samples();
+
+    for (int i = 0; i < PROFILE_BLOCKS / 2; i++) {
+        tufree(blocks[i]);
+    }
+    long half = profile_samples();
+
+    for (int i = PROFILE_BLOCKS / 2; i < PROFILE_BLOCKS; i++) {
+        tufree(blocks[i]);
+    }
+    CHECK(tumalloc_profile_stop() == 0);
+
+    CHECK(all >= PROFILE_BLOCKS);
+    CHECK(half == all - PROFILE_BLOCKS / 2);
+    return 0;
+}
+
+/**
+ * Keep many cache-line and page aligned buffers live at once, from the heap
+ * and from their own mappings
+ *
+ * @return 0 if every buffer was aligned and kept its data, -1 otherwise
+ */
+static int aligned_test(void) {
+    static const size_t alignments[] = { 64, 4096 };
+    static const size_t sizes[] = { 24, 1000, 300 * 1024 };
+    void *blocks[ALIGNED_BLOCKS];
+
+    for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (int i = 0; i < ALIGNED_BLOCKS; i++) {
+                blocks[i] = tualigned_alloc(alignments[a], sizes[s]);
+                CHECK(blocks[i] != NULL && (uintptr_t)blocks[i] % alignments[a] == 0);
+                memset(blocks[i], i, sizes[s]);
+            }
+
+            // The aligned pointer itself goes back to tufree
+            for (int i = 0; i < ALIGNED_BLOCKS; i++) {
+                unsigned char *bytes = blocks[i];
+                CHECK(bytes[0] == (unsigned char)i && bytes[sizes[s] - 1] == (unsigned char)i);
+                tufree(blocks[i]);
+            }
+        }
+    }
+
+    void *ptr = NULL;
+    CHECK(tuposix_memalign(&ptr, 3 * sizeof(void *), 64) == EINVAL && ptr == NULL);
+    CHECK(tuposix_memalign(&ptr, 256, 64) == 0 && (uintptr_t)ptr % 256 == 0);
+    tufree(ptr);
+    return 0;
+}
+
+/**
+ * Place a list on NUMA node 0, which every machine has
+ *
+ * @return 0 if the nodes kept their data and bad nodes were refused, -1 otherwise
+ */
+static int numa_test(void) {
+    CHECK(tumalloc_onnode(sizeof(node), -1) == NULL);
+    CHECK(tumalloc_onnode(sizeof(node), TU_MAX_NODES) == NULL);
+
+    node *list = NULL;
+    for (int i = 0; i < 100; i++) {
+        node *n = tumalloc_onnode(sizeof(node), 0);
+        CHECK(n != NULL);
+        n->data = i;
+        n->next = list;
+        list = n;
+    }
+
+    int i = 99;
+    for (node *curr = list; curr != NULL; curr = curr->next, i--) {
+        CHECK(curr->data == i);
+    }
+    list_free(list);
+
+    // Too big for a chunk, so a mapping bound to the node
+    char *big = tumalloc_onnode(2 * 1024 * 1024, 0);
+    CHECK(big != NULL);
+    memset(big, 1, 2 * 1024 * 1024);
+    tufree(big);
+    return 0;
+}
+
+/**
+ * A test case ctest can run on its own
+ */
+typedef struct test_case {
+    const char *name;
+    int (*run)(void);
+} test_case;
+
+static const test_case TESTS[] = {
+    { "split_coalesce", split_coalesce_test },
+    { "realloc", realloc_test },
+    { "calloc", calloc_test },
+    { "cached", cached_test },
+    { "alignment", alignment_test },
+    { "soft_limit", soft_limit_test },
+    { "handoff", handoff_test },
+    { "bulk", bulk_test },
+    { "sized", sized_test },
+    { "pool", pool_test },
+    { "arena", arena_test },
+    { "trim", trim_test },
+    { "heap", heap_test },
+    { "layout", layout_test },
+    { "profile", profile_test },
+    { "aligned", aligned_test },
+    { "numa", numa_test },
+    { "stress", stress_test },
+};
+
+/**
+ * Run the named test cases, or all of them
+ *
+ * usage: tualloc_tests [test...]
+ *
+ * @return 0 if every case passed, 1 otherwise
+ */
+int main(int argc, char **argv) {
+    for (int j = 1; j < argc; j++) {
+        size_t i = 0;
+        while (i < sizeof(TESTS) / sizeof(TESTS[0]) && strcmp(argv[j], TESTS[i].name) != 0) {
+            i++;
+        }
+        if (i == sizeof(TESTS) / sizeof(TESTS[0])) {
+            fprintf(stderr, "unknown test: %s\n", argv[j]);
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++) {
+        int selected = argc == 1;
+        for (int j = 1; j < argc; j++) {
+            selected |= strcmp(argv[j], TESTS[i].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        int result = TESTS[i].run();
+        printf("%-16s %s\n", TESTS[i].name, result == 0 ? "ok" : "FAILED");
+        failed |= result != 0;
+    }
+    return failed;
+}